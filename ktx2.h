@@ -0,0 +1,54 @@
+// KTX2 container layout shared by the engine's texture loader and the
+// offline texture cooker (tools/texcook.c). Covers what cooked textures use:
+// a single 2D image with a mip chain and no supercompression.
+//
+// File layout: header, one level index entry per mip level, data format
+// descriptor, then the mip levels' data from the smallest level to the
+// largest. All values are little-endian.
+#ifndef KTX2_H
+#define KTX2_H
+
+#include <stdint.h>
+
+#define KTX2_IDENTIFIER "\xABKTX 20\xBB\r\n\x1A\n"
+#define KTX2_IDENTIFIER_SIZE 12
+
+// VkFormat values of the formats the cooker writes, so the cooker itself
+// does not depend on the Vulkan headers
+#define KTX2_FORMAT_BC1_RGB_UNORM 131
+#define KTX2_FORMAT_BC3_UNORM 137
+#define KTX2_FORMAT_BC7_UNORM 145
+
+struct Ktx2Header
+{
+    uint8_t identifier[KTX2_IDENTIFIER_SIZE];
+    uint32_t vkFormat;
+    uint32_t typeSize;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    uint32_t pixelDepth;
+    uint32_t layerCount;
+    uint32_t faceCount;
+    uint32_t levelCount;
+    uint32_t supercompressionScheme;
+
+    uint32_t dfdByteOffset;
+    uint32_t dfdByteLength;
+    uint32_t kvdByteOffset;
+    uint32_t kvdByteLength;
+    uint64_t sgdByteOffset;
+    uint64_t sgdByteLength;
+};
+
+// Follows the header, entry 0 is the full resolution level
+struct Ktx2LevelIndex
+{
+    uint64_t byteOffset;
+    uint64_t byteLength;
+    uint64_t uncompressedByteLength;
+};
+
+_Static_assert(sizeof(struct Ktx2Header) == 80, "KTX2 header must be packed");
+_Static_assert(sizeof(struct Ktx2LevelIndex) == 24, "KTX2 level index must be packed");
+
+#endif
@@ -4,19 +4,53 @@
 // From VulkanSDK examples
 #include "linmath.h"
 
+// stb_image allocates through these so a decode can write its output
+// straight into staging memory, see decodeMalloc
+void* decodeMalloc(size_t size);
+void* decodeRealloc(void* p, size_t size);
+void decodeFree(void* p);
+#define STBI_MALLOC(size) decodeMalloc(size)
+#define STBI_REALLOC(p, size) decodeRealloc(p, size)
+#define STBI_FREE(p) decodeFree(p)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+// Cooked texture container, shared with tools/texcook.c
+#include "ktx2.h"
+// Asset pack layout, shared with tools/pack.c
+#include "pack.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <spawn.h>
+#include <linux/io_uring.h>
+
+// Passed on to shader compiler children
+extern char** environ;
 
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 const _Bool validationEnabled = 1;
+// Number of frames the CPU may record ahead of the GPU by default
+const uint32_t defaultFramesInFlight = 2;
+// Most frames --frames-in-flight accepts, each one has its own resources
+const uint32_t maxFramesInFlight = 16;
 
 struct Vertex
 {
@@ -70,6 +104,8 @@ struct QueueFamilyIndices
 {
     int graphicsFamily;
     int presentFamily;
+    // Transfer-only family if the device has one, else graphicsFamily
+    int transferFamily;
 };
 
 struct SwapChainSupportDetails
@@ -82,11 +118,641 @@ struct SwapChainSupportDetails
 };
 void freeSwapChainSupportDetails(struct SwapChainSupportDetails* details);
 
+// Maximum number of timed passes per frame, including the whole frame
+#define PROFILER_MAX_PASSES 16
+
+struct GpuPassTiming
+{
+    const char* name;
+    double milliseconds;
+    double totalMilliseconds;
+    uint32_t samples;
+};
+
+// Timestamp queries per frame in flight, read back once the frame's fence
+// has signalled so collecting results never stalls
+struct GpuProfiler
+{
+    _Bool supported;
+    VkQueryPool queryPool;
+    float timestampPeriod;
+    uint64_t timestampMask;
+
+    // Passes recorded into each frame in flight, pending readback
+    uint32_t* framePassCounts;
+    const char** framePassNames;
+
+    // Latest results, accumulated by name across frames
+    uint32_t passCount;
+    struct GpuPassTiming passes[PROFILER_MAX_PASSES];
+
+    // Periodic report to stderr
+    _Bool reportEnabled;
+    _Bool reportJson;
+    double reportInterval;
+    double lastReport;
+};
+
+// How a resource's memory is accessed, findMemType ranks memory types by it
+enum GpuMemoryUsage
+{
+    // Only accessed by the GPU
+    GPU_MEMORY_DEVICE,
+    // Written once by the CPU and read once by a transfer
+    GPU_MEMORY_STAGING,
+    // Rewritten by the CPU every frame and read directly by shaders
+    GPU_MEMORY_DYNAMIC,
+    // Written by the GPU and read back by the CPU
+    GPU_MEMORY_READBACK
+};
+
+// Preferred size of a device memory block, shrunk for small heaps
+#define GPU_BLOCK_SIZE (64ull * 1024 * 1024)
+
+// Contiguous range of a memory block, either free or backing one resource.
+// The chunks of a block form a list in offset order and adjacent free
+// chunks are always merged.
+struct GpuChunk
+{
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    _Bool free;
+    // Buffers and linear images, as opposed to optimal tiling images
+    _Bool linear;
+    struct GpuChunk* prev;
+    struct GpuChunk* next;
+};
+
+// One vkAllocateMemory, carved into chunks
+struct GpuBlock
+{
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t memoryType;
+    // Persistently mapped for host visible memory types, otherwise NULL
+    char* mapped;
+    // Holds a single large resource and is freed along with it
+    _Bool dedicated;
+    uint32_t allocationCount;
+    VkDeviceSize usedBytes;
+    struct GpuChunk* chunks;
+};
+
+// Memory bound to a buffer or image, mapped is NULL unless the memory type
+// is host visible
+struct GpuAllocation
+{
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    void* mapped;
+    struct GpuBlock* block;
+    struct GpuChunk* chunk;
+};
+
+struct GpuAllocatorStats
+{
+    uint32_t blockCount;
+    uint32_t allocationCount;
+    VkDeviceSize blockBytes;
+    VkDeviceSize usedBytes;
+};
+
+// Sub-allocates buffers and images from large blocks per memory type, so the
+// number of live vkAllocateMemory calls stays far below
+// maxMemoryAllocationCount
+struct GpuAllocator
+{
+    VkDeviceSize bufferImageGranularity;
+    uint32_t maxBlockCount;
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+    struct GpuBlock** blocks;
+};
+
+// One mip level of one array layer of a texture in host memory
+struct TextureSubresourceData
+{
+    uint32_t mipLevel;
+    uint32_t arrayLayer;
+    uint32_t width;
+    uint32_t height;
+    // Bytes between the starts of consecutive rows, rows of blocks for
+    // block-compressed formats
+    VkDeviceSize rowPitch;
+    const void* data;
+};
+
+// Read-only view of a file's contents, see openFileView and openAsset.
+// closeFileView releases the mapping or buffer backing it, views into the
+// asset pack have neither.
+struct FileView
+{
+    const char* data;
+    size_t size;
+    void* mapping;
+    size_t mappingSize;
+    void* buffer;
+};
+
+// Mapped asset pack, see pack.h
+struct AssetPack
+{
+    struct FileView file;
+    uint32_t entryCount;
+    uint32_t bucketCount;
+    const struct PackEntry* entries;
+    const uint32_t* buckets;
+    const char* names;
+    uint64_t nameSize;
+};
+
+// Access pattern hints for a file view, combined as a mask
+#define FILE_ACCESS_NORMAL 0
+#define FILE_ACCESS_SEQUENTIAL 0x1
+#define FILE_ACCESS_RANDOM 0x2
+#define FILE_ACCESS_PREFETCH 0x4
+
+// Staging bytes reserved past each image decoded in place, stb_image's JPEG
+// decoder allocates one more byte than the image needs
+#define DECODE_TARGET_PADDING 16
+
+// One image for the decode pool. The worker decodes the mapped file into dst,
+// staging memory sized from the image header, followed by mipLevels-1 box
+// filtered levels when the GPU can't blit them.
+struct DecodeJob
+{
+    const char* path;
+    struct FileView file;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipLevels;
+    unsigned char* dst;
+    _Bool failed;
+};
+
+// Most workers --decode-threads accepts
+#define MAX_DECODE_THREADS 256
+
+// Worker threads decoding images in parallel. The main thread opens a batch
+// of a known size, queues jobs as their data becomes available and sleeps
+// until the last one has finished.
+struct DecodePool
+{
+    uint32_t threadCount;
+    pthread_t* threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t jobsReady;
+    pthread_cond_t jobsDone;
+    struct DecodeJob** jobs;
+    uint32_t jobCount;
+    uint32_t nextJob;
+    uint32_t pendingJobs;
+    _Bool shutdown;
+};
+
+// Queue depth of the io_uring, and threads reading when it's unavailable
+#define ASYNC_IO_QUEUE_DEPTH 64
+#define ASYNC_IO_THREADS 4
+
+// Asynchronous read of size bytes at offset of fd into buffer
+struct IoRequest
+{
+    int fd;
+    char* buffer;
+    size_t size;
+    uint64_t offset;
+    void* userData;
+
+    // Progress, error is an errno value once the read has failed
+    size_t done;
+    int error;
+    struct iovec iov;
+    struct IoRequest* next;
+};
+
+// Reads through an io_uring, or a pool of threads calling pread where the
+// kernel doesn't offer one
+struct AsyncIo
+{
+    _Bool uring;
+    // Submitted and not yet returned by waitRead
+    uint32_t outstanding;
+    // Requests not started yet, waiting for ring space or an I/O thread
+    struct IoRequest* queue;
+    struct IoRequest* queueTail;
+
+    // io_uring, set up with raw syscalls
+    int ringFd;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    uint32_t* sqTail;
+    uint32_t sqMask;
+    uint32_t* sqArray;
+    uint32_t sqEntries;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t cqMask;
+    struct io_uring_cqe* cqes;
+    // Entries written but not submitted yet, and requests in the ring
+    uint32_t sqPending;
+    uint32_t ringUsed;
+
+    // Thread fallback
+    uint32_t threadCount;
+    pthread_t* threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t requestsReady;
+    pthread_cond_t requestsDone;
+    struct IoRequest* completed;
+    _Bool shutdown;
+};
+
+// Image file loaded by loadTextures, left in SHADER_READ_ONLY_OPTIMAL
+struct TextureLoad
+{
+    const char* path;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipLevels;
+    VkImage image;
+    struct GpuAllocation memory;
+};
+
+// What prepareTextureDecode needs to stage one loadTextures batch
+struct TextureLoadBatch
+{
+    struct TextureLoad* textures;
+    struct StagingResource* staging;
+    _Bool gpuMipmaps;
+};
+
+// A texture's whole mip chain in host memory, either mapped from a cooked
+// KTX2 file or decoded and downsampled on the CPU
+struct TextureSource
+{
+    VkFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipLevels;
+    uint32_t blockBytes;
+    uint32_t blockDim;
+    struct TextureSubresourceData* levels;
+
+    struct FileView file;
+    unsigned char* pixels;
+    unsigned char* mipPixels;
+};
+
+// Staging resource kept alive until the upload batch reading it completes
+struct StagingResource
+{
+    VkBuffer buffer;
+    VkImage image;
+    struct GpuAllocation memory;
+};
+
+// Startup transfers recorded into a single command buffer
+struct UploadBatch
+{
+    _Bool active;
+    VkCommandBuffer commandBuffer;
+    uint32_t stagingCount;
+    uint32_t stagingCapacity;
+    struct StagingResource* staging;
+};
+
+// Maximum number of async uploads the graphics queue takes ownership of in a
+// single frame, the rest wait for the next one
+#define MAX_UPLOAD_ACQUIRES_PER_FRAME 32
+
+enum AsyncUploadState
+{
+    UPLOAD_SUBMITTED,
+    UPLOAD_ACQUIRED
+};
+
+// An image copy running on the transfer queue. The barrier is recorded
+// twice: as a release on the transfer queue and as an acquire in the first
+// frame that waits on the upload's semaphore.
+struct AsyncUpload
+{
+    enum AsyncUploadState state;
+    uint32_t acquireFrame;
+    uint64_t serial;
+    VkCommandBuffer commandBuffer;
+    VkSemaphore semaphore;
+    VkFence fence;
+    VkBuffer stagingBuffer;
+    struct GpuAllocation stagingBufferMemory;
+
+    VkImageMemoryBarrier imageBarrier;
+    VkPipelineStageFlags dstStage;
+};
+
+// Uploads in flight on the transfer queue
+struct TransferContext
+{
+    VkCommandPool commandPool;
+    uint32_t uploadCount;
+    uint32_t uploadCapacity;
+    struct AsyncUpload* uploads;
+    uint64_t uploadSerial;
+
+    // Semaphores the frame being recorded has to wait on
+    uint32_t frameWaitCount;
+    VkSemaphore frameWaitSemaphores[MAX_UPLOAD_ACQUIRES_PER_FRAME];
+    VkPipelineStageFlags frameWaitStages[MAX_UPLOAD_ACQUIRES_PER_FRAME];
+};
+
+// Levels up to this size stay resident for as long as a texture is loaded
+#define STREAMING_TAIL_SIZE 64
+// Residency changes started per frame, each uploads all of its levels
+#define STREAMING_CHANGES_PER_FRAME 2
+// The mesh shows each streamed texture in turn for this many frames
+#define STREAMING_FRAMES_PER_TEXTURE 120
+// Usage of the images streamTextureLevel creates and measureStreamedTexture
+// sizes
+#define STREAMED_IMAGE_USAGE \
+    (VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT)
+
+// Texture whose sharper mip levels are loaded and dropped at runtime. The
+// image only holds levels residentLevel to mipLevels-1 of the source.
+struct StreamedTexture
+{
+    struct TextureSource source;
+    // Device memory an image holding levels i to mipLevels-1 takes
+    VkDeviceSize* levelBytes;
+    uint32_t tailLevel;
+    uint32_t residentLevel;
+    uint32_t desiredLevel;
+    uint64_t lastUsedFrame;
+    VkImage image;
+    struct GpuAllocation memory;
+    VkImageView view;
+
+    // Residency change waiting for a frame to acquire its upload
+    _Bool pending;
+    uint64_t pendingUpload;
+    uint32_t pendingLevel;
+    VkImage pendingImage;
+    struct GpuAllocation pendingMemory;
+    VkImageView pendingView;
+};
+
+// Image replaced by a residency change, freed once no frame samples it
+struct RetiredTexture
+{
+    VkImage image;
+    struct GpuAllocation memory;
+    VkImageView view;
+    uint64_t frame;
+};
+
+// Keeps streamed textures' device memory, including images still being
+// uploaded or retired, within budget bytes
+struct TextureStreamer
+{
+    _Bool enabled;
+    VkDeviceSize budget;
+    VkDeviceSize residentBytes;
+    uint64_t frame;
+    uint32_t pathCount;
+    const char** paths;
+    uint32_t textureCount;
+    struct StreamedTexture* textures;
+    // The one texture the mesh is drawn with
+    uint32_t activeTexture;
+    uint32_t retiredCount;
+    uint32_t retiredCapacity;
+    struct RetiredTexture* retired;
+
+    uint32_t uploadCount;
+    uint32_t evictionCount;
+};
+
+// Atlas layers are at least this large. Every entry sits in a cell with a
+// border of ATLAS_ALIGNMENT texels and cells are aligned to it, so each of
+// the ATLAS_MIP_LEVELS levels keeps at least one texel of border.
+#define ATLAS_LAYER_SIZE 2048
+#define ATLAS_ALIGNMENT 16
+#define ATLAS_MIP_LEVELS 5
+
+// Push constants telling the atlas fragment shader where a draw's texture
+// is, laid out like DrawConstants in shaders/atlas.frag
+struct DrawConstants
+{
+    float uvTransform[4];
+    uint32_t layer;
+};
+
+struct AtlasEntry
+{
+    uint32_t layer;
+    uint32_t x;
+    uint32_t y;
+    struct DrawConstants constants;
+};
+
+// Row of cells across a layer, as tall as the first cell placed in it
+struct AtlasShelf
+{
+    uint32_t layer;
+    uint32_t x;
+    uint32_t y;
+    uint32_t height;
+};
+
+// Textures packed into the layers of one 2D array image, so draws with
+// different textures share one descriptor set and pipeline
+struct TextureAtlas
+{
+    _Bool enabled;
+    uint32_t entryCount;
+    const char** paths;
+    struct AtlasEntry* entries;
+
+    uint32_t layerSize;
+    uint32_t layerCount;
+    uint32_t mipLevels;
+    VkImage image;
+    struct GpuAllocation memory;
+    VkImageView view;
+};
+
+// Slots in the bindless texture table, unless the device allows fewer
+#define BINDLESS_MAX_TEXTURES 4096
+
+// One descriptor set holding every texture of the session, bound once per
+// frame. Draws pick their texture by pushing its index.
+struct BindlessTextures
+{
+    _Bool enabled;
+    uint32_t capacity;
+    uint32_t textureCount;
+    VkDescriptorSetLayout layout;
+    VkDescriptorPool pool;
+    VkDescriptorSet set;
+
+    // Textures loaded for the table besides the engine's own
+    uint32_t pathCount;
+    const char** paths;
+    struct TextureLoad* loads;
+    VkImageView* views;
+};
+
+// Range of the index buffer drawn with one atlas entry or table texture
+struct DrawItem
+{
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    uint32_t texture;
+};
+
+// Fixed-workload benchmark, frame times are kept in milliseconds
+struct Benchmark
+{
+    _Bool enabled;
+    uint32_t warmupFrames;
+    double duration;
+    const char* reportPath;
+
+    double measureStart;
+    double measureEnd;
+    uint32_t sampleCount;
+    uint32_t sampleCapacity;
+    double* cpuFrameTimes;
+    double* gpuFrameTimes;
+
+    // Time spent in each EngineInit stage, indexed like initStages
+    double* initStageTimes;
+    double initTotalTime;
+};
+
+// Resources owned by a single frame in flight, reused once its fence signals
+struct FrameData
+{
+    VkCommandPool commandPool;
+    VkCommandBuffer commandBuffer;
+    VkSemaphore imageAvailable;
+    VkSemaphore renderFinished;
+    VkFence inFlight;
+
+    // Engine submission count when this frame was last submitted
+    uint64_t submission;
+};
+
+// Swapchain resources replaced by recreateSwapChain, destroyed once every
+// submission up to submission has completed. The render pass is only
+// retired when the surface format changed.
+struct RetiredSwapChain
+{
+    VkSwapchainKHR swapChain;
+    uint32_t imageCount;
+    VkImage* images;
+    VkImageView* imageViews;
+    VkFramebuffer* framebuffers;
+    VkImage depthImage;
+    struct GpuAllocation depthImageMemory;
+    VkImageView depthImageView;
+    VkRenderPass renderPass;
+    uint64_t submission;
+};
+
+// Threads compiling graphics pipelines off the main thread
+#define PIPELINE_COMPILER_THREADS 2
+
+enum PipelineJobState
+{
+    PIPELINE_JOB_QUEUED,
+    PIPELINE_JOB_BUILDING,
+    PIPELINE_JOB_DONE
+};
+
+// A pipeline compiled for *target. Finished jobs are installed by drawFrame
+// at the start of a frame, unless a newer request for the same target has
+// superseded them. pipeline is VK_NULL_HANDLE when the build failed.
+struct PipelineJob
+{
+    enum PipelineJobState state;
+    _Bool superseded;
+    const char* vertShader;
+    const char* fragShader;
+    VkRenderPass renderPass;
+    VkPipelineLayout layout;
+    VkPipeline* target;
+    VkPipeline pipeline;
+    struct PipelineJob* next;
+};
+
+// Pipeline replaced while submissions up to submission may still use it
+struct RetiredPipeline
+{
+    VkPipeline pipeline;
+    uint64_t submission;
+};
+
+// Worker threads creating pipelines through the shared pipeline cache, which
+// Vulkan synchronizes internally. jobs holds every job not installed yet,
+// oldest first.
+struct PipelineCompiler
+{
+    uint32_t threadCount;
+    pthread_t* threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t jobsReady;
+    struct PipelineJob* jobs;
+    struct PipelineJob* jobsTail;
+    _Bool shutdown;
+
+    uint32_t retiredCount;
+    uint32_t retiredCapacity;
+    struct RetiredPipeline* retired;
+};
+
+// Shader hot reload, enabled by --watch-shaders. GLSL sources are compiled
+// to the SPIR-V names the Makefile uses, at most this many at once.
+#define SHADER_WATCH_DIR "shaders"
+#define SHADER_COMPILER "glslangValidator"
+#define SHADER_MAX_COMPILES 8
+
+// A compiler child process for the source name in SHADER_WATCH_DIR. Sources
+// edited again while it runs are compiled once more when it exits.
+struct ShaderCompile
+{
+    pid_t pid;
+    char* name;
+    _Bool again;
+};
+
+// inotify watch on SHADER_WATCH_DIR. Finished compiles write their .spv,
+// whose change then rebuilds the pipelines that use it.
+struct ShaderWatcher
+{
+    _Bool enabled;
+    int fd;
+    _Bool compilerMissing;
+    uint32_t compileCount;
+    struct ShaderCompile compiles[SHADER_MAX_COMPILES];
+};
+
 struct Engine
 {
-    // Window
+    // Window, NULL when rendering headless
     GLFWwindow* window;
 
+    // Headless rendering renders into offscreen images instead of a
+    // swapchain and runs for frameLimit frames (0 == until window closes)
+    _Bool headless;
+    uint32_t frameLimit;
+    uint64_t frameNumber;
+    const char* outputPath;
+    struct GpuAllocation* offscreenImageMemory;
+
     // Vulkan instance
     VkInstance instance;
 
@@ -105,11 +771,19 @@ struct Engine
     // Queues
     VkQueue graphicsQueue;
     VkQueue presentQueue;
+    VkQueue transferQueue;
     struct QueueFamilyIndices queueFamilyIndices;
 
     // Physical/logical device
     VkPhysicalDevice physicalDevice;
+    VkPhysicalDeviceProperties deviceProperties;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
     VkDevice device;
+    _Bool textureCompressionBC;
+
+    // GPU memory, printed at exit with memoryReport
+    struct GpuAllocator allocator;
+    _Bool memoryReport;
 
     // Swapchain/images
     VkSwapchainKHR swapChain;
@@ -120,12 +794,26 @@ struct Engine
     VkExtent2D swapChainExtent;
     struct SwapChainSupportDetails swapChainDetails;
 
+    // Resize events only set swapChainResized, drawFrame recreates once
+    _Bool swapChainResized;
+    uint32_t retiredSwapChainCount;
+    uint32_t retiredSwapChainCapacity;
+    struct RetiredSwapChain* retiredSwapChains;
+
     // Render pass
     VkRenderPass renderPass;
 
-    // Graphics pipeline
+    // Pipeline cache, kept in pipelineCachePath between runs unless NULL
+    VkPipelineCache pipelineCache;
+    const char* pipelineCachePath;
+
+    // Graphics pipeline, VK_NULL_HANDLE while the compiler builds it
     VkPipelineLayout pipelineLayout;
     VkPipeline graphicsPipeline;
+    struct PipelineCompiler pipelineCompiler;
+
+    // Shader hot reload
+    struct ShaderWatcher shaderWatcher;
 
     // Frame buffers
     VkFramebuffer* framebuffers;
@@ -133,17 +821,45 @@ struct Engine
     // Command pool
     VkCommandPool commandPool;
 
+    // Startup uploads
+    struct UploadBatch uploadBatch;
+
+    // Asset pack, assets it doesn't hold load as loose files
+    const char* assetPackPath;
+    struct AssetPack assetPack;
+
+    // Image decoding, decodeThreads == 0 means one thread per core
+    struct DecodePool decodePool;
+    uint32_t decodeThreads;
+
+    // Asset reads
+    struct AsyncIo asyncIo;
+
+    // Runtime uploads on the transfer queue
+    struct TransferContext transfer;
+
 	// Depth buffering
     VkFormat depthFormat;
 	VkImage depthImage;
-    VkDeviceMemory depthImageMemory;
+    struct GpuAllocation depthImageMemory;
     VkImageView depthImageView;
 
     // Texture image
+    VkFormat textureFormat;
+    uint32_t textureMipLevels;
     VkImage textureImage;
-    VkDeviceMemory textureImageMemory;
+    struct GpuAllocation textureImageMemory;
     VkImageView textureImageView;
 
+    // Texture streaming, the streamer owns the texture when enabled
+    struct TextureStreamer streamer;
+
+    // Texture atlas, replaces the texture when enabled
+    struct TextureAtlas atlas;
+
+    // Bindless texture table, holds the texture and extra ones when enabled
+    struct BindlessTextures bindless;
+
     // Sampler
     VkSampler textureSampler;
 
@@ -152,28 +868,41 @@ struct Engine
     struct Vertex* vertices;
     uint16_t* indices;
     uint32_t indexCount;
+    struct DrawItem* draws;
+    uint32_t drawCount;
     VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
+    struct GpuAllocation vertexBufferMemory;
     VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
+    struct GpuAllocation indexBufferMemory;
 
-    // Uniform buffer
-    VkBuffer uniformStagingBuffer;
-    VkDeviceMemory uniformStagingBufferMemory;
+    // Uniform buffer, one persistently mapped slice per frame in flight
     VkBuffer uniformBuffer;
-    VkDeviceMemory uniformBufferMemory;
+    struct GpuAllocation uniformBufferMemory;
+    VkDeviceSize uniformStride;
+    char* uniformData;
 
-    // Descriptor pool/set
+    // Descriptor pool/sets, one set per frame in flight so a frame's set can
+    // be rewritten once its fence has signalled
     VkDescriptorSetLayout descriptorSetLayout;
-    VkDescriptorSet descriptorSet;
+    VkDescriptorSet* descriptorSets;
+    VkImageView* descriptorImageViews;
     VkDescriptorPool descriptorPool;
 
-    // Command buffers
-    VkCommandBuffer* commandBuffers;
+    // Frames in flight
+    uint32_t framesInFlight;
+    uint32_t currentFrame;
+    struct FrameData* frames;
 
-    // Semaphores
-    VkSemaphore imageAvailable;
-    VkSemaphore renderFinished;
+    // Graphics submissions made by drawFrame, and how many of them are known
+    // to have completed from their frame's fence
+    uint64_t submissions;
+    uint64_t completedSubmissions;
+
+    // GPU timing
+    struct GpuProfiler profiler;
+
+    // Benchmark mode
+    struct Benchmark benchmark;
 };
 
 /*  -----------------------------
@@ -229,9 +958,52 @@ _Bool queueFamilyComplete(struct QueueFamilyIndices* queueFamilyIndices);
 void createLogicalDevice(struct Engine* engine);
 void destroyLogicalDevice(struct Engine* engine);
 
+// GPU MEMORY
+void createGpuAllocator(struct Engine* engine);
+void destroyGpuAllocator(struct Engine* engine);
+VkDeviceSize gpuBlockSize(struct Engine* engine, uint32_t memoryType);
+void gpuAllocate(
+    struct Engine* engine,
+    VkMemoryRequirements* requirements,
+    enum GpuMemoryUsage usage,
+    _Bool linear,
+    struct GpuAllocation* allocation
+);
+void gpuFree(struct Engine* engine, struct GpuAllocation* allocation);
+void gpuInvalidate(struct Engine* engine, struct GpuAllocation* allocation);
+struct GpuBlock* allocateGpuBlock(
+    struct Engine* engine,
+    uint32_t memoryType,
+    VkDeviceSize size,
+    _Bool dedicated
+);
+void freeGpuBlock(struct Engine* engine, struct GpuBlock* block);
+_Bool allocateFromBlock(
+    struct Engine* engine,
+    struct GpuBlock* block,
+    VkMemoryRequirements* requirements,
+    _Bool linear,
+    struct GpuAllocation* allocation
+);
+void gpuAllocatorStats(
+    struct Engine* engine,
+    struct GpuAllocatorStats* perType,
+    struct GpuAllocatorStats* total
+);
+void gpuAllocatorReport(struct Engine* engine, FILE* fp);
+void describeMemoryFlags(VkMemoryPropertyFlags flags, char* out, size_t size);
+
 // SWAPCHAIN
 void createSwapChain(struct Engine* engine);
 void destroySwapChain(struct Engine* engine);
+void createOffscreenTargets(struct Engine* engine);
+void destroyOffscreenTargets(struct Engine* engine);
+struct RetiredSwapChain* retireSwapChain(struct Engine* engine);
+void releaseRetiredSwapChains(struct Engine* engine);
+void destroyRetiredSwapChain(
+    struct Engine* engine,
+    struct RetiredSwapChain* retired
+);
 VkSurfaceFormatKHR chooseSwapSurfaceFormat(
     VkSurfaceFormatKHR* availableFormats,
     int formatCount
@@ -255,17 +1027,111 @@ void findDepthFormat(struct Engine* engine);
 void createRenderPass(struct Engine* engine);
 void destroyRenderPass(struct Engine* engine);
 
+// PIPELINE CACHE
+void createPipelineCache(struct Engine* engine);
+void destroyPipelineCache(struct Engine* engine);
+_Bool pipelineCacheDataValid(
+    struct Engine* engine,
+    const char* data,
+    size_t size
+);
+void savePipelineCache(struct Engine* engine, const char* fname);
+
 // GRAPHICS PIPELINE
 void createGraphicsPipeline(struct Engine* engine);
 void destroyGraphicsPipeline(struct Engine* engine);
-char* readFile(const char* fname, uint32_t* fsize);
-void createShaderModule(
+const char* graphicsFragShader(struct Engine* engine);
+_Bool openShader(struct Engine* engine, const char* fname, struct FileView* view);
+VkPipeline buildGraphicsPipeline(
+    struct Engine* engine,
+    const char* vertShaderFname,
+    const char* fragShaderFname,
+    VkRenderPass renderPass,
+    VkPipelineLayout layout
+);
+_Bool createShaderModule(
     struct Engine* engine,
-    char* code,
-    uint32_t codeSize,
+    const char* code,
+    size_t codeSize,
     VkShaderModule* shaderModule
 );
 
+// PIPELINE COMPILER
+void createPipelineCompiler(struct Engine* engine);
+void destroyPipelineCompiler(struct Engine* engine);
+void requestGraphicsPipeline(
+    struct Engine* engine,
+    const char* fragShader,
+    VkPipeline* target
+);
+void installCompiledPipelines(struct Engine* engine);
+_Bool pipelineJobsUseRenderPass(
+    struct Engine* engine,
+    VkRenderPass renderPass
+);
+void retirePipeline(struct Engine* engine, VkPipeline pipeline);
+void releaseRetiredPipelines(struct Engine* engine);
+void* pipelineWorker(void* arg);
+
+// SHADER WATCHER
+void createShaderWatcher(struct Engine* engine);
+void destroyShaderWatcher(struct Engine* engine);
+void pollShaderWatcher(struct Engine* engine);
+_Bool shaderChanged(struct Engine* engine, const char* name);
+_Bool shaderSpirvPath(const char* name, char* path, size_t size);
+void startShaderCompile(struct Engine* engine, const char* name);
+void reapShaderCompiles(struct Engine* engine);
+void finishShaderCompile(
+    const struct ShaderCompile* compile,
+    pid_t pid,
+    int status
+);
+
+// FILE VIEW
+_Bool openFileView(const char* fname, uint32_t access, struct FileView* view);
+_Bool readFileView(const char* fname, struct FileView* view);
+void closeFileView(struct FileView* view);
+void adviseFileView(
+    const struct FileView* view,
+    size_t offset,
+    size_t size,
+    uint32_t access
+);
+
+// ASSET PACK
+void openAssetPack(struct Engine* engine);
+void closeAssetPack(struct Engine* engine);
+const struct PackEntry* findPackEntry(
+    const struct AssetPack* pack,
+    const char* name
+);
+_Bool openAsset(
+    struct Engine* engine,
+    const char* name,
+    uint32_t access,
+    struct FileView* view
+);
+_Bool lz4Decompress(
+    const unsigned char* src,
+    size_t srcSize,
+    unsigned char* dst,
+    size_t dstSize
+);
+
+// ASYNC IO
+void createAsyncIo(struct Engine* engine);
+void destroyAsyncIo(struct Engine* engine);
+_Bool createIoRing(struct AsyncIo* io, uint32_t entries);
+void destroyIoRing(struct AsyncIo* io);
+void submitRead(struct Engine* engine, struct IoRequest* request);
+struct IoRequest* waitRead(struct Engine* engine);
+void queueIoRequest(struct AsyncIo* io, struct IoRequest* request);
+struct IoRequest* dequeueIoRequest(struct AsyncIo* io);
+void pushRingRead(struct AsyncIo* io, struct IoRequest* request);
+struct IoRequest* waitRingRead(struct AsyncIo* io);
+_Bool advanceRead(struct IoRequest* request, long result);
+void* ioWorker(void* arg);
+
 // FRAMEBUFFERS
 void createFramebuffers(struct Engine* engine);
 void destroyFramebuffers(struct Engine* engine);
@@ -286,6 +1152,16 @@ VkFormat findSupportedFormat(
 _Bool hasStencilComponent(VkFormat format);
 void destroyDepthResources(struct Engine* engine);
 
+// DECODE POOL
+void createDecodePool(struct Engine* engine);
+void destroyDecodePool(struct Engine* engine);
+void beginDecodeBatch(struct Engine* engine, uint32_t jobCount);
+void queueDecodeJob(struct Engine* engine, struct DecodeJob* job);
+void finishDecodeBatch(struct Engine* engine);
+void* decodeWorker(void* arg);
+_Bool isJpeg(const struct FileView* file);
+void decodeImage(struct DecodeJob* job);
+
 // TEXTURE IMAGE
 void createTextureImage(struct Engine* engine);
 void destroyTextureImage(struct Engine* engine);
@@ -294,25 +1170,130 @@ void createImage(
     VkFormat format,
     uint32_t texWidth,
     uint32_t texHeight,
+    uint32_t mipLevels,
+    uint32_t arrayLayers,
     VkImageTiling tiling,
     VkImageUsageFlags usage,
-    VkMemoryPropertyFlags propertyFlags,
+    enum GpuMemoryUsage memoryUsage,
     VkImage* stagingImage,
-    VkDeviceMemory* stagingImageMemory
+    struct GpuAllocation* stagingImageMemory
+);
+void createUnboundImage(
+    struct Engine* engine,
+    VkFormat format,
+    uint32_t width,
+    uint32_t height,
+    uint32_t mipLevels,
+    uint32_t arrayLayers,
+    VkImageTiling tiling,
+    VkImageUsageFlags usage,
+    VkImage* image
 );
 void transitionImageLayout(
     struct Engine* engine,
     VkImage image,
     VkFormat format,
+    uint32_t mipLevels,
+    uint32_t arrayLayers,
     VkImageLayout oldLayout,
     VkImageLayout newLayout
 );
-void copyImage(
+void loadTextures(
+    struct Engine* engine,
+    struct TextureLoad* textures,
+    uint32_t textureCount
+);
+void prepareTextureDecode(
+    struct Engine* engine,
+    struct DecodeJob* job,
+    uint32_t index,
+    void* userData
+);
+void decodeImageFiles(
+    struct Engine* engine,
+    struct DecodeJob* jobs,
+    uint32_t jobCount,
+    void (*prepare)(struct Engine* engine, struct DecodeJob* job, uint32_t index, void* userData),
+    void* userData
+);
+void queueImageDecode(
+    struct Engine* engine,
+    struct DecodeJob* job,
+    uint32_t index,
+    void (*prepare)(struct Engine* engine, struct DecodeJob* job, uint32_t index, void* userData),
+    void* userData
+);
+VkDeviceSize stagingCopyAlignment(struct Engine* engine, uint32_t blockBytes);
+VkDeviceSize layoutTextureData(
+    struct Engine* engine,
+    const struct TextureSubresourceData* subresources,
+    uint32_t subresourceCount,
+    uint32_t blockBytes,
+    uint32_t blockDim,
+    VkBufferImageCopy* regions
+);
+void writeTextureData(
+    const struct TextureSubresourceData* subresources,
+    uint32_t subresourceCount,
+    uint32_t blockBytes,
+    uint32_t blockDim,
+    const VkBufferImageCopy* regions,
+    char* mapped
+);
+void stageTextureData(
+    struct Engine* engine,
+    const struct TextureSubresourceData* subresources,
+    uint32_t subresourceCount,
+    uint32_t blockBytes,
+    uint32_t blockDim,
+    VkBuffer* buffer,
+    struct GpuAllocation* memory,
+    VkBufferImageCopy* regions
+);
+void copyBufferToImage(
     struct Engine* engine,
-    VkImage src,
+    VkBuffer src,
     VkImage dst,
+    const VkBufferImageCopy* regions,
+    uint32_t regionCount
+);
+uint32_t mipLevelCount(uint32_t width, uint32_t height);
+_Bool canBlitMipmaps(struct Engine* engine, VkFormat format);
+void generateMipmaps(
+    struct Engine* engine,
+    VkImage image,
     uint32_t width,
-    uint32_t height
+    uint32_t height,
+    uint32_t mipLevels,
+    uint32_t arrayLayers
+);
+unsigned char* generateMipmapsCpu(
+    const unsigned char* pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t mipLevels,
+    struct TextureSubresourceData* levels
+);
+uint32_t compressedBlockBytes(VkFormat format);
+_Bool loadKtx2Texture(struct Engine* engine, const char* fname);
+_Bool openKtx2Source(
+    struct Engine* engine,
+    const char* fname,
+    uint32_t access,
+    struct TextureSource* source
+);
+void openImageSource(
+    struct Engine* engine,
+    const char* fname,
+    struct TextureSource* source
+);
+void closeTextureSource(struct TextureSource* source);
+void uploadTextureSource(
+    struct Engine* engine,
+    const struct TextureSource* source,
+    uint32_t baseLevel,
+    VkImage* image,
+    struct GpuAllocation* memory
 );
 
 // TEXTURE IMAGE VIEW
@@ -323,6 +1304,17 @@ void createImageView(
     VkImage image,
     VkFormat format,
     VkImageAspectFlags aspectFlags,
+    uint32_t mipLevels,
+    VkImageView* imageView
+);
+void createImageViewLayers(
+    struct Engine* engine,
+    VkImage image,
+    VkFormat format,
+    VkImageAspectFlags aspectFlags,
+    VkImageViewType viewType,
+    uint32_t mipLevels,
+    uint32_t layerCount,
     VkImageView* imageView
 );
 
@@ -330,34 +1322,142 @@ void createImageView(
 void createTextureSampler(struct Engine* engine);
 void destroyTextureSampler(struct Engine* engine);
 
-// VERTEX BUFFER
-void createVertexBuffer(struct Engine* engine);
-void copyBuffer(
+// TEXTURE STREAMING
+void createTextureStreamer(struct Engine* engine);
+void destroyTextureStreamer(struct Engine* engine);
+uint32_t addStreamedTexture(
     struct Engine* engine,
-    VkBuffer* src,
-    VkBuffer* dst,
-    VkDeviceSize size
+    const char* ktx2Path,
+    const char* imagePath
 );
-VkCommandBuffer beginSingleTimeCommands(struct Engine* engine);
-void endSingleTimeCommands(
+VkImageView activeTextureView(struct Engine* engine);
+void updateTextureStreaming(struct Engine* engine);
+VkDeviceSize streamingBytesFreeing(struct Engine* engine);
+struct StreamedTexture* findEvictionVictim(
     struct Engine* engine,
-    VkCommandBuffer commandBuffer
+    struct StreamedTexture* texture
 );
-void createBuffer(
+void streamTextureLevel(
     struct Engine* engine,
-    VkDeviceSize size,
-    VkBufferUsageFlags usage,
-    VkMemoryPropertyFlags properties,
-    VkBuffer* buffer,
-    VkDeviceMemory* bufferMemory
+    struct StreamedTexture* texture,
+    uint32_t level
 );
-void destroyVertexBuffer(struct Engine* engine);
+void finishStreamedTexture(
+    struct Engine* engine,
+    struct StreamedTexture* texture
+);
+void measureStreamedTexture(
+    struct Engine* engine,
+    struct StreamedTexture* texture
+);
+uint32_t streamedTextureLevel(
+    const struct StreamedTexture* texture,
+    float screenSize
+);
+float meshScreenSize(
+    struct Engine* engine,
+    struct UniformBufferObject* ubo
+);
+void textureStreamerReport(struct Engine* engine, FILE* fp);
+
+// TEXTURE ATLAS
+void createTextureAtlas(struct Engine* engine);
+void destroyTextureAtlas(struct Engine* engine);
+void packTextureAtlas(
+    struct Engine* engine,
+    const struct DecodeJob* jobs
+);
+void prepareAtlasDecode(
+    struct Engine* engine,
+    struct DecodeJob* job,
+    uint32_t index,
+    void* userData
+);
+uint32_t atlasCellSize(uint32_t size);
+void fillAtlasCell(
+    const struct TextureSubresourceData* level,
+    uint32_t x,
+    uint32_t y,
+    uint32_t cellWidth,
+    uint32_t cellHeight,
+    unsigned char* dst
+);
+
+// BINDLESS TEXTURES
+void checkBindlessSupport(
+    struct Engine* engine,
+    const VkPhysicalDeviceFeatures* supportedFeatures,
+    VkPhysicalDeviceFeatures* enabledFeatures,
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT* features
+);
+void createBindlessLayout(struct Engine* engine);
+void destroyBindlessLayout(struct Engine* engine);
+void createBindlessTable(struct Engine* engine);
+void destroyBindlessTable(struct Engine* engine);
+uint32_t addBindlessTexture(struct Engine* engine, VkImageView view);
+
+// VERTEX BUFFER
+void createVertexBuffer(struct Engine* engine);
+void copyBuffer(
+    struct Engine* engine,
+    VkBuffer* src,
+    VkBuffer* dst,
+    VkDeviceSize size
+);
+VkCommandBuffer beginSingleTimeCommands(struct Engine* engine);
+// Records into the open upload batch instead if there is one
+void endSingleTimeCommands(
+    struct Engine* engine,
+    VkCommandBuffer commandBuffer
+);
+void createBuffer(
+    struct Engine* engine,
+    VkDeviceSize size,
+    VkBufferUsageFlags usage,
+    enum GpuMemoryUsage memoryUsage,
+    VkBuffer* buffer,
+    struct GpuAllocation* bufferMemory
+);
+void destroyVertexBuffer(struct Engine* engine);
 void freeVertexBufferMemory(struct Engine* engine);
 uint32_t findMemType(
     struct Engine* engine,
     uint32_t typeFilter,
-    VkMemoryPropertyFlags properties
+    enum GpuMemoryUsage usage
+);
+
+// UPLOAD BATCH
+void beginUploadBatch(struct Engine* engine);
+void submitUploadBatch(struct Engine* engine);
+void releaseStagingResource(
+    struct Engine* engine,
+    VkBuffer buffer,
+    VkImage image,
+    struct GpuAllocation* memory
+);
+
+// ASYNC UPLOADS
+void createTransferContext(struct Engine* engine);
+void destroyTransferContext(struct Engine* engine);
+struct AsyncUpload* beginAsyncUpload(
+    struct Engine* engine,
+    const void* data,
+    VkDeviceSize size
+);
+void submitAsyncUpload(struct Engine* engine, struct AsyncUpload* upload);
+uint64_t uploadImageAsync(
+    struct Engine* engine,
+    VkImage dst,
+    const struct TextureSubresourceData* subresources,
+    uint32_t subresourceCount,
+    uint32_t blockBytes,
+    uint32_t blockDim
 );
+_Bool asyncUploadPending(struct Engine* engine, uint64_t serial);
+void recordUploadRelease(struct Engine* engine, struct AsyncUpload* upload);
+void recordUploadAcquires(struct Engine* engine, VkCommandBuffer commandBuffer);
+void retireAsyncUploads(struct Engine* engine, uint32_t frame);
+void freeAsyncUpload(struct Engine* engine, struct AsyncUpload* upload);
 
 // DESCRIPTOR LAYOUT
 void createDescriptorSetLayout(struct Engine* engine);
@@ -370,6 +1470,7 @@ void freeIndexBufferMemory(struct Engine* engine);
 
 // UNIFORM BUFFER
 void createUniformBuffer(struct Engine* engine);
+void computeUniforms(struct Engine* engine, struct UniformBufferObject* ubo);
 void updateUniformBuffer(struct Engine* engine);
 void freeUniformBufferMemory(struct Engine* engine);
 void destroyUniformBuffer(struct Engine* engine);
@@ -380,23 +1481,112 @@ void destroyDescriptorPool(struct Engine* engine);
 
 // DESCRIPTOR SET
 void createDescriptorSet(struct Engine* engine);
-// Automatically freed when pool is destroyed
+void writeDescriptorSet(struct Engine* engine, uint32_t frame);
+void freeDescriptorSets(struct Engine* engine);
+// Sets are automatically freed when pool is destroyed
 
 // COMMAND BUFFERS
 void createCommandBuffers(struct Engine* engine);
+void recordCommandBuffer(
+    struct Engine* engine,
+    VkCommandBuffer commandBuffer,
+    uint32_t imageIndex
+);
+void recordSceneDraws(struct Engine* engine, VkCommandBuffer commandBuffer);
 void freeCommandBuffers(struct Engine* engine);
 
-// SEMAPHORES
-void createSemaphores(struct Engine* engine);
-void destroySemaphores(struct Engine* engine);
+// SYNC OBJECTS
+void createSyncObjects(struct Engine* engine);
+void destroySyncObjects(struct Engine* engine);
+
+// GPU PROFILER
+void createGpuProfiler(struct Engine* engine);
+void destroyGpuProfiler(struct Engine* engine);
+void profilerCollect(struct Engine* engine, uint32_t frame);
+void profilerBeginFrame(struct Engine* engine, VkCommandBuffer commandBuffer);
+void profilerEndFrame(struct Engine* engine, VkCommandBuffer commandBuffer);
+uint32_t profilerBeginPass(
+    struct Engine* engine,
+    VkCommandBuffer commandBuffer,
+    const char* name
+);
+void profilerEndPass(
+    struct Engine* engine,
+    VkCommandBuffer commandBuffer,
+    uint32_t pass
+);
+double profilerGetPassTime(struct Engine* engine, const char* name);
+void profilerReport(struct Engine* engine, FILE* fp, _Bool json);
+
+// BENCHMARK
+void benchmarkRecordFrame(struct Engine* engine, double frameTime);
+_Bool benchmarkDone(struct Engine* engine);
+void writeFrameStats(FILE* fp, const double* samples, uint32_t count);
+void writeJsonString(FILE* fp, const char* string);
+void writeBenchmarkReport(struct Engine* engine);
+void freeBenchmark(struct Engine* engine);
 
-void drawFrame(struct Engine* engine);
+// UTILITY
+double getTime(void);
+
+_Bool drawFrame(struct Engine* engine);
+void saveFrame(struct Engine* engine, uint32_t imageIndex, const char* fname);
 
 void recreateSwapChain(struct Engine* engine);
 
 /*  -----------------------------
  *  --- Main engine functions ---
  *  -----------------------------   */
+// EngineInit runs these in order and times each one for benchmark reports
+struct InitStage
+{
+    const char* name;
+    void (*run)(struct Engine* engine);
+};
+#define INIT_STAGE(function) { #function, function }
+static const struct InitStage initStages[] = {
+    INIT_STAGE(openAssetPack),
+    INIT_STAGE(createInstance),
+    INIT_STAGE(setupDebugCallback),
+    INIT_STAGE(createSurface),
+    INIT_STAGE(getPhysicalDevice),
+    INIT_STAGE(createLogicalDevice),
+    INIT_STAGE(createPipelineCache),
+    INIT_STAGE(createGpuAllocator),
+    INIT_STAGE(createSwapChain),
+    INIT_STAGE(createImageViews),
+    INIT_STAGE(findDepthFormat),
+    INIT_STAGE(createRenderPass),
+    INIT_STAGE(createDescriptorSetLayout),
+    INIT_STAGE(createBindlessLayout),
+    INIT_STAGE(createGraphicsPipeline),
+    INIT_STAGE(createPipelineCompiler),
+    INIT_STAGE(createShaderWatcher),
+    INIT_STAGE(createCommandPool),
+    INIT_STAGE(beginUploadBatch),
+    INIT_STAGE(createDepthResources),
+    INIT_STAGE(createFramebuffers),
+    INIT_STAGE(createAsyncIo),
+    INIT_STAGE(createDecodePool),
+    INIT_STAGE(createTextureImage),
+    INIT_STAGE(createTextureStreamer),
+    INIT_STAGE(createTextureAtlas),
+    INIT_STAGE(createTextureImageView),
+    INIT_STAGE(createTextureSampler),
+    INIT_STAGE(createBindlessTable),
+    INIT_STAGE(createVertexBuffer),
+    INIT_STAGE(createIndexBuffer),
+    INIT_STAGE(submitUploadBatch),
+    INIT_STAGE(createTransferContext),
+    INIT_STAGE(createUniformBuffer),
+    INIT_STAGE(createDescriptorPool),
+    INIT_STAGE(createDescriptorSet),
+    INIT_STAGE(createCommandBuffers),
+    INIT_STAGE(createSyncObjects),
+    INIT_STAGE(createGpuProfiler)
+};
+#define INIT_STAGE_COUNT (sizeof(initStages)/sizeof(initStages[0]))
+
 void EngineInit(struct Engine* self, GLFWwindow* window)
 {
     struct Vertex vertices[] = {
@@ -422,73 +1612,136 @@ void EngineInit(struct Engine* self, GLFWwindow* window)
     self->indices = malloc(sizeof(indices));
     memcpy(self->indices, indices, sizeof(indices));
 
+    // With an atlas or bindless textures each quad is drawn with its own
+    // texture
+    struct DrawItem draws[] = {
+        {0, 6, 0},
+        {6, 6, 1}
+    };
+    self->drawCount = sizeof(draws)/sizeof(draws[0]);
+    self->draws = malloc(sizeof(draws));
+    memcpy(self->draws, draws, sizeof(draws));
+
     self->window = window;
 
-    createInstance(self);
-    setupDebugCallback(self);
-    createSurface(self);
-    getPhysicalDevice(self);
-    createLogicalDevice(self);
-    createSwapChain(self);
-    createImageViews(self);
-    findDepthFormat(self);
-    createRenderPass(self);
-    createDescriptorSetLayout(self);
-    createGraphicsPipeline(self);
-    createCommandPool(self);
-    createDepthResources(self);
-    createFramebuffers(self);
-    createTextureImage(self);
-    createTextureImageView(self);
-    createTextureSampler(self);
-    createVertexBuffer(self);
-    createIndexBuffer(self);
-    createUniformBuffer(self);
-    createDescriptorPool(self);
-    createDescriptorSet(self);
-    createCommandBuffers(self);
-    createSemaphores(self);
+    if (self->framesInFlight == 0)
+        self->framesInFlight = defaultFramesInFlight;
+    if (self->profiler.reportInterval <= 0.0)
+        self->profiler.reportInterval = 1.0;
+    self->currentFrame = 0;
+
+    self->benchmark.initStageTimes = calloc(
+        INIT_STAGE_COUNT,
+        sizeof(*(self->benchmark.initStageTimes))
+    );
+
+    double initStart = getTime();
+    uint32_t i;
+    for (i=0; i<INIT_STAGE_COUNT; i++)
+    {
+        double stageStart = getTime();
+        initStages[i].run(self);
+        self->benchmark.initStageTimes[i] = (getTime() - stageStart) * 1000.0;
+    }
+    self->benchmark.initTotalTime = (getTime() - initStart) * 1000.0;
 }
 void EngineRun(struct Engine* self)
 {
-    // GLFW main loop
-    while(!glfwWindowShouldClose(self->window)) {
-        glfwPollEvents();
+    double lastFrame = getTime();
+    self->benchmark.measureStart = lastFrame;
+
+    // GLFW main loop, headless runs only stop at the frame limit. In
+    // benchmark mode the limit counts measured frames after the warm-up.
+    while(self->headless || !glfwWindowShouldClose(self->window)) {
+        if (self->benchmark.enabled)
+        {
+            if (benchmarkDone(self))
+                break;
+        }
+        else if (self->frameLimit > 0 && self->frameNumber >= self->frameLimit)
+        {
+            break;
+        }
 
-        updateUniformBuffer(self);
-        drawFrame(self);
+        if (!self->headless)
+            glfwPollEvents();
+
+        _Bool drawn = drawFrame(self);
+
+        double now = getTime();
+        if (drawn)
+        {
+            self->frameNumber++;
+            if (self->benchmark.enabled)
+                benchmarkRecordFrame(self, now - lastFrame);
+        }
+        lastFrame = now;
     }
+    self->benchmark.measureEnd = lastFrame;
 
     vkDeviceWaitIdle(self->device);
+
+    if (self->benchmark.enabled)
+        writeBenchmarkReport(self);
+
+    if (self->memoryReport)
+    {
+        gpuAllocatorReport(self, stderr);
+        if (self->streamer.enabled)
+            textureStreamerReport(self, stderr);
+    }
+
+    if (self->headless && self->outputPath && self->frameNumber > 0)
+    {
+        // drawFrame has already advanced past the last rendered frame
+        uint32_t lastImage = (self->currentFrame + self->framesInFlight - 1) %
+            self->framesInFlight;
+        saveFrame(self, lastImage, self->outputPath);
+    }
 }
 void EngineDestroy(struct Engine* self)
 {
-    destroySemaphores(self);
+    freeBenchmark(self);
+    destroyGpuProfiler(self);
+    destroySyncObjects(self);
     freeCommandBuffers(self);
+    destroyTransferContext(self);
     destroyDescriptorPool(self);
+    freeDescriptorSets(self);
     freeUniformBufferMemory(self);
     destroyUniformBuffer(self);
     freeIndexBufferMemory(self);
     destroyIndexBuffer(self);
     freeVertexBufferMemory(self);
     destroyVertexBuffer(self);
+    destroyBindlessTable(self);
     destroyTextureSampler(self);
     destroyTextureImageView(self);
     destroyTextureImage(self);
+    destroyTextureStreamer(self);
+    destroyTextureAtlas(self);
+    destroyDecodePool(self);
+    destroyAsyncIo(self);
     destroyFramebuffers(self);
     destroyDepthResources(self);
     destroyCommandPool(self);
     freeExtensions(self);
+    destroyBindlessLayout(self);
     destroyDescriptorSetLayout(self);
+    destroyShaderWatcher(self);
+    destroyPipelineCompiler(self);
     destroyGraphicsPipeline(self);
+    destroyPipelineCache(self);
     destroyRenderPass(self);
     destroyImageViews(self);
     destroySwapChain(self);
+    destroyGpuAllocator(self);
     destroyLogicalDevice(self);
     destroySurface(self);
     if (validationEnabled)
         destroyDebugCallback(self);
     destroyInstance(self);
+    closeAssetPack(self);
 }
 
 /*  -----------------------------
@@ -502,17 +1755,254 @@ uint32_t max(uint32_t a, uint32_t b)
 {
     return (a > b ? a : b);
 }
+// Monotonic wall clock in seconds
+double getTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
 
+// Resizes arrive in bursts while the window is dragged, so only flag them
+// and let drawFrame recreate the swapchain once per frame
 static void onWindowResized(GLFWwindow* window, int width, int height)
 {
-    if (width == 0 || height == 0)
-        return;
-
+    (void)width;
+    (void)height;
     struct Engine* engine = (struct Engine*)glfwGetWindowUserPointer(window);
-    recreateSwapChain(engine);
+    engine->swapChainResized = 1;
+}
+
+static void printUsage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [--frames-in-flight N] [--frames N]\n"
+        "       [--headless] [--output frame.ppm]\n"
+        "       [--profile] [--profile-json] [--profile-interval SECONDS]\n"
+        "       [--benchmark] [--warmup N] [--duration SECONDS]\n"
+        "       [--report report.json|-] [--memory-stats]\n"
+        "       [--decode-threads N] [--pack assets.pack]\n"
+        "       [--stream-textures] [--texture-budget MIB]\n"
+        "       [--stream-texture texture.png]...\n"
+        "       [--atlas texture.png]... [--bindless]\n"
+        "       [--bindless-texture texture.png]...\n"
+        "       [--pipeline-cache FILE] [--no-pipeline-cache]\n"
+        "       [--watch-shaders]\n",
+        program
+    );
 }
 
-int main() {
+// Parses an option's value as a whole number from minValue to maxValue,
+// anything else is a usage error
+static uint32_t parseCount(const char* program, const char* option, const char* value, uint32_t minValue, uint32_t maxValue)
+{
+    // strtoul would accept a sign and negate the value
+    char* end;
+    errno = 0;
+    unsigned long count = strtoul(value, &end, 10);
+    if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno == ERANGE ||
+        count < minValue || count > maxValue)
+    {
+        fprintf(stderr, "%s takes a whole number from %u to %u.\n", option, minValue, maxValue);
+        printUsage(program);
+        exit(-1);
+    }
+    return (uint32_t)count;
+}
+
+int main(int argc, char** argv) {
+    struct Engine* engine = calloc(1, sizeof(*engine));
+    engine->benchmark.warmupFrames = 60;
+    engine->pipelineCachePath = "pipeline.cache";
+
+    int i;
+    for (i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i], "--frames-in-flight") == 0 && i+1 < argc)
+        {
+            engine->framesInFlight = parseCount(
+                argv[0],
+                argv[i],
+                argv[i+1],
+                1,
+                maxFramesInFlight
+            );
+            i++;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+        {
+            engine->frameLimit = parseCount(
+                argv[0],
+                argv[i],
+                argv[i+1],
+                0,
+                UINT32_MAX
+            );
+            i++;
+        }
+        else if (strcmp(argv[i], "--headless") == 0)
+        {
+            engine->headless = 1;
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i+1 < argc)
+        {
+            engine->outputPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile") == 0)
+        {
+            engine->profiler.reportEnabled = 1;
+        }
+        else if (strcmp(argv[i], "--profile-json") == 0)
+        {
+            engine->profiler.reportEnabled = 1;
+            engine->profiler.reportJson = 1;
+        }
+        else if (strcmp(argv[i], "--profile-interval") == 0 && i+1 < argc)
+        {
+            engine->profiler.reportInterval = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--benchmark") == 0)
+        {
+            engine->benchmark.enabled = 1;
+        }
+        else if (strcmp(argv[i], "--warmup") == 0 && i+1 < argc)
+        {
+            engine->benchmark.warmupFrames = parseCount(
+                argv[0],
+                argv[i],
+                argv[i+1],
+                0,
+                UINT32_MAX
+            );
+            i++;
+        }
+        else if (strcmp(argv[i], "--duration") == 0 && i+1 < argc)
+        {
+            engine->benchmark.duration = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--report") == 0 && i+1 < argc)
+        {
+            engine->benchmark.reportPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--memory-stats") == 0)
+        {
+            engine->memoryReport = 1;
+        }
+        else if (strcmp(argv[i], "--decode-threads") == 0 && i+1 < argc)
+        {
+            engine->decodeThreads = parseCount(
+                argv[0],
+                argv[i],
+                argv[i+1],
+                0,
+                MAX_DECODE_THREADS
+            );
+            i++;
+        }
+        else if (strcmp(argv[i], "--pack") == 0 && i+1 < argc)
+        {
+            engine->assetPackPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stream-textures") == 0)
+        {
+            engine->streamer.enabled = 1;
+        }
+        else if (strcmp(argv[i], "--stream-texture") == 0 && i+1 < argc)
+        {
+            struct TextureStreamer* streamer = &(engine->streamer);
+            streamer->enabled = 1;
+            streamer->paths = realloc(
+                streamer->paths,
+                (streamer->pathCount + 1) * sizeof(*(streamer->paths))
+            );
+            streamer->paths[streamer->pathCount++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--texture-budget") == 0 && i+1 < argc)
+        {
+            engine->streamer.enabled = 1;
+            engine->streamer.budget =
+                (VkDeviceSize)(atof(argv[++i]) * 1024.0 * 1024.0);
+        }
+        else if (strcmp(argv[i], "--atlas") == 0 && i+1 < argc)
+        {
+            struct TextureAtlas* atlas = &(engine->atlas);
+            atlas->enabled = 1;
+            atlas->paths = realloc(
+                atlas->paths,
+                (atlas->entryCount + 1) * sizeof(*(atlas->paths))
+            );
+            atlas->paths[atlas->entryCount++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pipeline-cache") == 0 && i+1 < argc)
+        {
+            engine->pipelineCachePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-pipeline-cache") == 0)
+        {
+            engine->pipelineCachePath = NULL;
+        }
+        else if (strcmp(argv[i], "--watch-shaders") == 0)
+        {
+            engine->shaderWatcher.enabled = 1;
+        }
+        else if (strcmp(argv[i], "--bindless") == 0)
+        {
+            engine->bindless.enabled = 1;
+        }
+        else if (strcmp(argv[i], "--bindless-texture") == 0 && i+1 < argc)
+        {
+            struct BindlessTextures* bindless = &(engine->bindless);
+            bindless->enabled = 1;
+            bindless->paths = realloc(
+                bindless->paths,
+                (bindless->pathCount + 1) * sizeof(*(bindless->paths))
+            );
+            bindless->paths[bindless->pathCount++] = argv[++i];
+        }
+        else
+        {
+            printUsage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (engine->streamer.enabled + engine->atlas.enabled +
+        engine->bindless.enabled > 1)
+    {
+        fprintf(stderr, "Texture streaming, atlases and bindless textures can't be combined.\n");
+        exit(-1);
+    }
+
+    if (engine->benchmark.enabled)
+    {
+        // Without an explicit workload, measure a fixed number of frames
+        if (engine->frameLimit == 0 && engine->benchmark.duration <= 0.0)
+            engine->frameLimit = 1000;
+        if (!engine->benchmark.reportPath)
+            engine->benchmark.reportPath = "benchmark.json";
+    }
+
+    if (engine->headless)
+    {
+        if (engine->frameLimit == 0 && !engine->benchmark.enabled)
+            engine->frameLimit = 1;
+
+        EngineInit(engine, NULL);
+        EngineRun(engine);
+        EngineDestroy(engine);
+
+        free(engine);
+
+        return 0;
+    }
+
+    if (engine->outputPath)
+    {
+        fprintf(stderr, "--output is only supported with --headless.\n");
+        exit(-1);
+    }
+
     // Init GLFW
     glfwInit();
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -523,7 +2013,6 @@ int main() {
         NULL
     );
 
-    struct Engine* engine = calloc(1, sizeof(*engine));
     glfwSetWindowUserPointer(window, engine);
     glfwSetWindowSizeCallback(window, onWindowResized);
 
@@ -627,10 +2116,11 @@ _Bool checkValidationSupport(uint32_t validationLayerCount, const char** validat
 // DEVICE EXTENSIONS
 void getRequiredExtensions(struct Engine* engine)
 {
-    // Get OS specific extensions from glfw
-    const char** glfwExtensions;
-    uint32_t glfwExtensionCount;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    // Get OS specific extensions from glfw, none are needed without a window
+    const char** glfwExtensions = NULL;
+    uint32_t glfwExtensionCount = 0;
+    if (!engine->headless)
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
     // Copy glfwExtensions
     uint32_t i;
@@ -646,6 +2136,32 @@ void getRequiredExtensions(struct Engine* engine)
     strcpy(engine->surfaceExtensions[i], VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
     i++;
 
+    // Bindless mode queries descriptor indexing support through the
+    // extended feature queries
+    if (engine->bindless.enabled)
+    {
+        const char* name = VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+        uint32_t availableCount;
+        vkEnumerateInstanceExtensionProperties(NULL, &availableCount, NULL);
+        VkExtensionProperties* available = calloc(availableCount, sizeof(*available));
+        vkEnumerateInstanceExtensionProperties(NULL, &availableCount, available);
+
+        uint32_t j;
+        for (j=0; j<availableCount; j++)
+        {
+            if (strcmp(available[j].extensionName, name) == 0)
+                break;
+        }
+        free(available);
+
+        if (j < availableCount)
+        {
+            engine->surfaceExtensions[i] = calloc(1, strlen(name)+1);
+            strcpy(engine->surfaceExtensions[i], name);
+            i++;
+        }
+    }
+
     engine->surfaceExtensionCount = i;
 }
 
@@ -753,6 +2269,8 @@ void destroyDebugCallback(struct Engine* engine)
 // WINDOW SURFACE
 void createSurface(struct Engine* engine)
 {
+    if (engine->headless) return;
+
     VkResult result;
     result = glfwCreateWindowSurface(
         engine->instance,
@@ -771,6 +2289,8 @@ void createSurface(struct Engine* engine)
 
 void destroySurface(struct Engine* engine)
 {
+    if (engine->headless) return;
+
     vkDestroySurfaceKHR(engine->instance, engine->surface, NULL);
 }
 
@@ -810,12 +2330,29 @@ void getPhysicalDevice(struct Engine* engine)
         fprintf(stderr, "No usable devices found.\n");
         exit(-1);
     }
+
+    vkGetPhysicalDeviceProperties(
+        engine->physicalDevice,
+        &(engine->deviceProperties)
+    );
+    vkGetPhysicalDeviceMemoryProperties(
+        engine->physicalDevice,
+        &(engine->memoryProperties)
+    );
 }
 
 // Determines whether a physical device has proper support, returns true (1)
 // if it does and sets queue family indices of engine->queueFamilyIndices
 _Bool isDeviceSuitable(struct Engine* engine, VkPhysicalDevice* physicalDevice)
 {
+    // Offscreen rendering needs neither the swapchain extension nor a
+    // surface, any device with a graphics queue will do
+    if (engine->headless)
+    {
+        engine->queueFamilyIndices = findQueueFamilies(engine, physicalDevice);
+        return queueFamilyComplete(&(engine->queueFamilyIndices));
+    }
+
     // Device extensions
     _Bool extensionsSupported = 0;
 
@@ -960,7 +2497,8 @@ struct QueueFamilyIndices findQueueFamilies(struct Engine* engine, VkPhysicalDev
 {
     struct QueueFamilyIndices queueFamilyIndices = {
         .graphicsFamily = -1,
-        .presentFamily = -1
+        .presentFamily = -1,
+        .transferFamily = -1
     };
 
     // Get number of queue families
@@ -994,14 +2532,22 @@ struct QueueFamilyIndices findQueueFamilies(struct Engine* engine, VkPhysicalDev
             queueFamilyIndices.graphicsFamily = i;
         }
 
-        // Check if queue family is capable of presenting to window surface
+        // Check if queue family is capable of presenting to window surface,
+        // without a surface the graphics queue stands in for present
         VkBool32 presentSupport = 0;
-        vkGetPhysicalDeviceSurfaceSupportKHR(
-            *physicalDevice,
-            i,
-            engine->surface,
-            &presentSupport
-        );
+        if (engine->headless)
+        {
+            presentSupport = queueFamilyIndices.graphicsFamily == (int)i;
+        }
+        else
+        {
+            vkGetPhysicalDeviceSurfaceSupportKHR(
+                *physicalDevice,
+                i,
+                engine->surface,
+                &presentSupport
+            );
+        }
         if (queueFamilyCount > 0 && presentSupport)
         {
             queueFamilyIndices.presentFamily = i;
@@ -1012,6 +2558,22 @@ struct QueueFamilyIndices findQueueFamilies(struct Engine* engine, VkPhysicalDev
             break;
     }
 
+    // Prefer a transfer-only family (the DMA engines on discrete GPUs) so
+    // uploads run alongside rendering
+    for (i=0; i<queueFamilyCount; i++)
+    {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+        if (queueFamilies[i].queueCount > 0 &&
+            (flags & VK_QUEUE_TRANSFER_BIT) &&
+            !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+        {
+            queueFamilyIndices.transferFamily = i;
+            break;
+        }
+    }
+    if (queueFamilyIndices.transferFamily < 0)
+        queueFamilyIndices.transferFamily = queueFamilyIndices.graphicsFamily;
+
     free(queueFamilies);
 
     return queueFamilyIndices;
@@ -1025,36 +2587,67 @@ _Bool queueFamilyComplete(struct QueueFamilyIndices* queueFamilyIndices)
 // LOGICAL DEVICE
 void createLogicalDevice(struct Engine* engine)
 {
-    VkDeviceQueueCreateInfo queueCreateInfos[2];
-    int uniqueQueueFamilies[2] = {
+    VkDeviceQueueCreateInfo queueCreateInfos[3];
+    int queueFamilies[3] = {
         engine->queueFamilyIndices.graphicsFamily,
-        engine->queueFamilyIndices.presentFamily
+        engine->queueFamilyIndices.presentFamily,
+        engine->queueFamilyIndices.transferFamily
     };
 
+    // Passing the same family twice will result in a validation error
     float queuePriority = 1.0f;
-    int i;
-    for (i=0; i<2; i++)
+    uint32_t queueCreateInfoCount = 0;
+    int i, j;
+    for (i=0; i<3; i++)
+    {
+        _Bool duplicate = 0;
+        for (j=0; j<i; j++)
+        {
+            if (queueFamilies[j] == queueFamilies[i])
+                duplicate = 1;
+        }
+        if (duplicate)
+            continue;
+
+        VkDeviceQueueCreateInfo* queueInfo = &(queueCreateInfos[queueCreateInfoCount++]);
+        queueInfo->sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queueInfo->pNext = NULL;
+        queueInfo->flags = 0;
+        queueInfo->queueFamilyIndex = queueFamilies[i];
+        queueInfo->queueCount = 1;
+        queueInfo->pQueuePriorities = &queuePriority;
+    }
+
+    // Cooked block-compressed textures need the feature, without it they
+    // fall back to their source images
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(engine->physicalDevice, &supportedFeatures);
+    VkPhysicalDeviceFeatures enabledFeatures;
+    memset(&enabledFeatures, 0, sizeof(enabledFeatures));
+    enabledFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+    engine->textureCompressionBC = supportedFeatures.textureCompressionBC;
+
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures;
+    memset(&indexingFeatures, 0, sizeof(indexingFeatures));
+    indexingFeatures.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    if (engine->bindless.enabled)
     {
-        queueCreateInfos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        queueCreateInfos[i].pNext = NULL;
-        queueCreateInfos[i].flags = 0;
-        queueCreateInfos[i].queueFamilyIndex = uniqueQueueFamilies[i];
-        queueCreateInfos[i].queueCount = 1;
-        queueCreateInfos[i].pQueuePriorities = &queuePriority;
+        checkBindlessSupport(
+            engine,
+            &supportedFeatures,
+            &enabledFeatures,
+            &indexingFeatures
+        );
     }
 
     VkDeviceCreateInfo createInfo;
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    createInfo.pNext = NULL;
+    createInfo.pNext = engine->bindless.enabled ? &indexingFeatures : NULL;
     createInfo.flags = 0;
     createInfo.pQueueCreateInfos = queueCreateInfos;
-    // Passing both pQueueCreateInfos when the indices are the
-    // same will result in a validation error
-    if (engine->queueFamilyIndices.graphicsFamily == engine->queueFamilyIndices.presentFamily)
-        createInfo.queueCreateInfoCount = 1;
-    else
-        createInfo.queueCreateInfoCount = 2;
-    createInfo.pEnabledFeatures = NULL;
+    createInfo.queueCreateInfoCount = queueCreateInfoCount;
+    createInfo.pEnabledFeatures = &enabledFeatures;
     createInfo.enabledExtensionCount = engine->deviceExtensionCount;
     createInfo.ppEnabledExtensionNames = (const char* const*)engine->deviceExtensions;
 
@@ -1089,6 +2682,13 @@ void createLogicalDevice(struct Engine* engine)
         0,
         &(engine->presentQueue)
     );
+
+    vkGetDeviceQueue(
+        engine->device,
+        engine->queueFamilyIndices.transferFamily,
+        0,
+        &(engine->transferQueue)
+    );
 }
 
 void destroyLogicalDevice(struct Engine* engine)
@@ -1096,34 +2696,538 @@ void destroyLogicalDevice(struct Engine* engine)
     vkDestroyDevice(engine->device, NULL);
 }
 
-// SWAPCHAIN
-void createSwapChain(struct Engine* engine)
+// GPU MEMORY
+void createGpuAllocator(struct Engine* engine)
 {
-    struct SwapChainSupportDetails swapChainSupport;
-    swapChainSupport = querySwapChainSupport(engine, &(engine->physicalDevice));
+    struct GpuAllocator* allocator = &(engine->allocator);
 
-    VkSurfaceFormatKHR surfaceFormat;
-    surfaceFormat = chooseSwapSurfaceFormat(
-        swapChainSupport.formats,
-        swapChainSupport.formatCount
-    );
+    allocator->bufferImageGranularity =
+        engine->deviceProperties.limits.bufferImageGranularity;
+    allocator->maxBlockCount =
+        engine->deviceProperties.limits.maxMemoryAllocationCount;
 
-    VkPresentModeKHR presentMode;
-    presentMode = chooseSwapPresentMode(
-        swapChainSupport.presentModes,
-        swapChainSupport.presentModeCount
-    );
+    allocator->blockCount = 0;
+    allocator->blockCapacity = 0;
+    allocator->blocks = NULL;
+}
 
-    VkExtent2D extent = chooseSwapExtent(&(swapChainSupport.capabilities));
+void destroyGpuAllocator(struct Engine* engine)
+{
+    struct GpuAllocator* allocator = &(engine->allocator);
 
-    // 0 max image count == no limit
-    engine->imageCount = swapChainSupport.capabilities.minImageCount+1;
-    if (swapChainSupport.capabilities.minImageCount > 0 &&
-        engine->imageCount > swapChainSupport.capabilities.maxImageCount)
-            engine->imageCount = swapChainSupport.capabilities.maxImageCount;
+    struct GpuAllocatorStats total;
+    gpuAllocatorStats(engine, NULL, &total);
+    if (total.allocationCount > 0)
+    {
+        fprintf(
+            stderr,
+            "%u GPU allocations were not freed.\n",
+            total.allocationCount
+        );
+    }
 
-    VkSwapchainCreateInfoKHR createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+    while (allocator->blockCount > 0)
+        freeGpuBlock(engine, allocator->blocks[allocator->blockCount - 1]);
+
+    free(allocator->blocks);
+    allocator->blocks = NULL;
+    allocator->blockCapacity = 0;
+}
+
+// Whether a resource ending at end shares a bufferImageGranularity page with
+// one starting at offset
+static _Bool onSamePage(VkDeviceSize end, VkDeviceSize offset, VkDeviceSize pageSize)
+{
+    return ((end - 1) & ~(pageSize - 1)) == (offset & ~(pageSize - 1));
+}
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Blocks are a fraction of the heap so small heaps (BAR windows, integrated
+// parts) are not exhausted by a single block
+VkDeviceSize gpuBlockSize(struct Engine* engine, uint32_t memoryType)
+{
+    VkPhysicalDeviceMemoryProperties* memProperties =
+        &(engine->memoryProperties);
+    uint32_t heapIndex = memProperties->memoryTypes[memoryType].heapIndex;
+    VkDeviceSize heapSize = memProperties->memoryHeaps[heapIndex].size;
+
+    VkDeviceSize blockSize = GPU_BLOCK_SIZE;
+    while (blockSize > heapSize / 8 && blockSize > 1024 * 1024)
+        blockSize /= 2;
+    return blockSize;
+}
+
+void gpuAllocate(struct Engine* engine, VkMemoryRequirements* requirements, enum GpuMemoryUsage usage, _Bool linear, struct GpuAllocation* allocation)
+{
+    struct GpuAllocator* allocator = &(engine->allocator);
+
+    uint32_t memoryType = findMemType(
+        engine,
+        requirements->memoryTypeBits,
+        usage
+    );
+    VkDeviceSize blockSize = gpuBlockSize(engine, memoryType);
+
+    // Large resources would mostly waste a shared block
+    if (requirements->size > blockSize / 2)
+    {
+        struct GpuBlock* block = allocateGpuBlock(
+            engine,
+            memoryType,
+            requirements->size,
+            1
+        );
+        allocateFromBlock(engine, block, requirements, linear, allocation);
+        return;
+    }
+
+    uint32_t i;
+    for (i=0; i<allocator->blockCount; i++)
+    {
+        struct GpuBlock* block = allocator->blocks[i];
+        if (block->memoryType != memoryType || block->dedicated)
+            continue;
+
+        if (allocateFromBlock(engine, block, requirements, linear, allocation))
+            return;
+    }
+
+    struct GpuBlock* block = allocateGpuBlock(engine, memoryType, blockSize, 0);
+    if (!allocateFromBlock(engine, block, requirements, linear, allocation))
+    {
+        fprintf(stderr, "Failed to sub-allocate GPU memory.\n");
+        exit(-1);
+    }
+}
+
+// Returns the allocation's range to its block, merging it with free
+// neighbours. Empty blocks are released unless they are the only empty
+// block of their memory type, which is kept to avoid reallocating it on the
+// next request.
+void gpuFree(struct Engine* engine, struct GpuAllocation* allocation)
+{
+    struct GpuAllocator* allocator = &(engine->allocator);
+    struct GpuBlock* block = allocation->block;
+    struct GpuChunk* chunk = allocation->chunk;
+
+    if (!block)
+        return;
+
+    chunk->free = 1;
+    block->allocationCount--;
+    block->usedBytes -= chunk->size;
+
+    struct GpuChunk* next = chunk->next;
+    if (next && next->free)
+    {
+        chunk->size += next->size;
+        chunk->next = next->next;
+        if (next->next)
+            next->next->prev = chunk;
+        free(next);
+    }
+
+    struct GpuChunk* prev = chunk->prev;
+    if (prev && prev->free)
+    {
+        prev->size += chunk->size;
+        prev->next = chunk->next;
+        if (chunk->next)
+            chunk->next->prev = prev;
+        free(chunk);
+    }
+
+    memset(allocation, 0, sizeof(*allocation));
+
+    if (block->allocationCount > 0)
+        return;
+
+    _Bool keep = !block->dedicated;
+    uint32_t i;
+    for (i=0; i<allocator->blockCount && keep; i++)
+    {
+        struct GpuBlock* other = allocator->blocks[i];
+        if (other != block && other->memoryType == block->memoryType &&
+            !other->dedicated && other->allocationCount == 0)
+        {
+            keep = 0;
+        }
+    }
+
+    if (!keep)
+        freeGpuBlock(engine, block);
+}
+
+// Makes GPU writes visible to the host. Only needed for readback memory,
+// which may be host cached without being coherent.
+void gpuInvalidate(struct Engine* engine, struct GpuAllocation* allocation)
+{
+    struct GpuBlock* block = allocation->block;
+    VkMemoryPropertyFlags flags =
+        engine->memoryProperties.memoryTypes[block->memoryType].propertyFlags;
+    if (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+        return;
+
+    // The range has to be aligned to nonCoherentAtomSize, which may spill
+    // into neighbouring allocations but never past the block
+    VkDeviceSize atom = engine->deviceProperties.limits.nonCoherentAtomSize;
+    VkDeviceSize offset = allocation->offset & ~(atom - 1);
+    VkDeviceSize end = alignUp(allocation->offset + allocation->size, atom);
+    if (end > block->size)
+        end = block->size;
+
+    VkMappedMemoryRange range;
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.pNext = NULL;
+    range.memory = block->memory;
+    range.offset = offset;
+    range.size = end - offset;
+    vkInvalidateMappedMemoryRanges(engine->device, 1, &range);
+}
+
+struct GpuBlock* allocateGpuBlock(struct Engine* engine, uint32_t memoryType, VkDeviceSize size, _Bool dedicated)
+{
+    struct GpuAllocator* allocator = &(engine->allocator);
+
+    if (allocator->blockCount >= allocator->maxBlockCount)
+    {
+        fprintf(stderr, "Exceeded maxMemoryAllocationCount.\n");
+        exit(-1);
+    }
+
+    struct GpuBlock* block = calloc(1, sizeof(*block));
+    block->size = size;
+    block->memoryType = memoryType;
+    block->dedicated = dedicated;
+
+    VkMemoryAllocateInfo allocInfo;
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.pNext = NULL;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    VkResult result;
+    result = vkAllocateMemory(
+        engine->device,
+        &allocInfo,
+        NULL,
+        &(block->memory)
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to allocate GPU memory block.\n");
+        exit(-1);
+    }
+
+    VkMemoryPropertyFlags flags =
+        engine->memoryProperties.memoryTypes[memoryType].propertyFlags;
+    if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        // A block can only be mapped once, so every allocation in it shares
+        // this mapping for the block's lifetime
+        void* data;
+        result = vkMapMemory(
+            engine->device,
+            block->memory,
+            0,
+            VK_WHOLE_SIZE,
+            0,
+            &data
+        );
+        if (result != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to map GPU memory block.\n");
+            exit(-1);
+        }
+        block->mapped = data;
+    }
+
+    block->chunks = calloc(1, sizeof(*(block->chunks)));
+    block->chunks->offset = 0;
+    block->chunks->size = size;
+    block->chunks->free = 1;
+
+    if (allocator->blockCount == allocator->blockCapacity)
+    {
+        allocator->blockCapacity = allocator->blockCapacity ?
+            allocator->blockCapacity * 2 : 16;
+        allocator->blocks = realloc(
+            allocator->blocks,
+            allocator->blockCapacity * sizeof(*(allocator->blocks))
+        );
+    }
+    allocator->blocks[allocator->blockCount++] = block;
+
+    return block;
+}
+
+void freeGpuBlock(struct Engine* engine, struct GpuBlock* block)
+{
+    struct GpuAllocator* allocator = &(engine->allocator);
+
+    uint32_t i;
+    for (i=0; i<allocator->blockCount; i++)
+    {
+        if (allocator->blocks[i] == block)
+        {
+            allocator->blocks[i] = allocator->blocks[--allocator->blockCount];
+            break;
+        }
+    }
+
+    if (block->mapped)
+        vkUnmapMemory(engine->device, block->memory);
+    vkFreeMemory(engine->device, block->memory, NULL);
+
+    struct GpuChunk* chunk = block->chunks;
+    while (chunk)
+    {
+        struct GpuChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(block);
+}
+
+// First fit over the block's free chunks. Linear and optimal resources may
+// not share a bufferImageGranularity page, so a chunk next to a resource of
+// the other kind is padded out to the page boundary.
+_Bool allocateFromBlock(struct Engine* engine, struct GpuBlock* block, VkMemoryRequirements* requirements, _Bool linear, struct GpuAllocation* allocation)
+{
+    VkDeviceSize granularity = engine->allocator.bufferImageGranularity;
+    VkDeviceSize alignment = requirements->alignment ? requirements->alignment : 1;
+    VkDeviceSize size = requirements->size;
+
+    struct GpuChunk* chunk;
+    for (chunk = block->chunks; chunk; chunk = chunk->next)
+    {
+        if (!chunk->free || chunk->size < size)
+            continue;
+
+        VkDeviceSize offset = alignUp(chunk->offset, alignment);
+
+        // Free chunks never border each other, so the neighbours are in use
+        struct GpuChunk* prev = chunk->prev;
+        if (granularity > 1 && prev && prev->linear != linear &&
+            onSamePage(prev->offset + prev->size, offset, granularity))
+        {
+            offset = alignUp(offset, granularity);
+        }
+
+        VkDeviceSize end = offset + size;
+        if (end > chunk->offset + chunk->size)
+            continue;
+
+        struct GpuChunk* next = chunk->next;
+        if (granularity > 1 && next && next->linear != linear &&
+            onSamePage(end, next->offset, granularity))
+        {
+            continue;
+        }
+
+        // Split off the alignment padding in front and the remainder behind
+        if (offset > chunk->offset)
+        {
+            struct GpuChunk* padding = calloc(1, sizeof(*padding));
+            padding->offset = chunk->offset;
+            padding->size = offset - chunk->offset;
+            padding->free = 1;
+            padding->prev = prev;
+            padding->next = chunk;
+            if (prev)
+                prev->next = padding;
+            else
+                block->chunks = padding;
+            chunk->prev = padding;
+        }
+
+        VkDeviceSize chunkEnd = chunk->offset + chunk->size;
+        if (end < chunkEnd)
+        {
+            struct GpuChunk* remainder = calloc(1, sizeof(*remainder));
+            remainder->offset = end;
+            remainder->size = chunkEnd - end;
+            remainder->free = 1;
+            remainder->prev = chunk;
+            remainder->next = next;
+            if (next)
+                next->prev = remainder;
+            chunk->next = remainder;
+        }
+
+        chunk->offset = offset;
+        chunk->size = size;
+        chunk->free = 0;
+        chunk->linear = linear;
+
+        block->allocationCount++;
+        block->usedBytes += size;
+
+        allocation->memory = block->memory;
+        allocation->offset = offset;
+        allocation->size = size;
+        allocation->mapped = block->mapped ? block->mapped + offset : NULL;
+        allocation->block = block;
+        allocation->chunk = chunk;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Fills perType (VK_MAX_MEMORY_TYPES entries) and/or total, either may be NULL
+void gpuAllocatorStats(struct Engine* engine, struct GpuAllocatorStats* perType, struct GpuAllocatorStats* total)
+{
+    struct GpuAllocator* allocator = &(engine->allocator);
+
+    if (perType)
+        memset(perType, 0, VK_MAX_MEMORY_TYPES * sizeof(*perType));
+    if (total)
+        memset(total, 0, sizeof(*total));
+
+    uint32_t i;
+    for (i=0; i<allocator->blockCount; i++)
+    {
+        struct GpuBlock* block = allocator->blocks[i];
+        struct GpuAllocatorStats* stats[2] = {
+            perType ? &(perType[block->memoryType]) : NULL,
+            total
+        };
+
+        uint32_t j;
+        for (j=0; j<2; j++)
+        {
+            if (!stats[j])
+                continue;
+            stats[j]->blockCount++;
+            stats[j]->allocationCount += block->allocationCount;
+            stats[j]->blockBytes += block->size;
+            stats[j]->usedBytes += block->usedBytes;
+        }
+    }
+}
+
+void gpuAllocatorReport(struct Engine* engine, FILE* fp)
+{
+    struct GpuAllocatorStats perType[VK_MAX_MEMORY_TYPES];
+    struct GpuAllocatorStats total;
+    gpuAllocatorStats(engine, perType, &total);
+
+    VkPhysicalDeviceMemoryProperties* memProperties = &(engine->memoryProperties);
+    char flags[128];
+
+    fprintf(fp, "GPU memory:\n");
+    uint32_t i;
+    for (i=0; i<memProperties->memoryHeapCount; i++)
+    {
+        fprintf(
+            fp,
+            "  heap %2u: %10.2f MiB%s\n",
+            i,
+            memProperties->memoryHeaps[i].size / (1024.0 * 1024.0),
+            (memProperties->memoryHeaps[i].flags &
+                VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? " device-local" : ""
+        );
+    }
+    for (i=0; i<memProperties->memoryTypeCount; i++)
+    {
+        describeMemoryFlags(
+            memProperties->memoryTypes[i].propertyFlags,
+            flags,
+            sizeof(flags)
+        );
+        fprintf(
+            fp,
+            "  type %2u (heap %u):%s\n",
+            i,
+            memProperties->memoryTypes[i].heapIndex,
+            flags
+        );
+        if (perType[i].blockCount == 0)
+            continue;
+
+        fprintf(
+            fp,
+            "    %3u blocks %8.2f MiB, %5u allocations %8.2f MiB\n",
+            perType[i].blockCount,
+            perType[i].blockBytes / (1024.0 * 1024.0),
+            perType[i].allocationCount,
+            perType[i].usedBytes / (1024.0 * 1024.0)
+        );
+    }
+    fprintf(
+        fp,
+        "  total: %3u blocks %8.2f MiB, %5u allocations %8.2f MiB\n",
+        total.blockCount,
+        total.blockBytes / (1024.0 * 1024.0),
+        total.allocationCount,
+        total.usedBytes / (1024.0 * 1024.0)
+    );
+}
+
+// Writes the names of the set property flags, each preceded by a space
+void describeMemoryFlags(VkMemoryPropertyFlags flags, char* out, size_t size)
+{
+    static const struct
+    {
+        VkMemoryPropertyFlags flag;
+        const char* name;
+    } names[] = {
+        { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, "device-local" },
+        { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, "host-visible" },
+        { VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, "host-coherent" },
+        { VK_MEMORY_PROPERTY_HOST_CACHED_BIT, "host-cached" },
+        { VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, "lazily-allocated" }
+    };
+
+    size_t length = 0;
+    out[0] = '\0';
+    uint32_t i;
+    for (i=0; i<sizeof(names)/sizeof(names[0]) && length < size; i++)
+    {
+        if (flags & names[i].flag)
+            length += snprintf(out + length, size - length, " %s", names[i].name);
+    }
+}
+
+// SWAPCHAIN
+void createSwapChain(struct Engine* engine)
+{
+    if (engine->headless)
+    {
+        createOffscreenTargets(engine);
+        return;
+    }
+
+    struct SwapChainSupportDetails swapChainSupport;
+    swapChainSupport = querySwapChainSupport(engine, &(engine->physicalDevice));
+
+    VkSurfaceFormatKHR surfaceFormat;
+    surfaceFormat = chooseSwapSurfaceFormat(
+        swapChainSupport.formats,
+        swapChainSupport.formatCount
+    );
+
+    VkPresentModeKHR presentMode;
+    presentMode = chooseSwapPresentMode(
+        swapChainSupport.presentModes,
+        swapChainSupport.presentModeCount
+    );
+
+    VkExtent2D extent = chooseSwapExtent(&(swapChainSupport.capabilities));
+
+    // 0 max image count == no limit
+    engine->imageCount = swapChainSupport.capabilities.minImageCount+1;
+    if (swapChainSupport.capabilities.minImageCount > 0 &&
+        engine->imageCount > swapChainSupport.capabilities.maxImageCount)
+            engine->imageCount = swapChainSupport.capabilities.maxImageCount;
+
+    VkSwapchainCreateInfoKHR createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
     createInfo.pNext = NULL;
     createInfo.flags = 0;
     createInfo.surface = engine->surface;
@@ -1157,8 +3261,9 @@ void createSwapChain(struct Engine* engine)
     createInfo.presentMode = presentMode;
     createInfo.clipped = VK_TRUE;
 
-    VkSwapchainKHR oldSwapChain = engine->swapChain;
-    createInfo.oldSwapchain = oldSwapChain;
+    // When recreating, the old swapchain has been retired by
+    // recreateSwapChain and stays alive until its frames finish
+    createInfo.oldSwapchain = engine->swapChain;
 
     VkSwapchainKHR newSwapChain;
     VkResult result;
@@ -1176,10 +3281,6 @@ void createSwapChain(struct Engine* engine)
 
     engine->swapChain = newSwapChain;
 
-    // Destroy the old swapchain when recreating
-    if (oldSwapChain != VK_NULL_HANDLE)
-        vkDestroySwapchainKHR(engine->device, oldSwapChain, NULL);
-
     vkGetSwapchainImagesKHR(
         engine->device,
         engine->swapChain,
@@ -1205,52 +3306,196 @@ void createSwapChain(struct Engine* engine)
 
 void destroySwapChain(struct Engine* engine)
 {
+    if (engine->headless)
+    {
+        destroyOffscreenTargets(engine);
+        return;
+    }
+
+    // The device is idle by now, so nothing retired is still in use
+    uint32_t i;
+    for (i=0; i<engine->retiredSwapChainCount; i++)
+    {
+        destroyRetiredSwapChain(engine, &(engine->retiredSwapChains[i]));
+    }
+    free(engine->retiredSwapChains);
+
     freeSwapChainSupportDetails(&(engine->swapChainDetails));
     vkDestroySwapchainKHR(engine->device, engine->swapChain, NULL);
 }
 
-VkSurfaceFormatKHR chooseSwapSurfaceFormat(VkSurfaceFormatKHR* availableFormats, int formatCount)
+// Moves the current swapchain and everything sized to it onto the retired
+// list. The handles stay in the engine for createSwapChain's oldSwapchain
+// and until the create functions replace them.
+struct RetiredSwapChain* retireSwapChain(struct Engine* engine)
 {
-    if (formatCount == 1 && availableFormats->format == VK_FORMAT_UNDEFINED)
+    if (engine->retiredSwapChainCount == engine->retiredSwapChainCapacity)
     {
-        VkSurfaceFormatKHR noPreferredFormat = {
-            .format = VK_FORMAT_B8G8R8A8_UNORM,
-            .colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR
-        };
-        return noPreferredFormat;
+        engine->retiredSwapChainCapacity = engine->retiredSwapChainCapacity ?
+            engine->retiredSwapChainCapacity * 2 : 4;
+        engine->retiredSwapChains = realloc(
+            engine->retiredSwapChains,
+            engine->retiredSwapChainCapacity *
+                sizeof(*(engine->retiredSwapChains))
+        );
     }
 
-    int i;
-    for (i=0; i<formatCount; i++)
+    struct RetiredSwapChain* retired =
+        &(engine->retiredSwapChains[engine->retiredSwapChainCount++]);
+    retired->swapChain = engine->swapChain;
+    retired->imageCount = engine->imageCount;
+    retired->images = engine->swapChainImages;
+    retired->imageViews = engine->imageViews;
+    retired->framebuffers = engine->framebuffers;
+    retired->depthImage = engine->depthImage;
+    retired->depthImageMemory = engine->depthImageMemory;
+    retired->depthImageView = engine->depthImageView;
+    retired->renderPass = VK_NULL_HANDLE;
+    retired->submission = engine->submissions;
+
+    return retired;
+}
+
+// Destroys retired swapchains whose last submission has completed. A
+// retired render pass also waits for pipeline builds still using it.
+void releaseRetiredSwapChains(struct Engine* engine)
+{
+    uint32_t i = 0;
+    while (i < engine->retiredSwapChainCount)
     {
-        if (availableFormats[i].format == VK_FORMAT_B8G8R8A8_UNORM &&
-            availableFormats[i].colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
-                return availableFormats[i];
-    }
+        struct RetiredSwapChain* retired = &(engine->retiredSwapChains[i]);
+        if (retired->submission > engine->completedSubmissions ||
+            (retired->renderPass != VK_NULL_HANDLE &&
+             pipelineJobsUseRenderPass(engine, retired->renderPass)))
+        {
+            i++;
+            continue;
+        }
 
-    return *availableFormats;
+        destroyRetiredSwapChain(engine, retired);
+        engine->retiredSwapChains[i] =
+            engine->retiredSwapChains[--engine->retiredSwapChainCount];
+    }
 }
 
-VkPresentModeKHR chooseSwapPresentMode(VkPresentModeKHR* availablePresentModes, int presentModeCount)
+void destroyRetiredSwapChain(
+    struct Engine* engine,
+    struct RetiredSwapChain* retired
+)
 {
-    int i;
-    for (i=0; i<presentModeCount; i++)
+    uint32_t i;
+    for (i=0; i<retired->imageCount; i++)
     {
-        if (availablePresentModes[i] == VK_PRESENT_MODE_MAILBOX_KHR)
-            return availablePresentModes[i];
+        vkDestroyFramebuffer(engine->device, retired->framebuffers[i], NULL);
+        vkDestroyImageView(engine->device, retired->imageViews[i], NULL);
     }
+    free(retired->framebuffers);
+    free(retired->imageViews);
+    free(retired->images);
 
-    return VK_PRESENT_MODE_FIFO_KHR;
+    vkDestroyImageView(engine->device, retired->depthImageView, NULL);
+    gpuFree(engine, &(retired->depthImageMemory));
+    vkDestroyImage(engine->device, retired->depthImage, NULL);
+
+    vkDestroyRenderPass(engine->device, retired->renderPass, NULL);
+
+    // Images belong to the swapchain and go with it
+    vkDestroySwapchainKHR(engine->device, retired->swapChain, NULL);
 }
 
-VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR* capabilities)
+// Stands in for the swapchain when rendering headless. One image per frame
+// in flight, so the frame index doubles as the image index.
+void createOffscreenTargets(struct Engine* engine)
 {
-    if (capabilities->currentExtent.width != UINT32_MAX)
-    {
-        return capabilities->currentExtent;
-    }
+    engine->swapChainImageFormat = VK_FORMAT_R8G8B8A8_UNORM;
+    engine->swapChainExtent.width = WIDTH;
+    engine->swapChainExtent.height = HEIGHT;
+    engine->imageCount = engine->framesInFlight;
 
-    VkExtent2D actualExtent = {.width = WIDTH, .height = HEIGHT};
+    engine->swapChainImages = calloc(
+        engine->imageCount,
+        sizeof(*engine->swapChainImages)
+    );
+    engine->offscreenImageMemory = calloc(
+        engine->imageCount,
+        sizeof(*engine->offscreenImageMemory)
+    );
+
+    uint32_t i;
+    for (i=0; i<engine->imageCount; i++)
+    {
+        createImage(
+            engine,
+            engine->swapChainImageFormat,
+            engine->swapChainExtent.width,
+            engine->swapChainExtent.height,
+            1,
+            1,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+            GPU_MEMORY_DEVICE,
+            &(engine->swapChainImages[i]),
+            &(engine->offscreenImageMemory[i])
+        );
+    }
+}
+
+void destroyOffscreenTargets(struct Engine* engine)
+{
+    uint32_t i;
+    for (i=0; i<engine->imageCount; i++)
+    {
+        vkDestroyImage(engine->device, engine->swapChainImages[i], NULL);
+        gpuFree(engine, &(engine->offscreenImageMemory[i]));
+    }
+
+    free(engine->swapChainImages);
+    free(engine->offscreenImageMemory);
+}
+
+VkSurfaceFormatKHR chooseSwapSurfaceFormat(VkSurfaceFormatKHR* availableFormats, int formatCount)
+{
+    if (formatCount == 1 && availableFormats->format == VK_FORMAT_UNDEFINED)
+    {
+        VkSurfaceFormatKHR noPreferredFormat = {
+            .format = VK_FORMAT_B8G8R8A8_UNORM,
+            .colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR
+        };
+        return noPreferredFormat;
+    }
+
+    int i;
+    for (i=0; i<formatCount; i++)
+    {
+        if (availableFormats[i].format == VK_FORMAT_B8G8R8A8_UNORM &&
+            availableFormats[i].colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+                return availableFormats[i];
+    }
+
+    return *availableFormats;
+}
+
+VkPresentModeKHR chooseSwapPresentMode(VkPresentModeKHR* availablePresentModes, int presentModeCount)
+{
+    int i;
+    for (i=0; i<presentModeCount; i++)
+    {
+        if (availablePresentModes[i] == VK_PRESENT_MODE_MAILBOX_KHR)
+            return availablePresentModes[i];
+    }
+
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR* capabilities)
+{
+    if (capabilities->currentExtent.width != UINT32_MAX)
+    {
+        return capabilities->currentExtent;
+    }
+
+    VkExtent2D actualExtent = {.width = WIDTH, .height = HEIGHT};
     actualExtent.width = max(
         capabilities->minImageExtent.width,
         min(capabilities->maxImageExtent.width, actualExtent.width)
@@ -1279,6 +3524,7 @@ void createImageViews(struct Engine* engine)
             engine->swapChainImages[i],
             engine->swapChainImageFormat,
             VK_IMAGE_ASPECT_COLOR_BIT,
+            1,
             &(engine->imageViews[i])
         );
     }
@@ -1323,7 +3569,11 @@ void createRenderPass(struct Engine* engine)
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // Offscreen targets are left ready to be copied out by saveFrame
+    if (engine->headless)
+        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    else
+        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference colorAttachmentRef;
     colorAttachmentRef.attachment = 0;
@@ -1411,7 +3661,7 @@ void createDescriptorSetLayout(struct Engine* engine)
 {
     VkDescriptorSetLayoutBinding uboLayoutBinding;
     uboLayoutBinding.binding = 0;
-    uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     uboLayoutBinding.descriptorCount = 1;
     uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     uboLayoutBinding.pImmutableSamplers = NULL;
@@ -1459,35 +3709,253 @@ void destroyDescriptorSetLayout(struct Engine* engine)
     );
 }
 
+// PIPELINE CACHE
+// Seeds the pipeline cache with the data saved by the last run on the same
+// device and driver. Data from anywhere else is dropped, drivers are not
+// required to reject it themselves.
+void createPipelineCache(struct Engine* engine)
+{
+    struct FileView view;
+    memset(&view, 0, sizeof(view));
+
+    _Bool valid = 0;
+    if (engine->pipelineCachePath &&
+        openFileView(engine->pipelineCachePath, FILE_ACCESS_SEQUENTIAL, &view))
+    {
+        valid = pipelineCacheDataValid(engine, view.data, view.size);
+        if (!valid && view.size > 0)
+            fprintf(stderr, "%s is from another device or driver, ignoring it.\n", engine->pipelineCachePath);
+    }
+
+    VkPipelineCacheCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.initialDataSize = valid ? view.size : 0;
+    createInfo.pInitialData = valid ? view.data : NULL;
+
+    VkResult result;
+    result = vkCreatePipelineCache(
+        engine->device,
+        &createInfo,
+        NULL,
+        &(engine->pipelineCache)
+    );
+    closeFileView(&view);
+
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create pipeline cache.\n");
+        exit(-1);
+    }
+}
+
+// Saves the cache for the next run and destroys it
+void destroyPipelineCache(struct Engine* engine)
+{
+    if (engine->pipelineCachePath)
+        savePipelineCache(engine, engine->pipelineCachePath);
+
+    vkDestroyPipelineCache(engine->device, engine->pipelineCache, NULL);
+}
+
+// Checks the header every pipeline cache starts with against the device
+_Bool pipelineCacheDataValid(struct Engine* engine, const char* data, size_t size)
+{
+    // VkPipelineCacheHeaderVersionOne, little endian like the hosts we run on
+    uint32_t headerSize, headerVersion, vendorID, deviceID;
+    if (size < 16 + VK_UUID_SIZE)
+        return 0;
+
+    memcpy(&headerSize, data, 4);
+    memcpy(&headerVersion, data + 4, 4);
+    memcpy(&vendorID, data + 8, 4);
+    memcpy(&deviceID, data + 12, 4);
+
+    return headerSize >= 16 + VK_UUID_SIZE && headerSize <= size &&
+        headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        vendorID == engine->deviceProperties.vendorID &&
+        deviceID == engine->deviceProperties.deviceID &&
+        memcmp(
+            data + 16,
+            engine->deviceProperties.pipelineCacheUUID,
+            VK_UUID_SIZE
+        ) == 0;
+}
+
+// Writes the cache to a temporary file next to fname and renames it over
+// fname, so a crash mid-write never leaves a truncated cache behind
+void savePipelineCache(struct Engine* engine, const char* fname)
+{
+    size_t size = 0;
+    VkResult result;
+    result = vkGetPipelineCacheData(
+        engine->device,
+        engine->pipelineCache,
+        &size,
+        NULL
+    );
+    if (result != VK_SUCCESS || size == 0)
+        return;
+
+    char* data = malloc(size);
+    result = vkGetPipelineCacheData(
+        engine->device,
+        engine->pipelineCache,
+        &size,
+        data
+    );
+    if (result != VK_SUCCESS)
+    {
+        free(data);
+        return;
+    }
+
+    size_t tmpLength = strlen(fname) + 32;
+    char* tmpName = malloc(tmpLength);
+    snprintf(tmpName, tmpLength, "%s.%ld.tmp", fname, (long)getpid());
+
+    FILE* fp = fopen(tmpName, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s for writing.\n", tmpName);
+        free(tmpName);
+        free(data);
+        return;
+    }
+
+    _Bool written = fwrite(data, size, 1, fp) == 1 && fflush(fp) == 0 &&
+        fsync(fileno(fp)) == 0;
+    written = fclose(fp) == 0 && written;
+
+    if (!written || rename(tmpName, fname) != 0)
+    {
+        fprintf(stderr, "Failed to save pipeline cache to %s.\n", fname);
+        unlink(tmpName);
+    }
+
+    free(tmpName);
+    free(data);
+}
+
 // GRAPHICS PIPELINE
+// Creates the layout and, since the first frame needs it, compiles the
+// pipeline on the calling thread
 void createGraphicsPipeline(struct Engine* engine)
 {
-    char* vertShaderFname = "shaders/vert.spv";
-    char* fragShaderFname = "shaders/frag.spv";
-    char* vertShader = NULL; uint32_t vertShaderSize;
-    char* fragShader = NULL; uint32_t fragShaderSize;
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo;
+    memset(&pipelineLayoutInfo, 0, sizeof(pipelineLayoutInfo));
+    pipelineLayoutInfo.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    VkDescriptorSetLayout setLayouts[] = {
+        engine->descriptorSetLayout,
+        engine->bindless.layout
+    };
+    pipelineLayoutInfo.setLayoutCount = engine->bindless.enabled ? 2 : 1;
+    pipelineLayoutInfo.pSetLayouts = setLayouts;
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = engine->bindless.enabled ?
+        sizeof(uint32_t) : sizeof(struct DrawConstants);
+    pipelineLayoutInfo.pushConstantRangeCount =
+        engine->atlas.enabled || engine->bindless.enabled ? 1 : 0;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
 
-    vertShader = readFile(vertShaderFname, &vertShaderSize);
-    if (!vertShader)
+    if (vkCreatePipelineLayout(
+            engine->device,
+            &pipelineLayoutInfo,
+            NULL,
+            &(engine->pipelineLayout)
+    ) != VK_SUCCESS )
     {
-        fprintf(stderr, "Reading file %s failed.\n", vertShaderFname);
+        fprintf(stderr, "Failed to create pipeline layout.\n");
         exit(-1);
     }
 
-    fragShader = readFile(fragShaderFname, &fragShaderSize);
-    if (!fragShader)
+    engine->graphicsPipeline = buildGraphicsPipeline(
+        engine,
+        "shaders/vert.spv",
+        graphicsFragShader(engine),
+        engine->renderPass,
+        engine->pipelineLayout
+    );
+    if (engine->graphicsPipeline == VK_NULL_HANDLE)
     {
-        fprintf(stderr, "Reading file %s failed.\n", fragShaderFname);
-        free(vertShader);
+        fprintf(stderr, "Failed to create graphics pipeline.\n");
         exit(-1);
     }
+}
+
+void destroyGraphicsPipeline(struct Engine* engine)
+{
+    vkDestroyPipeline(engine->device, engine->graphicsPipeline, NULL);
+    vkDestroyPipelineLayout(engine->device, engine->pipelineLayout, NULL);
+}
 
-    VkShaderModule vertShaderModule;
-    VkShaderModule fragShaderModule;
-    createShaderModule(engine, vertShader, vertShaderSize, &vertShaderModule);
-    createShaderModule(engine, fragShader, fragShaderSize, &fragShaderModule);
+// Fragment shader for the texture mode in use
+const char* graphicsFragShader(struct Engine* engine)
+{
+    if (engine->atlas.enabled)
+        return "shaders/atlas_frag.spv";
+    else if (engine->bindless.enabled)
+        return "shaders/bindless_frag.spv";
+    return "shaders/frag.spv";
+}
+
+// Watched shaders are read from disk, a pack copy would hide every edit.
+// They're copied rather than mapped, truncating a mapped file while a
+// worker reads it would raise SIGBUS.
+_Bool openShader(struct Engine* engine, const char* fname, struct FileView* view)
+{
+    if (engine->shaderWatcher.enabled)
+        return readFileView(fname, view);
+    return openAsset(engine, fname, FILE_ACCESS_SEQUENTIAL, view);
+}
+
+// Safe to call from the pipeline compiler's workers, it only reads engine
+// state that is fixed after init. Returns VK_NULL_HANDLE on failure.
+VkPipeline buildGraphicsPipeline(
+    struct Engine* engine,
+    const char* vertShaderFname,
+    const char* fragShaderFname,
+    VkRenderPass renderPass,
+    VkPipelineLayout layout
+)
+{
+    struct FileView vertShader;
+    struct FileView fragShader;
+
+    if (!openShader(engine, vertShaderFname, &vertShader))
+    {
+        fprintf(stderr, "Reading file %s failed.\n", vertShaderFname);
+        return VK_NULL_HANDLE;
+    }
+
+    // Only the default shaders are checked in, the rest come from
+    // `make shaders`
+    if (!openShader(engine, fragShaderFname, &fragShader))
+    {
+        fprintf(stderr, "Reading file %s failed, `make shaders` builds it.\n", fragShaderFname);
+        closeFileView(&vertShader);
+        return VK_NULL_HANDLE;
+    }
+
+    // Mappings are page aligned and pack payloads at least 16 byte aligned,
+    // as pCode's uint32_t words need
+    VkShaderModule vertShaderModule = VK_NULL_HANDLE;
+    VkShaderModule fragShaderModule = VK_NULL_HANDLE;
+    _Bool modulesCreated =
+        createShaderModule(engine, vertShader.data, vertShader.size, &vertShaderModule) &&
+        createShaderModule(engine, fragShader.data, fragShader.size, &fragShaderModule);
+    closeFileView(&vertShader);
+    closeFileView(&fragShader);
+    if (!modulesCreated)
+    {
+        vkDestroyShaderModule(engine->device, vertShaderModule, NULL);
+        return VK_NULL_HANDLE;
+    }
 
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo;
     VkGraphicsPipelineCreateInfo pipelineInfo;
     VkPipelineShaderStageCreateInfo shaderStageInfos[2];
     VkPipelineVertexInputStateCreateInfo vertInputInfo;
@@ -1498,22 +3966,22 @@ void createGraphicsPipeline(struct Engine* engine)
     VkPipelineDepthStencilStateCreateInfo depthStencilInfo;
     VkPipelineViewportStateCreateInfo viewportInfo;
     VkPipelineMultisampleStateCreateInfo multisampleInfo;
-    //VkDynamicState dynamicStates[2];
-    //VkPipelineDynamicStateCreateInfo dyanamicStateInfo;
+    VkDynamicState dynamicStates[2];
+    VkPipelineDynamicStateCreateInfo dynamicStateInfo;
 
-    /*memset(&dynamicStates, 0, sizeof(dynamicStates));
+    // Set while recording, so the pipeline outlives swapchain resizes
     dynamicStates[0] = VK_DYNAMIC_STATE_VIEWPORT;
-    dynamicStates[1] = VK_DYNAMIC_STATE_LINE_WIDTH;
+    dynamicStates[1] = VK_DYNAMIC_STATE_SCISSOR;
     memset(&dynamicStateInfo, 0, sizeof(dynamicStateInfo));
     dynamicStateInfo.sType =
         VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
     dynamicStateInfo.dynamicStateCount = 2;
-    dynamicStateInfo.pDynamicStates = dynamicStates;*/
+    dynamicStateInfo.pDynamicStates = dynamicStates;
 
     memset(&pipelineInfo, 0, sizeof(pipelineInfo));
     pipelineInfo.sType =
         VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.layout = engine->pipelineLayout;
+    pipelineInfo.layout = layout;
     pipelineInfo.stageCount = 2;
 
     memset(shaderStageInfos, 0, 2*sizeof(shaderStageInfos[0]));
@@ -1566,26 +4034,13 @@ void createGraphicsPipeline(struct Engine* engine)
     rasterizationInfo.depthBiasSlopeFactor = 0.0f;
     rasterizationInfo.lineWidth = 1.0f;
 
-    VkViewport viewport;
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float) engine->swapChainExtent.width;
-    viewport.height = (float) engine->swapChainExtent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor;
-    scissor.offset.x = 0;
-    scissor.offset.y = 0;
-    scissor.extent = engine->swapChainExtent;
-
     memset(&viewportInfo, 0, sizeof(viewportInfo));
     viewportInfo.sType =
         VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewportInfo.viewportCount = 1;
-    viewportInfo.pViewports = &viewport;
+    viewportInfo.pViewports = NULL;
     viewportInfo.scissorCount = 1;
-    viewportInfo.pScissors = &scissor;
+    viewportInfo.pScissors = NULL;
 
     memset(&multisampleInfo, 0, sizeof(multisampleInfo));
     multisampleInfo.sType =
@@ -1597,26 +4052,6 @@ void createGraphicsPipeline(struct Engine* engine)
     multisampleInfo.alphaToCoverageEnable = VK_FALSE;
     multisampleInfo.alphaToOneEnable = VK_FALSE;
 
-    memset(&pipelineLayoutInfo, 0, sizeof(pipelineLayoutInfo));
-    pipelineLayoutInfo.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    VkDescriptorSetLayout setLayouts[] = {engine->descriptorSetLayout};
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = setLayouts;
-    pipelineLayoutInfo.pushConstantRangeCount = 0;
-    pipelineLayoutInfo.pPushConstantRanges = NULL;
-
-    if (vkCreatePipelineLayout(
-            engine->device,
-            &pipelineLayoutInfo,
-            NULL,
-            &(engine->pipelineLayout)
-    ) != VK_SUCCESS )
-    {
-        fprintf(stderr, "Failed to create pipeline layout.\n");
-        exit(-1);
-    }
-
     memset(&colorBlendAttachment, 0, sizeof(colorBlendAttachment));
     colorBlendAttachment.colorWriteMask =
         VK_COLOR_COMPONENT_R_BIT |
@@ -1664,70 +4099,42 @@ void createGraphicsPipeline(struct Engine* engine)
     pipelineInfo.pMultisampleState = &multisampleInfo;
     pipelineInfo.pDepthStencilState = &depthStencilInfo;
     pipelineInfo.pColorBlendState = &colorBlendInfo;
-    pipelineInfo.pDynamicState = NULL;
-    pipelineInfo.layout = engine->pipelineLayout;
-    pipelineInfo.renderPass = engine->renderPass;
+    pipelineInfo.pDynamicState = &dynamicStateInfo;
+    pipelineInfo.layout = layout;
+    pipelineInfo.renderPass = renderPass;
     pipelineInfo.subpass = 0;
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
+    VkPipeline pipeline;
     if (vkCreateGraphicsPipelines(
             engine->device,
-            VK_NULL_HANDLE,
+            engine->pipelineCache,
             1,
             &pipelineInfo,
             NULL,
-            &(engine->graphicsPipeline)
+            &pipeline
     ) != VK_SUCCESS)
     {
-        fprintf(stderr, "Failed to create graphics pipeline.\n");
-        exit(-1);
+        fprintf(stderr, "Failed to compile pipeline for %s.\n", fragShaderFname);
+        pipeline = VK_NULL_HANDLE;
     }
 
     // Free memory, shader modules no longer needed
-    free(vertShader);
-    free(fragShader);
     vkDestroyShaderModule(engine->device, vertShaderModule, NULL);
     vkDestroyShaderModule(engine->device, fragShaderModule, NULL);
     free(attribute);
-}
-
-void destroyGraphicsPipeline(struct Engine* engine)
-{
-    vkDestroyPipeline(engine->device, engine->graphicsPipeline, NULL);
-    vkDestroyPipelineLayout(engine->device, engine->pipelineLayout, NULL);
-}
-
-char* readFile(const char* fname, uint32_t* fsize)
-{
-    FILE *fp = fopen(fname, "r");
-
-    if (!fp)
-    {
-        fprintf(stderr, "Failed to load file %s.\n", fname);
-        return NULL;
-    }
-
-    fseek(fp, 0L, SEEK_END);
-    uint32_t length = ftell(fp);
-    rewind(fp);
-
-    char* buffer = malloc(length);
-    fread(buffer, length, 1, fp);
-    *fsize = length;
 
-    fclose(fp);
-
-    return buffer;
+    return pipeline;
 }
 
-void createShaderModule(struct Engine* engine, char* code, uint32_t codeSize, VkShaderModule* shaderModule)
+_Bool createShaderModule(struct Engine* engine, const char* code, size_t codeSize, VkShaderModule* shaderModule)
 {
     VkShaderModuleCreateInfo createInfo;
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     createInfo.pNext = NULL;
     createInfo.flags = 0;
     createInfo.codeSize = codeSize;
-    createInfo.pCode = (uint32_t*)code;
+    createInfo.pCode = (const uint32_t*)code;
 
     VkResult result;
     result = vkCreateShaderModule(
@@ -1740,1166 +4147,5924 @@ void createShaderModule(struct Engine* engine, char* code, uint32_t codeSize, Vk
     if (result != VK_SUCCESS)
     {
         fprintf(stderr, "Shader module creation failed.\n");
-        exit(-1);
+        return 0;
     }
+
+    return 1;
 }
 
-// FRAMEBUFFERS
-void createFramebuffers(struct Engine* engine)
+// PIPELINE COMPILER
+void createPipelineCompiler(struct Engine* engine)
 {
-    engine->framebuffers = malloc(
-            engine->imageCount * sizeof(*(engine->framebuffers)));
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
+
+    compiler->threadCount = PIPELINE_COMPILER_THREADS;
+    compiler->threads = calloc(
+        compiler->threadCount,
+        sizeof(*(compiler->threads))
+    );
+    compiler->jobs = NULL;
+    compiler->jobsTail = NULL;
+    compiler->shutdown = 0;
+    compiler->retiredCount = 0;
+    compiler->retiredCapacity = 0;
+    compiler->retired = NULL;
+    pthread_mutex_init(&(compiler->mutex), NULL);
+    pthread_cond_init(&(compiler->jobsReady), NULL);
 
     uint32_t i;
-    for (i=0; i<engine->imageCount; i++)
+    for (i=0; i<compiler->threadCount; i++)
     {
-        VkImageView attachments[] = {
-            engine->imageViews[i],
-            engine->depthImageView
-        };
-
-        VkFramebufferCreateInfo createInfo;
-        createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        createInfo.pNext = NULL;
-        createInfo.flags = 0;
-        createInfo.renderPass = engine->renderPass;
-        createInfo.attachmentCount = 2;
-        createInfo.pAttachments = attachments;
-        createInfo.width = engine->swapChainExtent.width;
-        createInfo.height = engine->swapChainExtent.height;
-        createInfo.layers = 1;
-
-        VkResult result;
-        result = vkCreateFramebuffer(
-            engine->device,
-            &createInfo,
-            NULL,
-            &(engine->framebuffers[i])
-        );
-
-        if (result != VK_SUCCESS)
+        if (pthread_create(&(compiler->threads[i]), NULL, pipelineWorker, engine) != 0)
         {
-            fprintf(stderr, "Error during framebuffer creation.\n");
+            fprintf(stderr, "Failed to create pipeline compiler thread.\n");
             exit(-1);
         }
     }
 }
 
-void destroyFramebuffers(struct Engine* engine)
+// Waits for builds in progress, then drops every job that was never
+// installed. The device must be idle.
+void destroyPipelineCompiler(struct Engine* engine)
 {
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
+
+    pthread_mutex_lock(&(compiler->mutex));
+    compiler->shutdown = 1;
+    pthread_cond_broadcast(&(compiler->jobsReady));
+    pthread_mutex_unlock(&(compiler->mutex));
+
     uint32_t i;
-    for (i=0; i< engine->imageCount; i++)
+    for (i=0; i<compiler->threadCount; i++)
+        pthread_join(compiler->threads[i], NULL);
+
+    struct PipelineJob* job = compiler->jobs;
+    while (job)
     {
-        vkDestroyFramebuffer(engine->device, engine->framebuffers[i], NULL);
+        struct PipelineJob* next = job->next;
+        if (job->state == PIPELINE_JOB_DONE)
+            vkDestroyPipeline(engine->device, job->pipeline, NULL);
+        free(job);
+        job = next;
     }
-}
 
-// COMMAND POOL
-void createCommandPool(struct Engine* engine)
-{
-    VkCommandPoolCreateInfo createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0; // Relates to reset frequency of command buffers
-    createInfo.queueFamilyIndex = engine->queueFamilyIndices.graphicsFamily;
+    for (i=0; i<compiler->retiredCount; i++)
+        vkDestroyPipeline(engine->device, compiler->retired[i].pipeline, NULL);
+    free(compiler->retired);
 
-    VkResult result;
-    result = vkCreateCommandPool(
-        engine->device,
-        &createInfo,
-        NULL,
-        &(engine->commandPool)
-    );
+    pthread_cond_destroy(&(compiler->jobsReady));
+    pthread_mutex_destroy(&(compiler->mutex));
+    free(compiler->threads);
+}
 
-    if (result != VK_SUCCESS)
+// Queues a pipeline with the engine's vertex shader, render pass and layout.
+// *target keeps its current pipeline, or VK_NULL_HANDLE, until a frame
+// installs the result. Earlier requests for target are superseded.
+void requestGraphicsPipeline(
+    struct Engine* engine,
+    const char* fragShader,
+    VkPipeline* target
+)
+{
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
+
+    struct PipelineJob* job = malloc(sizeof(*job));
+    job->state = PIPELINE_JOB_QUEUED;
+    job->superseded = 0;
+    job->vertShader = "shaders/vert.spv";
+    job->fragShader = fragShader;
+    job->renderPass = engine->renderPass;
+    job->layout = engine->pipelineLayout;
+    job->target = target;
+    job->pipeline = VK_NULL_HANDLE;
+    job->next = NULL;
+
+    pthread_mutex_lock(&(compiler->mutex));
+    struct PipelineJob* other;
+    for (other = compiler->jobs; other; other = other->next)
     {
-        fprintf(stderr, "Failed to create command pool.\n");
-        exit(-1);
+        if (other->target == target)
+            other->superseded = 1;
     }
-}
 
-void destroyCommandPool(struct Engine* engine)
-{
-    vkDestroyCommandPool(engine->device, engine->commandPool, NULL);
+    if (compiler->jobsTail)
+        compiler->jobsTail->next = job;
+    else
+        compiler->jobs = job;
+    compiler->jobsTail = job;
+    pthread_cond_signal(&(compiler->jobsReady));
+    pthread_mutex_unlock(&(compiler->mutex));
 }
 
-// DEPTH RESOURCES
-void createDepthResources(struct Engine* engine)
+// Called at the start of a frame, before anything is recorded. Replaced
+// pipelines are retired until the frames bound to them have finished.
+void installCompiledPipelines(struct Engine* engine)
 {
-    createImage(
-        engine,
-        engine->depthFormat,
-        engine->swapChainExtent.width,
-        engine->swapChainExtent.height,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        &(engine->depthImage),
-        &(engine->depthImageMemory)
-    );
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
 
-    createImageView(
-        engine,
-        engine->depthImage,
-        engine->depthFormat,
-        VK_IMAGE_ASPECT_DEPTH_BIT,
-        &(engine->depthImageView)
-    );
+    pthread_mutex_lock(&(compiler->mutex));
+    struct PipelineJob* previous = NULL;
+    struct PipelineJob* job = compiler->jobs;
+    while (job)
+    {
+        struct PipelineJob* next = job->next;
 
-    transitionImageLayout(
-        engine,
-        engine->depthImage,
-        engine->depthFormat,
-        VK_IMAGE_LAYOUT_UNDEFINED,
-        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
-    );
-}
+        // Superseded jobs that never started are dropped along with the
+        // finished ones
+        if (job->state == PIPELINE_JOB_BUILDING ||
+            (job->state == PIPELINE_JOB_QUEUED && !job->superseded))
+        {
+            previous = job;
+            job = next;
+            continue;
+        }
 
-void destroyDepthResources(struct Engine* engine)
-{
-    vkDestroyImageView(engine->device, engine->depthImageView, NULL);
-    vkFreeMemory(engine->device, engine->depthImageMemory, NULL);
-    vkDestroyImage(engine->device, engine->depthImage, NULL);
-}
+        // A failed build leaves the target as it was
+        if (job->superseded || job->pipeline == VK_NULL_HANDLE)
+        {
+            vkDestroyPipeline(engine->device, job->pipeline, NULL);
+        }
+        else
+        {
+            retirePipeline(engine, *(job->target));
+            *(job->target) = job->pipeline;
+        }
 
-_Bool hasStencilComponent(VkFormat format)
-{
-    return format == VK_FORMAT_D32_SFLOAT_S8_UINT ||
-            format == VK_FORMAT_D24_UNORM_S8_UINT;
+        if (previous)
+            previous->next = next;
+        else
+            compiler->jobs = next;
+        if (compiler->jobsTail == job)
+            compiler->jobsTail = previous;
+        free(job);
+        job = next;
+    }
+    pthread_mutex_unlock(&(compiler->mutex));
 }
 
-VkFormat findSupportedFormat(struct Engine* engine, VkFormat* candidates, uint32_t candidateCount, VkImageTiling tiling, VkFormatFeatureFlags features)
+// Whether a job that is queued or building was set up with renderPass
+_Bool pipelineJobsUseRenderPass(
+    struct Engine* engine,
+    VkRenderPass renderPass
+)
 {
-    uint32_t i;
-    for (i=0; i<candidateCount; i++)
-    {
-        VkFormatProperties props;
-        vkGetPhysicalDeviceFormatProperties(
-            engine->physicalDevice,
-            candidates[i],
-            &props
-        );
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
 
-        if (tiling == VK_IMAGE_TILING_LINEAR &&
-            (props.linearTilingFeatures & features) == features)
-        {
-            return candidates[i];
-        }
-        else if (tiling == VK_IMAGE_TILING_OPTIMAL &&
-                (props.optimalTilingFeatures & features) == features)
-        {
-            return candidates[i];
-        }
+    _Bool used = 0;
+    pthread_mutex_lock(&(compiler->mutex));
+    struct PipelineJob* job;
+    for (job = compiler->jobs; job; job = job->next)
+    {
+        if (job->state != PIPELINE_JOB_DONE && job->renderPass == renderPass)
+            used = 1;
     }
+    pthread_mutex_unlock(&(compiler->mutex));
 
-    fprintf(stderr, "Failed to find supported depth format.\n");
-    exit(-1);
+    return used;
 }
 
-// TEXTURE IMAGE
-void createTextureImage(struct Engine* engine)
+void retirePipeline(struct Engine* engine, VkPipeline pipeline)
 {
-    char* imageSrc = "textures/dog.jpeg";
-    int texWidth, texHeight, texChannels;
-    stbi_uc* pixels = stbi_load(
-        imageSrc,
-        &texWidth,
-        &texHeight,
-        &texChannels,
-        STBI_rgb_alpha
-    );
-    VkDeviceSize imageSize = texWidth * texHeight * 4;
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
+    if (pipeline == VK_NULL_HANDLE)
+        return;
 
-    if (!pixels)
+    if (compiler->retiredCount == compiler->retiredCapacity)
     {
-        fprintf(stderr, "stb_image failed to load resource %s\n", imageSrc);
-        exit(-1);
+        compiler->retiredCapacity = compiler->retiredCapacity ?
+            compiler->retiredCapacity * 2 : 4;
+        compiler->retired = realloc(
+            compiler->retired,
+            compiler->retiredCapacity * sizeof(*(compiler->retired))
+        );
     }
 
-    VkImage stagingImage;
-    VkDeviceMemory stagingImageMemory;
-
-    createImage(
-        engine,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        texWidth,
-        texHeight,
-        VK_IMAGE_TILING_LINEAR,
-        VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        &stagingImage,
-        &stagingImageMemory
-    );
+    struct RetiredPipeline* retired =
+        &(compiler->retired[compiler->retiredCount++]);
+    retired->pipeline = pipeline;
+    retired->submission = engine->submissions;
+}
 
-    void* data;
-    vkMapMemory(engine->device, stagingImageMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels, (size_t)imageSize);
-    vkUnmapMemory(engine->device, stagingImageMemory);
+void releaseRetiredPipelines(struct Engine* engine)
+{
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
 
-    stbi_image_free(pixels);
+    uint32_t i = 0;
+    while (i < compiler->retiredCount)
+    {
+        struct RetiredPipeline* retired = &(compiler->retired[i]);
+        if (retired->submission > engine->completedSubmissions)
+        {
+            i++;
+            continue;
+        }
 
-    createImage(
-        engine,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        texWidth,
-        texHeight,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        &(engine->textureImage),
-        &(engine->textureImageMemory)
-    );
+        vkDestroyPipeline(engine->device, retired->pipeline, NULL);
+        compiler->retired[i] = compiler->retired[--compiler->retiredCount];
+    }
+}
 
-    transitionImageLayout(
-        engine,
-        stagingImage,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_LAYOUT_PREINITIALIZED,
-        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
-    );
-    transitionImageLayout(
-        engine,
-        engine->textureImage,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_LAYOUT_PREINITIALIZED,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-    );
-    copyImage(engine, stagingImage, engine->textureImage, texWidth, texHeight);
+void* pipelineWorker(void* arg)
+{
+    struct Engine* engine = arg;
+    struct PipelineCompiler* compiler = &(engine->pipelineCompiler);
 
-    transitionImageLayout(
-        engine,
-        engine->textureImage,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-    );
+    pthread_mutex_lock(&(compiler->mutex));
+    for (;;)
+    {
+        struct PipelineJob* job = NULL;
+        while (!compiler->shutdown)
+        {
+            for (job = compiler->jobs; job; job = job->next)
+            {
+                if (job->state == PIPELINE_JOB_QUEUED && !job->superseded)
+                    break;
+            }
+            if (job)
+                break;
+            pthread_cond_wait(&(compiler->jobsReady), &(compiler->mutex));
+        }
+        if (compiler->shutdown)
+            break;
 
-    vkDestroyImage(
-        engine->device,
-        stagingImage,
-        NULL
-    );
+        job->state = PIPELINE_JOB_BUILDING;
+        pthread_mutex_unlock(&(compiler->mutex));
 
-    vkFreeMemory(
-        engine->device,
-        stagingImageMemory,
-        NULL
-    );
-}
+        VkPipeline pipeline = buildGraphicsPipeline(
+            engine,
+            job->vertShader,
+            job->fragShader,
+            job->renderPass,
+            job->layout
+        );
 
-void destroyTextureImage(struct Engine* engine)
-{
-    vkDestroyImage(
-        engine->device,
-        engine->textureImage,
-        NULL
-    );
+        pthread_mutex_lock(&(compiler->mutex));
+        job->pipeline = pipeline;
+        job->state = PIPELINE_JOB_DONE;
+    }
+    pthread_mutex_unlock(&(compiler->mutex));
 
-    vkFreeMemory(
-        engine->device,
-        engine->textureImageMemory,
-        NULL
-    );
+    return NULL;
 }
 
-void createImage(struct Engine* engine, VkFormat format, uint32_t texWidth, uint32_t texHeight, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags propertyFlags, VkImage* stagingImage, VkDeviceMemory* stagingImageMemory)
+// SHADER WATCHER
+void createShaderWatcher(struct Engine* engine)
 {
-    VkImageCreateInfo createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0;
-    createInfo.imageType = VK_IMAGE_TYPE_2D;
-    createInfo.format = format;
-    createInfo.extent.width = texWidth;
-    createInfo.extent.height = texHeight;
-    createInfo.extent.depth = 1;
-    createInfo.mipLevels = 1;
-    createInfo.arrayLayers = 1;
-    createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    createInfo.tiling = tiling;
-    createInfo.usage = usage;
-    createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    createInfo.queueFamilyIndexCount = 0;
-    createInfo.pQueueFamilyIndices = NULL;
-    createInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
+    struct ShaderWatcher* watcher = &(engine->shaderWatcher);
+    watcher->fd = -1;
+    watcher->compilerMissing = 0;
+    watcher->compileCount = 0;
+    if (!watcher->enabled)
+        return;
 
-    VkResult result;
-    result = vkCreateImage(
-        engine->device,
-        &createInfo,
-        NULL,
-        stagingImage
-    );
-    if (result != VK_SUCCESS)
+    // Editors either rewrite a file or rename a new one over it
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0 ||
+        inotify_add_watch(
+            watcher->fd,
+            SHADER_WATCH_DIR,
+            IN_CLOSE_WRITE | IN_MOVED_TO
+        ) < 0)
     {
-        fprintf(stderr, "Failed to create texture image.\n");
-        exit(-1);
+        fprintf(stderr, "Can't watch %s, shader reload is off: %s\n",
+            SHADER_WATCH_DIR, strerror(errno));
+        if (watcher->fd >= 0)
+            close(watcher->fd);
+        watcher->fd = -1;
+        watcher->enabled = 0;
     }
+}
 
-    VkMemoryRequirements memRequirements;
-    vkGetImageMemoryRequirements(
-        engine->device,
-        *stagingImage,
-        &memRequirements
-    );
-
-    VkMemoryAllocateInfo allocInfo;
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.pNext = NULL;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemType(
-        engine,
-        memRequirements.memoryTypeBits,
-        propertyFlags
-    );
+// Compiles still running are short, so they're waited for rather than killed
+void destroyShaderWatcher(struct Engine* engine)
+{
+    struct ShaderWatcher* watcher = &(engine->shaderWatcher);
+    if (!watcher->enabled)
+        return;
 
-    result = vkAllocateMemory(
-        engine->device,
-        &allocInfo,
-        NULL,
-        stagingImageMemory
-    );
-    if (result != VK_SUCCESS)
+    // Compiles still running are waited for, so none leaves its temporary
+    // output behind
+    uint32_t i;
+    for (i=0; i<watcher->compileCount; i++)
     {
-        fprintf(stderr, "Failed to allocate texture image memory.\n");
-        exit(-1);
+        struct ShaderCompile* compile = &(watcher->compiles[i]);
+        int status = 0;
+        pid_t pid = waitpid(compile->pid, &status, 0);
+        while (pid < 0 && errno == EINTR)
+            pid = waitpid(compile->pid, &status, 0);
+
+        finishShaderCompile(compile, pid, status);
+        free(compile->name);
     }
-
-    vkBindImageMemory(engine->device, *stagingImage, *stagingImageMemory, 0);
+    close(watcher->fd);
 }
 
-void transitionImageLayout(struct Engine* engine, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout)
+// Called once per frame before finished pipelines are installed. Every
+// change read this frame is covered by a single pipeline request.
+void pollShaderWatcher(struct Engine* engine)
 {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+    struct ShaderWatcher* watcher = &(engine->shaderWatcher);
+    if (!watcher->enabled)
+        return;
 
-    VkImageMemoryBarrier barrier;
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.pNext = NULL;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = image;
+    reapShaderCompiles(engine);
 
-    if (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    _Bool rebuild = 0;
+    for (;;)
     {
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        // EAGAIN once the queue is drained
+        ssize_t length = read(watcher->fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            break;
 
-        if (hasStencilComponent(format))
+        char* p = buffer;
+        while (p < buffer + length)
         {
-            barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            p += sizeof(*event) + event->len;
+
+            // Changes were dropped, reload to be safe
+            if (event->mask & IN_Q_OVERFLOW)
+                rebuild = 1;
+            else if (event->len > 0 && shaderChanged(engine, event->name))
+                rebuild = 1;
         }
     }
-    else
+
+    if (rebuild)
     {
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        fprintf(stderr, "Reloading shaders.\n");
+        requestGraphicsPipeline(
+            engine,
+            graphicsFragShader(engine),
+            &(engine->graphicsPipeline)
+        );
     }
+}
 
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
+// Handles one changed file of SHADER_WATCH_DIR. GLSL sources start a
+// compile, returns whether the file is SPIR-V the pipeline uses.
+_Bool shaderChanged(struct Engine* engine, const char* name)
+{
+    size_t length = strlen(name);
+    if (length > 4 && strcmp(name + length - 4, ".spv") == 0)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", SHADER_WATCH_DIR, name);
+        return strcmp(path, "shaders/vert.spv") == 0 ||
+            strcmp(path, graphicsFragShader(engine)) == 0;
+    }
+
+    startShaderCompile(engine, name);
+    return 0;
+}
+
+// SPIR-V file the Makefile builds from the GLSL source name, 0 for files
+// that aren't shader sources
+_Bool shaderSpirvPath(const char* name, char* path, size_t size)
+{
+    size_t length = strlen(name);
+    if (strcmp(name, "shader.vert") == 0)
+        snprintf(path, size, "%s/vert.spv", SHADER_WATCH_DIR);
+    else if (strcmp(name, "shader.frag") == 0)
+        snprintf(path, size, "%s/frag.spv", SHADER_WATCH_DIR);
+    else if (length > 5 && strcmp(name + length - 5, ".frag") == 0)
+        snprintf(path, size, "%s/%.*s_frag.spv",
+            SHADER_WATCH_DIR, (int)(length - 5), name);
+    else
+        return 0;
+
+    return 1;
+}
 
-    if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED &&
-        newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+// Runs SHADER_COMPILER in the background when name is a shader source
+void startShaderCompile(struct Engine* engine, const char* name)
+{
+    struct ShaderWatcher* watcher = &(engine->shaderWatcher);
+    char spirv[PATH_MAX];
+    if (watcher->compilerMissing ||
+        !shaderSpirvPath(name, spirv, sizeof(spirv)))
+        return;
+
+    uint32_t i;
+    for (i=0; i<watcher->compileCount; i++)
     {
-        barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        if (strcmp(watcher->compiles[i].name, name) == 0)
+        {
+            watcher->compiles[i].again = 1;
+            return;
+        }
     }
-    else if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED &&
-             newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
+
+    if (watcher->compileCount == SHADER_MAX_COMPILES)
     {
-        barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        fprintf(stderr, "Too many shader compiles running, skipped %s.\n", name);
+        return;
     }
-    else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
-             newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+
+    // Written next to the .spv and renamed over it once the compile
+    // succeeds, so no reader ever sees a half written file
+    char source[PATH_MAX];
+    char output[PATH_MAX + sizeof(".tmp")];
+    snprintf(source, sizeof(source), "%s/%s", SHADER_WATCH_DIR, name);
+    snprintf(output, sizeof(output), "%s.tmp", spirv);
+    char* argv[] = {
+        SHADER_COMPILER,
+        "-V",
+        source,
+        "-o",
+        output,
+        NULL
+    };
+    pid_t pid;
+    int error = posix_spawnp(&pid, SHADER_COMPILER, NULL, NULL, argv, environ);
+    if (error == ENOENT)
     {
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        fprintf(stderr, "%s not found, only SPIR-V changes reload.\n", SHADER_COMPILER);
+        watcher->compilerMissing = 1;
+        return;
     }
-    else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
-             newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    else if (error != 0)
     {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
-                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        fprintf(stderr, "Failed to run %s: %s\n", SHADER_COMPILER, strerror(error));
+        return;
     }
-    else
+
+    struct ShaderCompile* compile = &(watcher->compiles[watcher->compileCount++]);
+    compile->pid = pid;
+    compile->name = strdup(name);
+    compile->again = 0;
+}
+
+// Collects compiles that have exited and moves their output over the .spv.
+// A failed compile leaves the old .spv, and with it the current pipeline,
+// in place.
+void reapShaderCompiles(struct Engine* engine)
+{
+    struct ShaderWatcher* watcher = &(engine->shaderWatcher);
+
+    uint32_t i = 0;
+    while (i < watcher->compileCount)
     {
-        fprintf(stderr, "Unsupported layout transition.\n");
-        exit(-1);
+        struct ShaderCompile* compile = &(watcher->compiles[i]);
+        int status = 0;
+        pid_t pid = waitpid(compile->pid, &status, WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == EINTR))
+        {
+            i++;
+            continue;
+        }
+
+        finishShaderCompile(compile, pid, status);
+
+        char* name = compile->name;
+        _Bool again = compile->again;
+        watcher->compiles[i] = watcher->compiles[--watcher->compileCount];
+
+        if (again)
+            startShaderCompile(engine, name);
+        free(name);
     }
+}
 
-    vkCmdPipelineBarrier(
-        commandBuffer,
-        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-        0,
-        0,
-        NULL,
-        0,
-        NULL,
-        1,
-        &barrier
-    );
+// Moves a compile's output over its .spv once the compiler has succeeded,
+// and deletes it otherwise. pid and status are what waitpid returned for
+// the compiler.
+void finishShaderCompile(const struct ShaderCompile* compile, pid_t pid, int status)
+{
+    int error = errno;
+    char spirv[PATH_MAX];
+    char output[PATH_MAX + sizeof(".tmp")];
+    shaderSpirvPath(compile->name, spirv, sizeof(spirv));
+    snprintf(output, sizeof(output), "%s.tmp", spirv);
+
+    // ECHILD, the child was reaped elsewhere and its result is unknown
+    if (pid < 0)
+    {
+        fprintf(stderr, "Lost the compile of %s: %s\n",
+            compile->name, strerror(error));
+        unlink(output);
+    }
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "Compiling %s failed.\n", compile->name);
+        unlink(output);
+    }
+    else if (rename(output, spirv) != 0)
+    {
+        fprintf(stderr, "Failed to replace %s: %s\n", spirv, strerror(errno));
+        unlink(output);
+    }
+}
 
-    endSingleTimeCommands(engine, commandBuffer);
+// FILE VIEW
+// Maps the whole file read-only, so its pages are shared with the page
+// cache instead of copied into a heap buffer. access is a mask of
+// FILE_ACCESS_* hints passed on to madvise. Returns 0 with errno set when
+// the file can't be opened or mapped.
+_Bool openFileView(const char* fname, uint32_t access, struct FileView* view)
+{
+    view->data = NULL;
+    view->size = 0;
+    view->mapping = NULL;
+    view->mappingSize = 0;
+    view->buffer = NULL;
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    // mmap rejects empty mappings, an empty view needs none
+    if (st.st_size > 0)
+    {
+        void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return 0;
+        }
+        view->data = data;
+        view->size = (size_t)st.st_size;
+        view->mapping = data;
+        view->mappingSize = view->size;
+    }
+
+    // The mapping keeps the file referenced
+    close(fd);
+
+    adviseFileView(view, 0, view->size, access);
+    return 1;
 }
 
-void copyImage(struct Engine* engine, VkImage src, VkImage dst, uint32_t width, uint32_t height)
+// Reads the whole file into a heap buffer the view owns, for files that
+// may be rewritten while the view is open. Returns 0 with errno set on
+// failure.
+_Bool readFileView(const char* fname, struct FileView* view)
 {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+    view->data = NULL;
+    view->size = 0;
+    view->mapping = NULL;
+    view->mappingSize = 0;
+    view->buffer = NULL;
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
 
-    VkImageSubresourceLayers subresource;
-    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    subresource.baseArrayLayer = 0;
-    subresource.mipLevel = 0;
-    subresource.layerCount = 1;
-
-    VkImageCopy region;
-    region.srcSubresource = subresource;
-    region.srcOffset = (VkOffset3D){0, 0, 0};
-    region.dstSubresource = subresource;
-    region.dstOffset = (VkOffset3D){0, 0, 0};
-    region.extent.width = width;
-    region.extent.height = height;
-    region.extent.depth = 1;
-
-    vkCmdCopyImage(
-        commandBuffer,
-        src,
-        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        dst,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        1,
-        &region
-    );
+    // Stops early should the file shrink underneath the read
+    size_t capacity = (size_t)st.st_size;
+    char* buffer = malloc(capacity > 0 ? capacity : 1);
+    size_t size = 0;
+    while (size < capacity)
+    {
+        ssize_t count = read(fd, buffer + size, capacity - size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+        {
+            int error = errno;
+            free(buffer);
+            close(fd);
+            errno = error;
+            return 0;
+        }
+        if (count == 0)
+            break;
+        size += (size_t)count;
+    }
+    close(fd);
 
-    endSingleTimeCommands(engine, commandBuffer);
+    view->data = buffer;
+    view->size = size;
+    view->buffer = buffer;
+    return 1;
 }
 
-// TEXTURE IMAGE VIEW
-void createTextureImageView(struct Engine* engine)
+void closeFileView(struct FileView* view)
 {
-    createImageView(
-        engine,
-        engine->textureImage,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_ASPECT_COLOR_BIT,
-        &(engine->textureImageView)
-    );
+    if (view->mapping)
+        munmap(view->mapping, view->mappingSize);
+    free(view->buffer);
+
+    view->data = NULL;
+    view->size = 0;
+    view->mapping = NULL;
+    view->mappingSize = 0;
+    view->buffer = NULL;
 }
 
-void destroyTextureImageView(struct Engine* engine)
+// Hints how a range of the view is about to be read. Hints are advisory,
+// failures are ignored.
+void adviseFileView(const struct FileView* view, size_t offset, size_t size, uint32_t access)
 {
-    vkDestroyImageView(engine->device, engine->textureImageView, NULL);
+    if (!view->data || offset >= view->size)
+        return;
+
+    // madvise wants a page aligned start, views into the asset pack start
+    // anywhere within a page
+    uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(view->data + offset);
+    uintptr_t end = start + (size < view->size - offset ? size : view->size - offset);
+    start &= ~(pageSize - 1);
+    void* address = (void*)start;
+
+    if (access & FILE_ACCESS_SEQUENTIAL)
+        madvise(address, end - start, MADV_SEQUENTIAL);
+    if (access & FILE_ACCESS_RANDOM)
+        madvise(address, end - start, MADV_RANDOM);
+    if (access & FILE_ACCESS_PREFETCH)
+        madvise(address, end - start, MADV_WILLNEED);
 }
 
-void createImageView(struct Engine* engine, VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, VkImageView* imageView)
+// ASSET PACK
+// Maps the pack at engine->assetPackPath, or assets.pack when none was
+// given. A missing default pack is not an error, assets then load as loose
+// files.
+void openAssetPack(struct Engine* engine)
 {
-    VkImageViewCreateInfo createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0;
-    createInfo.image = image;
-    createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    createInfo.format = format;
-    createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-    createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-    createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-    createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    createInfo.subresourceRange.aspectMask = aspectFlags;
-    createInfo.subresourceRange.baseMipLevel = 0;
-    createInfo.subresourceRange.levelCount = 1;
-    createInfo.subresourceRange.baseArrayLayer = 0;
-    createInfo.subresourceRange.layerCount = 1;
+    struct AssetPack* pack = &(engine->assetPack);
+    const char* fname = engine->assetPackPath ? engine->assetPackPath : "assets.pack";
+    memset(pack, 0, sizeof(*pack));
 
-    VkResult result;
-    result = vkCreateImageView(
-        engine->device,
-        &createInfo,
-        NULL,
-        imageView
-    );
-    if (result != VK_SUCCESS)
+    // Entries are looked up all over the table, payloads read as needed
+    if (!openFileView(fname, FILE_ACCESS_RANDOM, &(pack->file)))
     {
-        fprintf(stderr, "Failed to create image view for texture.\n");
+        if (engine->assetPackPath)
+        {
+            fprintf(stderr, "Failed to open asset pack %s.\n", fname);
+            exit(-1);
+        }
+        return;
+    }
+
+    const char* data = pack->file.data;
+    uint64_t size = pack->file.size;
+    struct PackHeader header;
+    if (size < sizeof(header))
+    {
+        fprintf(stderr, "%s is too short for an asset pack.\n", fname);
         exit(-1);
     }
-}
+    memcpy(&header, data, sizeof(header));
 
-// TEXTURE SAMPLER
-void createTextureSampler(struct Engine* engine)
-{
-    VkSamplerCreateInfo createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0;
-    createInfo.magFilter = VK_FILTER_LINEAR;
-    createInfo.minFilter = VK_FILTER_LINEAR;
-    createInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-    createInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    createInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    createInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    createInfo.mipLodBias =0.0f;
-    createInfo.anisotropyEnable = VK_TRUE;
-    createInfo.maxAnisotropy = 16;
-    createInfo.compareEnable = VK_FALSE;
-    createInfo.compareOp = VK_COMPARE_OP_ALWAYS;
-    createInfo.minLod = 0.0f;
-    createInfo.maxLod = 0.0f;
-    createInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-    createInfo.unnormalizedCoordinates = VK_FALSE;
+    if (memcmp(header.magic, PACK_MAGIC, PACK_MAGIC_SIZE) != 0 ||
+        header.version != PACK_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %u asset pack.\n", fname, PACK_VERSION);
+        exit(-1);
+    }
 
-    VkResult result;
-    result = vkCreateSampler(
-        engine->device,
-        &createInfo,
-        NULL,
-        &(engine->textureSampler)
-    );
-    if (result != VK_SUCCESS)
+    // Tables must lie within the file and entries and buckets be aligned
+    // for direct access
+    uint64_t entryBytes = (uint64_t)header.entryCount * sizeof(struct PackEntry);
+    uint64_t bucketBytes = (uint64_t)header.bucketCount * sizeof(uint32_t);
+    if (header.bucketCount == 0 ||
+        (header.bucketCount & (header.bucketCount - 1)) != 0 ||
+        header.bucketCount < header.entryCount ||
+        header.entryOffset % 8 != 0 || header.bucketOffset % 4 != 0 ||
+        header.entryOffset > size || entryBytes > size - header.entryOffset ||
+        header.bucketOffset > size || bucketBytes > size - header.bucketOffset ||
+        header.nameOffset > size || header.nameSize > size - header.nameOffset ||
+        header.nameSize == 0 || data[header.nameOffset + header.nameSize - 1] != '\0')
     {
-        fprintf(stderr, "Failed to create texture sampler.\n");
+        fprintf(stderr, "%s is corrupt.\n", fname);
         exit(-1);
     }
+
+    pack->entryCount = header.entryCount;
+    pack->bucketCount = header.bucketCount;
+    pack->entries = (const struct PackEntry*)(data + header.entryOffset);
+    pack->buckets = (const uint32_t*)(data + header.bucketOffset);
+    pack->names = data + header.nameOffset;
+    pack->nameSize = header.nameSize;
 }
 
-void destroyTextureSampler(struct Engine* engine)
+void closeAssetPack(struct Engine* engine)
 {
-    vkDestroySampler(
-        engine->device,
-        engine->textureSampler,
-        NULL
-    );
+    closeFileView(&(engine->assetPack.file));
 }
 
-// VERTEX BUFFER
-void createVertexBuffer(struct Engine* engine)
+// Expected O(1): one hash, then a linear probe from the name's bucket that
+// ends at the first empty bucket. Returns NULL when the pack has no such
+// asset or no pack is open.
+const struct PackEntry* findPackEntry(const struct AssetPack* pack, const char* name)
 {
-    VkDeviceSize bufferSize = sizeof(engine->vertices[0]) * engine->vertexCount;
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
+    if (!pack->file.data)
+        return NULL;
 
-    createBuffer(
-        engine,
-        bufferSize,
-        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        &(stagingBuffer),
-        &(stagingBufferMemory)
-    );
+    uint64_t hash = packHash(name);
+    uint32_t mask = pack->bucketCount - 1;
+    uint32_t bucket = (uint32_t)hash & mask;
 
-    void* data;
-    vkMapMemory(
-        engine->device,
-        stagingBufferMemory,
-        0,
-        bufferSize,
-        0,
-        &data
-    );
-    memcpy(data, engine->vertices, (size_t)bufferSize);
-    vkUnmapMemory(engine->device, stagingBufferMemory);
+    uint32_t probes;
+    for (probes=0; probes<pack->bucketCount; probes++)
+    {
+        uint32_t index = pack->buckets[bucket];
+        if (index == 0 || index > pack->entryCount)
+            return NULL;
 
-    createBuffer(
-        engine,
-        bufferSize,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        &(engine->vertexBuffer),
-        &(engine->vertexBufferMemory)
-    );
-    copyBuffer(
-        engine,
-        &(stagingBuffer),
-        &(engine->vertexBuffer),
-        bufferSize
-    );
+        const struct PackEntry* entry = &(pack->entries[index - 1]);
+        if (entry->hash == hash && entry->nameOffset < pack->nameSize &&
+            strcmp(pack->names + entry->nameOffset, name) == 0)
+        {
+            return entry;
+        }
 
-    vkDestroyBuffer(engine->device, stagingBuffer, NULL);
-    vkFreeMemory(engine->device, stagingBufferMemory, NULL);
+        bucket = (bucket + 1) & mask;
+    }
+    return NULL;
 }
 
-void copyBuffer(struct Engine* engine, VkBuffer* src, VkBuffer* dst, VkDeviceSize size)
+// Opens an asset from the pack when it holds one, else the loose file at
+// the same path. Stored entries are views into the pack's mapping, LZ4
+// entries are decompressed into a buffer the view owns.
+_Bool openAsset(struct Engine* engine, const char* name, uint32_t access, struct FileView* view)
 {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+    struct AssetPack* pack = &(engine->assetPack);
+    const struct PackEntry* entry = findPackEntry(pack, name);
+    if (!entry)
+        return openFileView(name, access, view);
 
-    VkBufferCopy copyRegion;
-    copyRegion.srcOffset = 0;
-    copyRegion.dstOffset = 0;
-    copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, *src, *dst, 1, &copyRegion);
+    if (entry->offset > pack->file.size ||
+        entry->size > pack->file.size - entry->offset)
+    {
+        fprintf(stderr, "Asset %s lies outside the pack.\n", name);
+        return 0;
+    }
 
-    endSingleTimeCommands(engine, commandBuffer);
-}
+    view->data = pack->file.data + entry->offset;
+    view->size = entry->size;
+    view->mapping = NULL;
+    view->mappingSize = 0;
+    view->buffer = NULL;
 
-VkCommandBuffer beginSingleTimeCommands(struct Engine* engine)
-{
-    VkCommandBufferAllocateInfo allocInfo;
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.pNext = NULL;
-    allocInfo.commandPool = engine->commandPool;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = 1;
+    if (entry->compression == PACK_COMPRESSION_NONE)
+    {
+        adviseFileView(view, 0, view->size, access);
+        return 1;
+    }
 
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(engine->device, &allocInfo, &commandBuffer);
+    // Decompression reads the payload once, front to back
+    adviseFileView(view, 0, view->size, FILE_ACCESS_SEQUENTIAL | FILE_ACCESS_PREFETCH);
 
-    VkCommandBufferBeginInfo beginInfo;
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.pNext = NULL;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    beginInfo.pInheritanceInfo = NULL;
+    char* buffer = NULL;
+    if (entry->compression == PACK_COMPRESSION_LZ4 &&
+        entry->uncompressedSize <= SIZE_MAX)
+    {
+        buffer = malloc(entry->uncompressedSize > 0 ? (size_t)entry->uncompressedSize : 1);
+    }
+    if (!buffer || !lz4Decompress(
+            (const unsigned char*)view->data,
+            view->size,
+            (unsigned char*)buffer,
+            (size_t)entry->uncompressedSize
+        ))
+    {
+        fprintf(stderr, "Failed to decompress asset %s.\n", name);
+        free(buffer);
+        view->data = NULL;
+        view->size = 0;
+        return 0;
+    }
+
+    view->data = buffer;
+    view->size = (size_t)entry->uncompressedSize;
+    view->buffer = buffer;
+    return 1;
+}
+
+// Bytes of an LZ4 length beyond the 15 its token holds
+static _Bool lz4ReadLength(const unsigned char* src, size_t srcSize, size_t* pos, size_t* length)
+{
+    unsigned char byte;
+    do
+    {
+        if (*pos >= srcSize)
+            return 0;
+        byte = src[(*pos)++];
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+// Decodes a single LZ4 block, bounds checked against both buffers since
+// pack contents are not trusted. Succeeds only if the block fills dst
+// exactly.
+_Bool lz4Decompress(const unsigned char* src, size_t srcSize, unsigned char* dst, size_t dstSize)
+{
+    size_t s = 0;
+    size_t d = 0;
+    while (s < srcSize)
+    {
+        unsigned char token = src[s++];
+
+        size_t length = token >> 4;
+        if (length == 15 && !lz4ReadLength(src, srcSize, &s, &length))
+            return 0;
+        if (length > srcSize - s || length > dstSize - d)
+            return 0;
+        memcpy(dst + d, src + s, length);
+        s += length;
+        d += length;
+
+        // The last sequence has no match
+        if (s == srcSize)
+            break;
+
+        if (srcSize - s < 2)
+            return 0;
+        size_t offset = src[s] | ((size_t)src[s + 1] << 8);
+        s += 2;
+        if (offset == 0 || offset > d)
+            return 0;
+
+        length = token & 0xF;
+        if (length == 15 && !lz4ReadLength(src, srcSize, &s, &length))
+            return 0;
+        length += 4;
+        if (length > dstSize - d)
+            return 0;
+
+        // Matches may overlap their own output, copy forwards byte by byte
+        size_t i;
+        for (i=0; i<length; i++)
+            dst[d + i] = dst[d - offset + i];
+        d += length;
+    }
+    return d == dstSize;
+}
+
+// ASYNC IO
+// Reads go into an io_uring and are submitted together, with one syscall,
+// the next time a completion is waited for, so a whole batch is in flight
+// at once. Without io_uring (old kernels, seccomp sandboxes) a few threads
+// issue blocking preads instead.
+void createAsyncIo(struct Engine* engine)
+{
+    struct AsyncIo* io = &(engine->asyncIo);
+    memset(io, 0, sizeof(*io));
+    io->ringFd = -1;
+
+    if (createIoRing(io, ASYNC_IO_QUEUE_DEPTH))
+    {
+        io->uring = 1;
+        return;
+    }
+
+    io->threadCount = ASYNC_IO_THREADS;
+    io->threads = calloc(io->threadCount, sizeof(*(io->threads)));
+    pthread_mutex_init(&(io->mutex), NULL);
+    pthread_cond_init(&(io->requestsReady), NULL);
+    pthread_cond_init(&(io->requestsDone), NULL);
+
+    uint32_t i;
+    for (i=0; i<io->threadCount; i++)
+    {
+        if (pthread_create(&(io->threads[i]), NULL, ioWorker, io) != 0)
+        {
+            fprintf(stderr, "Failed to create I/O thread.\n");
+            exit(-1);
+        }
+    }
+}
+
+void destroyAsyncIo(struct Engine* engine)
+{
+    struct AsyncIo* io = &(engine->asyncIo);
+
+    if (io->uring)
+    {
+        destroyIoRing(io);
+        return;
+    }
+
+    pthread_mutex_lock(&(io->mutex));
+    io->shutdown = 1;
+    pthread_cond_broadcast(&(io->requestsReady));
+    pthread_mutex_unlock(&(io->mutex));
+
+    uint32_t i;
+    for (i=0; i<io->threadCount; i++)
+        pthread_join(io->threads[i], NULL);
+
+    pthread_cond_destroy(&(io->requestsDone));
+    pthread_cond_destroy(&(io->requestsReady));
+    pthread_mutex_destroy(&(io->mutex));
+    free(io->threads);
+}
+
+// Sets up the ring with raw syscalls, returns 0 if the kernel refuses
+_Bool createIoRing(struct AsyncIo* io, uint32_t entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return 0;
+    io->ringFd = fd;
+
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    io->cqRingSize = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings with a single mmap
+    _Bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap)
+    {
+        if (io->cqRingSize > io->sqRingSize)
+            io->sqRingSize = io->cqRingSize;
+        io->cqRingSize = io->sqRingSize;
+    }
+
+    void* sqRing = mmap(
+        NULL,
+        io->sqRingSize,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_SQ_RING
+    );
+    io->sqRing = sqRing == MAP_FAILED ? NULL : sqRing;
+
+    void* cqRing = sqRing;
+    if (!singleMap)
+    {
+        cqRing = mmap(
+            NULL,
+            io->cqRingSize,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            fd,
+            IORING_OFF_CQ_RING
+        );
+    }
+    io->cqRing = cqRing == MAP_FAILED ? NULL : cqRing;
+
+    void* sqes = mmap(
+        NULL,
+        io->sqesSize,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_SQES
+    );
+    io->sqes = sqes == MAP_FAILED ? NULL : sqes;
+
+    if (!io->sqRing || !io->cqRing || !io->sqes)
+    {
+        destroyIoRing(io);
+        return 0;
+    }
+
+    char* sq = io->sqRing;
+    io->sqTail = (uint32_t*)(sq + params.sq_off.tail);
+    io->sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    io->sqArray = (uint32_t*)(sq + params.sq_off.array);
+    io->sqEntries = params.sq_entries;
+
+    char* cq = io->cqRing;
+    io->cqHead = (uint32_t*)(cq + params.cq_off.head);
+    io->cqTail = (uint32_t*)(cq + params.cq_off.tail);
+    io->cqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 1;
+}
+
+void destroyIoRing(struct AsyncIo* io)
+{
+    if (io->sqes)
+        munmap(io->sqes, io->sqesSize);
+    if (io->cqRing && io->cqRing != io->sqRing)
+        munmap(io->cqRing, io->cqRingSize);
+    if (io->sqRing)
+        munmap(io->sqRing, io->sqRingSize);
+    if (io->ringFd >= 0)
+        close(io->ringFd);
+
+    io->sqes = NULL;
+    io->cqRing = NULL;
+    io->sqRing = NULL;
+    io->ringFd = -1;
+}
+
+// Queues a read of size bytes (at least 1) at offset of fd into buffer.
+// Nothing is guaranteed to start before the next waitRead.
+void submitRead(struct Engine* engine, struct IoRequest* request)
+{
+    struct AsyncIo* io = &(engine->asyncIo);
+    request->done = 0;
+    request->error = 0;
+    request->next = NULL;
+    io->outstanding++;
+
+    if (io->uring)
+    {
+        // Reads beyond the ring's depth wait for earlier ones to complete
+        if (io->ringUsed < io->sqEntries)
+            pushRingRead(io, request);
+        else
+            queueIoRequest(io, request);
+        return;
+    }
+
+    pthread_mutex_lock(&(io->mutex));
+    queueIoRequest(io, request);
+    pthread_cond_signal(&(io->requestsReady));
+    pthread_mutex_unlock(&(io->mutex));
+}
+
+// Returns the next request whose read has finished, successfully or with
+// error set, blocking until there is one. NULL once every submitted request
+// has been returned.
+struct IoRequest* waitRead(struct Engine* engine)
+{
+    struct AsyncIo* io = &(engine->asyncIo);
+    if (io->outstanding == 0)
+        return NULL;
+
+    struct IoRequest* request;
+    if (io->uring)
+    {
+        request = waitRingRead(io);
+    }
+    else
+    {
+        pthread_mutex_lock(&(io->mutex));
+        while (!io->completed)
+            pthread_cond_wait(&(io->requestsDone), &(io->mutex));
+        request = io->completed;
+        io->completed = request->next;
+        pthread_mutex_unlock(&(io->mutex));
+    }
+
+    io->outstanding--;
+    return request;
+}
+
+void queueIoRequest(struct AsyncIo* io, struct IoRequest* request)
+{
+    request->next = NULL;
+    if (io->queueTail)
+        io->queueTail->next = request;
+    else
+        io->queue = request;
+    io->queueTail = request;
+}
+
+struct IoRequest* dequeueIoRequest(struct AsyncIo* io)
+{
+    struct IoRequest* request = io->queue;
+    if (request)
+    {
+        io->queue = request->next;
+        if (!io->queue)
+            io->queueTail = NULL;
+    }
+    return request;
+}
+
+// Writes the unread remainder of the request into the next submission
+// queue entry. Only this thread writes the tail, the kernel reads it.
+void pushRingRead(struct AsyncIo* io, struct IoRequest* request)
+{
+    uint32_t tail = *(io->sqTail);
+    uint32_t index = tail & io->sqMask;
+
+    request->iov.iov_base = request->buffer + request->done;
+    request->iov.iov_len = request->size - request->done;
+
+    struct io_uring_sqe* sqe = &(io->sqes[index]);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = request->fd;
+    sqe->off = request->offset + request->done;
+    sqe->addr = (uint64_t)(uintptr_t)&(request->iov);
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+
+    io->sqArray[index] = index;
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    io->ringUsed++;
+    io->sqPending++;
+}
+
+struct IoRequest* waitRingRead(struct AsyncIo* io)
+{
+    for (;;)
+    {
+        uint32_t head = *(io->cqHead);
+        if (head == __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE))
+        {
+            // Submits everything queued since the last wait and sleeps
+            // until at least one read completes
+            long result = syscall(
+                __NR_io_uring_enter,
+                io->ringFd,
+                io->sqPending,
+                1,
+                IORING_ENTER_GETEVENTS,
+                NULL,
+                0
+            );
+            if (result < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+                exit(-1);
+            }
+            io->sqPending -= (uint32_t)result;
+            continue;
+        }
+
+        struct io_uring_cqe* cqe = &(io->cqes[head & io->cqMask]);
+        struct IoRequest* request = (struct IoRequest*)(uintptr_t)cqe->user_data;
+        int32_t result = cqe->res;
+        __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+        io->ringUsed--;
+
+        _Bool finished = advanceRead(request, result);
+        if (!finished)
+            pushRingRead(io, request);
+
+        while (io->queue && io->ringUsed < io->sqEntries)
+            pushRingRead(io, dequeueIoRequest(io));
+
+        if (finished)
+            return request;
+    }
+}
+
+// Accounts for one read syscall's result, a byte count or -errno. Returns
+// whether the request is finished, short reads continue where they stopped.
+_Bool advanceRead(struct IoRequest* request, long result)
+{
+    if (result == -EINTR || result == -EAGAIN)
+        return 0;
+    if (result < 0)
+    {
+        request->error = (int)-result;
+        return 1;
+    }
+    // End of file before size bytes, the file shrank
+    if (result == 0)
+    {
+        request->error = EIO;
+        return 1;
+    }
+
+    request->done += (size_t)result;
+    return request->done >= request->size;
+}
+
+void* ioWorker(void* arg)
+{
+    struct AsyncIo* io = arg;
+
+    pthread_mutex_lock(&(io->mutex));
+    for (;;)
+    {
+        while (!io->shutdown && !io->queue)
+            pthread_cond_wait(&(io->requestsReady), &(io->mutex));
+        if (io->shutdown)
+            break;
+
+        struct IoRequest* request = dequeueIoRequest(io);
+        pthread_mutex_unlock(&(io->mutex));
+
+        _Bool finished = 0;
+        while (!finished)
+        {
+            ssize_t result = pread(
+                request->fd,
+                request->buffer + request->done,
+                request->size - request->done,
+                (off_t)(request->offset + request->done)
+            );
+            finished = advanceRead(request, result < 0 ? -errno : (long)result);
+        }
+
+        pthread_mutex_lock(&(io->mutex));
+        request->next = io->completed;
+        io->completed = request;
+        pthread_cond_signal(&(io->requestsDone));
+    }
+    pthread_mutex_unlock(&(io->mutex));
+
+    return NULL;
+}
+
+// FRAMEBUFFERS
+void createFramebuffers(struct Engine* engine)
+{
+    engine->framebuffers = malloc(
+            engine->imageCount * sizeof(*(engine->framebuffers)));
+
+    uint32_t i;
+    for (i=0; i<engine->imageCount; i++)
+    {
+        VkImageView attachments[] = {
+            engine->imageViews[i],
+            engine->depthImageView
+        };
+
+        VkFramebufferCreateInfo createInfo;
+        createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        createInfo.pNext = NULL;
+        createInfo.flags = 0;
+        createInfo.renderPass = engine->renderPass;
+        createInfo.attachmentCount = 2;
+        createInfo.pAttachments = attachments;
+        createInfo.width = engine->swapChainExtent.width;
+        createInfo.height = engine->swapChainExtent.height;
+        createInfo.layers = 1;
+
+        VkResult result;
+        result = vkCreateFramebuffer(
+            engine->device,
+            &createInfo,
+            NULL,
+            &(engine->framebuffers[i])
+        );
+
+        if (result != VK_SUCCESS)
+        {
+            fprintf(stderr, "Error during framebuffer creation.\n");
+            exit(-1);
+        }
+    }
+}
+
+void destroyFramebuffers(struct Engine* engine)
+{
+    uint32_t i;
+    for (i=0; i< engine->imageCount; i++)
+    {
+        vkDestroyFramebuffer(engine->device, engine->framebuffers[i], NULL);
+    }
+}
+
+// COMMAND POOL
+void createCommandPool(struct Engine* engine)
+{
+    VkCommandPoolCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0; // Relates to reset frequency of command buffers
+    createInfo.queueFamilyIndex = engine->queueFamilyIndices.graphicsFamily;
+
+    VkResult result;
+    result = vkCreateCommandPool(
+        engine->device,
+        &createInfo,
+        NULL,
+        &(engine->commandPool)
+    );
+
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create command pool.\n");
+        exit(-1);
+    }
+}
+
+void destroyCommandPool(struct Engine* engine)
+{
+    vkDestroyCommandPool(engine->device, engine->commandPool, NULL);
+}
+
+// DEPTH RESOURCES
+void createDepthResources(struct Engine* engine)
+{
+    createImage(
+        engine,
+        engine->depthFormat,
+        engine->swapChainExtent.width,
+        engine->swapChainExtent.height,
+        1,
+        1,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+        GPU_MEMORY_DEVICE,
+        &(engine->depthImage),
+        &(engine->depthImageMemory)
+    );
+
+    // No layout transition, the render pass takes the depth attachment
+    // from UNDEFINED. A one-off transition here would wait for the graphics
+    // queue to go idle on every swapchain recreate.
+    createImageView(
+        engine,
+        engine->depthImage,
+        engine->depthFormat,
+        VK_IMAGE_ASPECT_DEPTH_BIT,
+        1,
+        &(engine->depthImageView)
+    );
+}
+
+void destroyDepthResources(struct Engine* engine)
+{
+    vkDestroyImageView(engine->device, engine->depthImageView, NULL);
+    gpuFree(engine, &(engine->depthImageMemory));
+    vkDestroyImage(engine->device, engine->depthImage, NULL);
+}
+
+_Bool hasStencilComponent(VkFormat format)
+{
+    return format == VK_FORMAT_D32_SFLOAT_S8_UINT ||
+            format == VK_FORMAT_D24_UNORM_S8_UINT;
+}
+
+VkFormat findSupportedFormat(struct Engine* engine, VkFormat* candidates, uint32_t candidateCount, VkImageTiling tiling, VkFormatFeatureFlags features)
+{
+    uint32_t i;
+    for (i=0; i<candidateCount; i++)
+    {
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(
+            engine->physicalDevice,
+            candidates[i],
+            &props
+        );
+
+        if (tiling == VK_IMAGE_TILING_LINEAR &&
+            (props.linearTilingFeatures & features) == features)
+        {
+            return candidates[i];
+        }
+        else if (tiling == VK_IMAGE_TILING_OPTIMAL &&
+                (props.optimalTilingFeatures & features) == features)
+        {
+            return candidates[i];
+        }
+    }
+
+    fprintf(stderr, "Failed to find supported depth format.\n");
+    exit(-1);
+}
+
+// DECODE POOL
+// Staging memory the calling thread's next decode may write its output to
+// instead of a heap buffer. size is the decoded image, capacity leaves room
+// for the padding some decoders add to their output allocation.
+struct DecodeTarget
+{
+    void* memory;
+    size_t size;
+    size_t capacity;
+    _Bool claimed;
+};
+static _Thread_local struct DecodeTarget decodeTarget;
+
+// Hands out the thread's decode target for the first allocation the size of
+// the decoded image, which is the output buffer for every format stb_image
+// reads into req_comp channels. Should an intermediate buffer of the same
+// size claim it instead, the image lands on the heap and is copied as before.
+// Only set for decoders that write each output byte once and never read it
+// back, see decodeImage.
+void* decodeMalloc(size_t size)
+{
+    struct DecodeTarget* target = &decodeTarget;
+    if (target->memory && !target->claimed &&
+        size >= target->size && size <= target->capacity)
+    {
+        target->claimed = 1;
+        return target->memory;
+    }
+    return malloc(size);
+}
+
+void* decodeRealloc(void* p, size_t size)
+{
+    struct DecodeTarget* target = &decodeTarget;
+    if (!p)
+        return decodeMalloc(size);
+    if (!target->memory || p != target->memory)
+        return realloc(p, size);
+
+    // Outgrew the target, continue on the heap
+    if (size <= target->capacity)
+        return p;
+    void* grown = malloc(size);
+    if (grown)
+    {
+        memcpy(grown, p, target->capacity);
+        target->claimed = 0;
+    }
+    return grown;
+}
+
+void decodeFree(void* p)
+{
+    struct DecodeTarget* target = &decodeTarget;
+    if (target->memory && p == target->memory)
+    {
+        target->claimed = 0;
+        return;
+    }
+    free(p);
+}
+
+void createDecodePool(struct Engine* engine)
+{
+    struct DecodePool* pool = &(engine->decodePool);
+
+    // The main thread mostly sleeps while a batch decodes, so every core
+    // gets a worker unless --decode-threads says otherwise
+    uint32_t threadCount = engine->decodeThreads;
+    if (threadCount == 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = cores > 0 ? (uint32_t)cores : 1;
+    }
+
+    pool->threadCount = threadCount;
+    pool->threads = calloc(threadCount, sizeof(*(pool->threads)));
+    pool->jobs = NULL;
+    pool->jobCount = 0;
+    pool->nextJob = 0;
+    pool->pendingJobs = 0;
+    pool->shutdown = 0;
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pthread_cond_init(&(pool->jobsReady), NULL);
+    pthread_cond_init(&(pool->jobsDone), NULL);
+
+    uint32_t i;
+    for (i=0; i<threadCount; i++)
+    {
+        if (pthread_create(&(pool->threads[i]), NULL, decodeWorker, pool) != 0)
+        {
+            fprintf(stderr, "Failed to create decode thread.\n");
+            exit(-1);
+        }
+    }
+}
+
+void destroyDecodePool(struct Engine* engine)
+{
+    struct DecodePool* pool = &(engine->decodePool);
+
+    pthread_mutex_lock(&(pool->mutex));
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&(pool->jobsReady));
+    pthread_mutex_unlock(&(pool->mutex));
+
+    uint32_t i;
+    for (i=0; i<pool->threadCount; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&(pool->jobsDone));
+    pthread_cond_destroy(&(pool->jobsReady));
+    pthread_mutex_destroy(&(pool->mutex));
+    free(pool->threads);
+}
+
+// Opens a batch of jobCount jobs. Workers start on each job as soon as it
+// is queued.
+void beginDecodeBatch(struct Engine* engine, uint32_t jobCount)
+{
+    struct DecodePool* pool = &(engine->decodePool);
+
+    pthread_mutex_lock(&(pool->mutex));
+    pool->jobs = calloc(jobCount > 0 ? jobCount : 1, sizeof(*(pool->jobs)));
+    pool->jobCount = 0;
+    pool->nextJob = 0;
+    pool->pendingJobs = jobCount;
+    pthread_mutex_unlock(&(pool->mutex));
+}
+
+void queueDecodeJob(struct Engine* engine, struct DecodeJob* job)
+{
+    struct DecodePool* pool = &(engine->decodePool);
+
+    pthread_mutex_lock(&(pool->mutex));
+    pool->jobs[pool->jobCount++] = job;
+    pthread_cond_signal(&(pool->jobsReady));
+    pthread_mutex_unlock(&(pool->mutex));
+}
+
+// Returns once every job of the batch has been queued and has finished.
+// Failed jobs are flagged rather than reported.
+void finishDecodeBatch(struct Engine* engine)
+{
+    struct DecodePool* pool = &(engine->decodePool);
+
+    pthread_mutex_lock(&(pool->mutex));
+    while (pool->pendingJobs > 0)
+        pthread_cond_wait(&(pool->jobsDone), &(pool->mutex));
+
+    free(pool->jobs);
+    pool->jobs = NULL;
+    pool->jobCount = 0;
+    pool->nextJob = 0;
+    pthread_mutex_unlock(&(pool->mutex));
+}
+
+void* decodeWorker(void* arg)
+{
+    struct DecodePool* pool = arg;
+
+    pthread_mutex_lock(&(pool->mutex));
+    for (;;)
+    {
+        while (!pool->shutdown && pool->nextJob >= pool->jobCount)
+            pthread_cond_wait(&(pool->jobsReady), &(pool->mutex));
+        if (pool->shutdown)
+            break;
+
+        struct DecodeJob* job = pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&(pool->mutex));
+
+        decodeImage(job);
+
+        pthread_mutex_lock(&(pool->mutex));
+        if (--pool->pendingJobs == 0)
+            pthread_cond_signal(&(pool->jobsDone));
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+
+    return NULL;
+}
+
+// JPEG files start with an SOI marker followed by another marker
+_Bool isJpeg(const struct FileView* file)
+{
+    const unsigned char* data = (const unsigned char*)file->data;
+    return file->size >= 3 &&
+        data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+// Runs on a worker. Writes the job's levels tightly packed one after the
+// other from job->dst on.
+void decodeImage(struct DecodeJob* job)
+{
+    // A single level JPEG is decoded in place. Reading uncached staging
+    // memory back is slow, so the CPU mip fallback, which reads level 0, and
+    // PNG, whose unfiltering reads the previous output row, decode to the
+    // heap and copy.
+    size_t levelSize = (size_t)job->width * job->height * 4;
+    if (job->mipLevels == 1 && isJpeg(&(job->file)))
+    {
+        decodeTarget.memory = job->dst;
+        decodeTarget.size = levelSize;
+        decodeTarget.capacity = levelSize + DECODE_TARGET_PADDING;
+        decodeTarget.claimed = 0;
+    }
+
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load_from_memory(
+        (const stbi_uc*)job->file.data,
+        (int)job->file.size,
+        &width,
+        &height,
+        &channels,
+        STBI_rgb_alpha
+    );
+    decodeTarget.memory = NULL;
+
+    if (!pixels || (uint32_t)width != job->width ||
+        (uint32_t)height != job->height)
+    {
+        if (pixels != job->dst)
+            stbi_image_free(pixels);
+        job->failed = 1;
+        return;
+    }
+
+    job->failed = 0;
+    if (pixels == job->dst)
+        return;
+
+    struct TextureSubresourceData* levels = calloc(
+        job->mipLevels,
+        sizeof(*levels)
+    );
+    unsigned char* mipPixels = generateMipmapsCpu(
+        pixels,
+        job->width,
+        job->height,
+        job->mipLevels,
+        levels
+    );
+
+    unsigned char* dst = job->dst;
+    uint32_t i;
+    for (i=0; i<job->mipLevels; i++)
+    {
+        size_t size = (size_t)(levels[i].rowPitch * levels[i].height);
+        memcpy(dst, levels[i].data, size);
+        dst += size;
+    }
+
+    free(mipPixels);
+    free(levels);
+    stbi_image_free(pixels);
+}
+
+// TEXTURE IMAGE
+void createTextureImage(struct Engine* engine)
+{
+    // createTextureStreamer or createTextureAtlas load textures instead
+    if (engine->streamer.enabled || engine->atlas.enabled)
+        return;
+
+    // Textures cooked with `make textures` upload without decoding
+    if (loadKtx2Texture(engine, "textures/dog.ktx2"))
+        return;
+
+    struct TextureLoad texture;
+    texture.path = "textures/dog.jpeg";
+    loadTextures(engine, &texture, 1);
+
+    engine->textureFormat = VK_FORMAT_R8G8B8A8_UNORM;
+    engine->textureMipLevels = texture.mipLevels;
+    engine->textureImage = texture.image;
+    engine->textureImageMemory = texture.memory;
+}
+
+void destroyTextureImage(struct Engine* engine)
+{
+    if (engine->streamer.enabled || engine->atlas.enabled)
+        return;
+
+    vkDestroyImage(
+        engine->device,
+        engine->textureImage,
+        NULL
+    );
+
+    gpuFree(engine, &(engine->textureImageMemory));
+}
+
+void createImage(struct Engine* engine, VkFormat format, uint32_t texWidth, uint32_t texHeight, uint32_t mipLevels, uint32_t arrayLayers, VkImageTiling tiling, VkImageUsageFlags usage, enum GpuMemoryUsage memoryUsage, VkImage* stagingImage, struct GpuAllocation* stagingImageMemory)
+{
+    createUnboundImage(
+        engine,
+        format,
+        texWidth,
+        texHeight,
+        mipLevels,
+        arrayLayers,
+        tiling,
+        usage,
+        stagingImage
+    );
+
+    VkMemoryRequirements memRequirements;
+    vkGetImageMemoryRequirements(
+        engine->device,
+        *stagingImage,
+        &memRequirements
+    );
+
+    gpuAllocate(
+        engine,
+        &memRequirements,
+        memoryUsage,
+        tiling == VK_IMAGE_TILING_LINEAR,
+        stagingImageMemory
+    );
+
+    vkBindImageMemory(
+        engine->device,
+        *stagingImage,
+        stagingImageMemory->memory,
+        stagingImageMemory->offset
+    );
+}
+
+// Creates a 2D image with no memory bound to it yet
+void createUnboundImage(struct Engine* engine, VkFormat format, uint32_t width, uint32_t height, uint32_t mipLevels, uint32_t arrayLayers, VkImageTiling tiling, VkImageUsageFlags usage, VkImage* image)
+{
+    VkImageCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.imageType = VK_IMAGE_TYPE_2D;
+    createInfo.format = format;
+    createInfo.extent.width = width;
+    createInfo.extent.height = height;
+    createInfo.extent.depth = 1;
+    createInfo.mipLevels = mipLevels;
+    createInfo.arrayLayers = arrayLayers;
+    createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    createInfo.tiling = tiling;
+    createInfo.usage = usage;
+    createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    createInfo.queueFamilyIndexCount = 0;
+    createInfo.pQueueFamilyIndices = NULL;
+    createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkResult result;
+    result = vkCreateImage(
+        engine->device,
+        &createInfo,
+        NULL,
+        image
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create texture image.\n");
+        exit(-1);
+    }
+}
+
+void transitionImageLayout(struct Engine* engine, VkImage image, VkFormat format, uint32_t mipLevels, uint32_t arrayLayers, VkImageLayout oldLayout, VkImageLayout newLayout)
+{
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+
+    VkImageMemoryBarrier barrier;
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.pNext = NULL;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+
+    if (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    {
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+
+        if (hasStencilComponent(format))
+        {
+            barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+        }
+    }
+    else
+    {
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = mipLevels;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = arrayLayers;
+
+    // Stages must be exact, the transition may share a command buffer with
+    // the transfers around it when an upload batch is open
+    VkPipelineStageFlags srcStage;
+    VkPipelineStageFlags dstStage;
+
+    if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
+        newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
+    {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
+             newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+    {
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    }
+    else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
+             newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        dstStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    }
+    else
+    {
+        fprintf(stderr, "Unsupported layout transition.\n");
+        exit(-1);
+    }
+
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        srcStage,
+        dstStage,
+        0,
+        0,
+        NULL,
+        0,
+        NULL,
+        1,
+        &barrier
+    );
+
+    endSingleTimeCommands(engine, commandBuffer);
+}
+
+// Loads RGBA8 images into new sampled images with full mip chains. Images
+// in the asset pack are already mapped and go to the decode pool at once.
+// Loose files are read in one batch of asynchronous reads, and each one is
+// handed to the pool as soon as its read completes. The pool decodes into
+// staging sized from the image header, and the copies are only recorded
+// once everything has decoded, so this thread never reads or decodes.
+void loadTextures(struct Engine* engine, struct TextureLoad* textures, uint32_t textureCount)
+{
+    VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+
+    // Blit the mip chains on the GPU when the format allows it, otherwise
+    // the workers filter every level and all of them are uploaded
+    _Bool gpuMipmaps = canBlitMipmaps(engine, format);
+
+    struct DecodeJob* jobs = calloc(textureCount, sizeof(*jobs));
+    struct StagingResource* staging = calloc(textureCount, sizeof(*staging));
+
+    uint32_t i, j;
+    for (i=0; i<textureCount; i++)
+        jobs[i].path = textures[i].path;
+
+    struct TextureLoadBatch batch;
+    batch.textures = textures;
+    batch.staging = staging;
+    batch.gpuMipmaps = gpuMipmaps;
+    decodeImageFiles(engine, jobs, textureCount, prepareTextureDecode, &batch);
+
+    uint32_t maxUploadLevels = 1;
+    for (i=0; i<textureCount; i++)
+        maxUploadLevels = max(maxUploadLevels, jobs[i].mipLevels);
+
+    VkBufferImageCopy* regions = calloc(maxUploadLevels, sizeof(*regions));
+    for (i=0; i<textureCount; i++)
+    {
+        struct TextureLoad* texture = &(textures[i]);
+        if (jobs[i].failed)
+        {
+            fprintf(stderr, "stb_image failed to load resource %s\n", texture->path);
+            exit(-1);
+        }
+
+        createImage(
+            engine,
+            format,
+            texture->width,
+            texture->height,
+            texture->mipLevels,
+            1,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+            VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+            VK_IMAGE_USAGE_SAMPLED_BIT,
+            GPU_MEMORY_DEVICE,
+            &(texture->image),
+            &(texture->memory)
+        );
+
+        transitionImageLayout(
+            engine,
+            texture->image,
+            format,
+            texture->mipLevels,
+            1,
+            VK_IMAGE_LAYOUT_UNDEFINED,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+        );
+
+        VkDeviceSize offset = 0;
+        for (j=0; j<jobs[i].mipLevels; j++)
+        {
+            uint32_t width = max(texture->width >> j, 1);
+            uint32_t height = max(texture->height >> j, 1);
+
+            regions[j].bufferOffset = offset;
+            regions[j].bufferRowLength = 0;
+            regions[j].bufferImageHeight = 0;
+            regions[j].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            regions[j].imageSubresource.mipLevel = j;
+            regions[j].imageSubresource.baseArrayLayer = 0;
+            regions[j].imageSubresource.layerCount = 1;
+            regions[j].imageOffset = (VkOffset3D){0, 0, 0};
+            regions[j].imageExtent.width = width;
+            regions[j].imageExtent.height = height;
+            regions[j].imageExtent.depth = 1;
+
+            offset += (VkDeviceSize)width * height * 4;
+        }
+        copyBufferToImage(
+            engine,
+            staging[i].buffer,
+            texture->image,
+            regions,
+            jobs[i].mipLevels
+        );
+
+        if (gpuMipmaps)
+        {
+            generateMipmaps(
+                engine,
+                texture->image,
+                texture->width,
+                texture->height,
+                texture->mipLevels,
+                1
+            );
+        }
+        else
+        {
+            transitionImageLayout(
+                engine,
+                texture->image,
+                format,
+                texture->mipLevels,
+                1,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+            );
+        }
+
+        releaseStagingResource(
+            engine,
+            staging[i].buffer,
+            VK_NULL_HANDLE,
+            &(staging[i].memory)
+        );
+    }
+
+    free(regions);
+    free(staging);
+    free(jobs);
+}
+
+// Reads every job's file, from the asset pack or with batched async reads,
+// and queues it on the decode pool as soon as its header has been read and
+// prepare has given it somewhere to decode to. Returns once the whole batch
+// has decoded, with the files closed and failed jobs flagged.
+void decodeImageFiles(struct Engine* engine, struct DecodeJob* jobs, uint32_t jobCount, void (*prepare)(struct Engine* engine, struct DecodeJob* job, uint32_t index, void* userData), void* userData)
+{
+    struct IoRequest* reads = calloc(jobCount, sizeof(*reads));
+
+    beginDecodeBatch(engine, jobCount);
+
+    uint32_t i;
+    for (i=0; i<jobCount; i++)
+    {
+        const char* path = jobs[i].path;
+
+        if (findPackEntry(&(engine->assetPack), path))
+        {
+            if (!openAsset(engine, path, FILE_ACCESS_SEQUENTIAL | FILE_ACCESS_PREFETCH, &(jobs[i].file)))
+            {
+                fprintf(stderr, "stb_image failed to load resource %s\n", path);
+                exit(-1);
+            }
+            queueImageDecode(engine, &(jobs[i]), i, prepare, userData);
+            continue;
+        }
+
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0 ||
+            st.st_size > INT_MAX)
+        {
+            fprintf(stderr, "stb_image failed to load resource %s\n", path);
+            exit(-1);
+        }
+
+        reads[i].fd = fd;
+        reads[i].buffer = malloc((size_t)st.st_size);
+        reads[i].size = (size_t)st.st_size;
+        reads[i].offset = 0;
+        reads[i].userData = &(jobs[i]);
+        submitRead(engine, &(reads[i]));
+    }
+
+    struct IoRequest* read;
+    while ((read = waitRead(engine)) != NULL)
+    {
+        struct DecodeJob* job = read->userData;
+        close(read->fd);
+
+        if (read->error != 0)
+        {
+            fprintf(stderr, "Failed to read %s: %s\n", job->path, strerror(read->error));
+            exit(-1);
+        }
+
+        // The job's view owns the file contents from here on
+        job->file.data = read->buffer;
+        job->file.size = read->size;
+        job->file.mapping = NULL;
+        job->file.mappingSize = 0;
+        job->file.buffer = read->buffer;
+
+        queueImageDecode(engine, job, (uint32_t)(job - jobs), prepare, userData);
+    }
+
+    finishDecodeBatch(engine);
+
+    for (i=0; i<jobCount; i++)
+        closeFileView(&(jobs[i].file));
+    free(reads);
+}
+
+// Sizes the job from the image header in job->file, lets prepare give it a
+// target and hands it to the workers
+void queueImageDecode(struct Engine* engine, struct DecodeJob* job, uint32_t index, void (*prepare)(struct Engine* engine, struct DecodeJob* job, uint32_t index, void* userData), void* userData)
+{
+    int width, height, channels;
+    if (job->file.size > INT_MAX ||
+        !stbi_info_from_memory(
+            (const stbi_uc*)job->file.data,
+            (int)job->file.size,
+            &width,
+            &height,
+            &channels
+        ))
+    {
+        fprintf(stderr, "stb_image failed to load resource %s\n", job->path);
+        exit(-1);
+    }
+
+    job->width = width;
+    job->height = height;
+    prepare(engine, job, index, userData);
+    queueDecodeJob(engine, job);
+}
+
+// Sizes the texture from the job's image header and gives the job a
+// staging buffer to decode into. userData is the loadTextures batch.
+void prepareTextureDecode(struct Engine* engine, struct DecodeJob* job, uint32_t index, void* userData)
+{
+    struct TextureLoadBatch* batch = userData;
+    struct TextureLoad* texture = &(batch->textures[index]);
+    struct StagingResource* staging = &(batch->staging[index]);
+
+    texture->width = job->width;
+    texture->height = job->height;
+    texture->mipLevels = mipLevelCount(job->width, job->height);
+    job->mipLevels = batch->gpuMipmaps ? 1 : texture->mipLevels;
+
+    VkDeviceSize size = 0;
+    uint32_t i;
+    for (i=0; i<job->mipLevels; i++)
+    {
+        size += (VkDeviceSize)max(job->width >> i, 1) *
+            max(job->height >> i, 1) * 4;
+    }
+    if (job->mipLevels == 1)
+        size += DECODE_TARGET_PADDING;
+
+    createBuffer(
+        engine,
+        size,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        GPU_MEMORY_STAGING,
+        &(staging->buffer),
+        &(staging->memory)
+    );
+    staging->image = VK_NULL_HANDLE;
+
+    job->dst = staging->memory.mapped;
+}
+
+// Copy offsets must be multiples of 4 and of the block size, rounded up to
+// the device's preferred copy alignment
+VkDeviceSize stagingCopyAlignment(struct Engine* engine, uint32_t blockBytes)
+{
+    VkDeviceSize optimal =
+        engine->deviceProperties.limits.optimalBufferCopyOffsetAlignment;
+    if (optimal == 0)
+        optimal = 1;
+    VkDeviceSize alignment = optimal;
+    while (alignment % 4 != 0 || alignment % blockBytes != 0)
+        alignment += optimal;
+    return alignment;
+}
+
+// Lays texture subresources out for a staging buffer, fills one copy region
+// per subresource and returns the buffer size they need. Data is laid out
+// in blocks of blockDim x blockDim texels taking blockBytes each, 1x1 blocks
+// for uncompressed formats. Rows keep their source pitch when it is a whole
+// number of blocks, since bufferRowLength can describe it, and are repacked
+// tightly otherwise.
+VkDeviceSize layoutTextureData(struct Engine* engine, const struct TextureSubresourceData* subresources, uint32_t subresourceCount, uint32_t blockBytes, uint32_t blockDim, VkBufferImageCopy* regions)
+{
+    VkDeviceSize alignment = stagingCopyAlignment(engine, blockBytes);
+
+    VkDeviceSize size = 0;
+    uint32_t i;
+    for (i=0; i<subresourceCount; i++)
+    {
+        const struct TextureSubresourceData* subresource = &(subresources[i]);
+        uint32_t rowBlocks = (subresource->width + blockDim - 1) / blockDim;
+        uint32_t blockRows = (subresource->height + blockDim - 1) / blockDim;
+        VkDeviceSize rowLength = rowBlocks;
+        if (subresource->rowPitch % blockBytes == 0)
+            rowLength = subresource->rowPitch / blockBytes;
+
+        size = (size + alignment - 1) / alignment * alignment;
+
+        regions[i].bufferOffset = size;
+        regions[i].bufferRowLength =
+            rowLength == rowBlocks ? 0 : (uint32_t)rowLength * blockDim;
+        regions[i].bufferImageHeight = 0;
+        regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        regions[i].imageSubresource.mipLevel = subresource->mipLevel;
+        regions[i].imageSubresource.baseArrayLayer = subresource->arrayLayer;
+        regions[i].imageSubresource.layerCount = 1;
+        regions[i].imageOffset = (VkOffset3D){0, 0, 0};
+        regions[i].imageExtent.width = subresource->width;
+        regions[i].imageExtent.height = subresource->height;
+        regions[i].imageExtent.depth = 1;
+
+        // The last row only needs its blocks, not the full pitch
+        size += rowLength * blockBytes * (blockRows - 1) +
+            (VkDeviceSize)rowBlocks * blockBytes;
+    }
+
+    return size;
+}
+
+// Copies subresources into mapped staging memory at the offsets chosen by
+// layoutTextureData
+void writeTextureData(const struct TextureSubresourceData* subresources, uint32_t subresourceCount, uint32_t blockBytes, uint32_t blockDim, const VkBufferImageCopy* regions, char* mapped)
+{
+    uint32_t i;
+    for (i=0; i<subresourceCount; i++)
+    {
+        const struct TextureSubresourceData* subresource = &(subresources[i]);
+        char* dst = mapped + regions[i].bufferOffset;
+        uint32_t rowBlocks = (subresource->width + blockDim - 1) / blockDim;
+        uint32_t blockRows = (subresource->height + blockDim - 1) / blockDim;
+        VkDeviceSize rowBytes = (VkDeviceSize)rowBlocks * blockBytes;
+
+        if (regions[i].bufferRowLength != 0 || subresource->rowPitch == rowBytes)
+        {
+            memcpy(
+                dst,
+                subresource->data,
+                (size_t)(subresource->rowPitch * (blockRows - 1) + rowBytes)
+            );
+            continue;
+        }
+
+        const char* src = subresource->data;
+        uint32_t y;
+        for (y=0; y<blockRows; y++)
+        {
+            memcpy(dst, src, (size_t)rowBytes);
+            dst += rowBytes;
+            src += subresource->rowPitch;
+        }
+    }
+}
+
+
+// Packs texture subresources into a new staging buffer and fills one copy
+// region per subresource, laid out by layoutTextureData
+void stageTextureData(struct Engine* engine, const struct TextureSubresourceData* subresources, uint32_t subresourceCount, uint32_t blockBytes, uint32_t blockDim, VkBuffer* buffer, struct GpuAllocation* memory, VkBufferImageCopy* regions)
+{
+    VkDeviceSize size = layoutTextureData(
+        engine,
+        subresources,
+        subresourceCount,
+        blockBytes,
+        blockDim,
+        regions
+    );
+
+    createBuffer(
+        engine,
+        size,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        GPU_MEMORY_STAGING,
+        buffer,
+        memory
+    );
+
+    writeTextureData(
+        subresources,
+        subresourceCount,
+        blockBytes,
+        blockDim,
+        regions,
+        memory->mapped
+    );
+}
+
+void copyBufferToImage(struct Engine* engine, VkBuffer src, VkImage dst, const VkBufferImageCopy* regions, uint32_t regionCount)
+{
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+
+    vkCmdCopyBufferToImage(
+        commandBuffer,
+        src,
+        dst,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        regionCount,
+        regions
+    );
+
+    endSingleTimeCommands(engine, commandBuffer);
+}
+
+// Full chain down to 1x1
+uint32_t mipLevelCount(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+    uint32_t size = max(width, height);
+    while (size > 1)
+    {
+        size /= 2;
+        levels++;
+    }
+    return levels;
+}
+
+// Blitting with linear filtering needs all three features on optimal tiling
+_Bool canBlitMipmaps(struct Engine* engine, VkFormat format)
+{
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(engine->physicalDevice, format, &props);
+
+    VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+        VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (props.optimalTilingFeatures & required) == required;
+}
+
+// Fills every level below the first by blitting from the level above.
+// Expects all levels in TRANSFER_DST_OPTIMAL with level 0 written, and
+// leaves all of them in SHADER_READ_ONLY_OPTIMAL.
+void generateMipmaps(struct Engine* engine, VkImage image, uint32_t width, uint32_t height, uint32_t mipLevels, uint32_t arrayLayers)
+{
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+
+    VkImageMemoryBarrier barrier;
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.pNext = NULL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = arrayLayers;
+
+    int32_t mipWidth = (int32_t)width;
+    int32_t mipHeight = (int32_t)height;
+
+    uint32_t i;
+    for (i=1; i<mipLevels; i++)
+    {
+        // The level above becomes the blit source
+        barrier.subresourceRange.baseMipLevel = i - 1;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(
+            commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0,
+            0,
+            NULL,
+            0,
+            NULL,
+            1,
+            &barrier
+        );
+
+        int32_t nextWidth = mipWidth > 1 ? mipWidth / 2 : 1;
+        int32_t nextHeight = mipHeight > 1 ? mipHeight / 2 : 1;
+
+        VkImageBlit blit;
+        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.srcSubresource.mipLevel = i - 1;
+        blit.srcSubresource.baseArrayLayer = 0;
+        blit.srcSubresource.layerCount = arrayLayers;
+        blit.srcOffsets[0] = (VkOffset3D){0, 0, 0};
+        blit.srcOffsets[1] = (VkOffset3D){mipWidth, mipHeight, 1};
+        blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.dstSubresource.mipLevel = i;
+        blit.dstSubresource.baseArrayLayer = 0;
+        blit.dstSubresource.layerCount = arrayLayers;
+        blit.dstOffsets[0] = (VkOffset3D){0, 0, 0};
+        blit.dstOffsets[1] = (VkOffset3D){nextWidth, nextHeight, 1};
+
+        vkCmdBlitImage(
+            commandBuffer,
+            image,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1,
+            &blit,
+            VK_FILTER_LINEAR
+        );
+
+        // Done with the level above
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(
+            commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+            0,
+            0,
+            NULL,
+            0,
+            NULL,
+            1,
+            &barrier
+        );
+
+        mipWidth = nextWidth;
+        mipHeight = nextHeight;
+    }
+
+    // The last level was only ever written
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0,
+        0,
+        NULL,
+        0,
+        NULL,
+        1,
+        &barrier
+    );
+
+    endSingleTimeCommands(engine, commandBuffer);
+}
+
+// Builds the mip chain of a tightly packed RGBA8 image with a 2x2 box
+// filter, odd edges repeat their last texel. Fills levels[0..mipLevels) with
+// level 0 pointing at pixels and returns the allocation holding the rest,
+// which the caller frees.
+unsigned char* generateMipmapsCpu(const unsigned char* pixels, uint32_t width, uint32_t height, uint32_t mipLevels, struct TextureSubresourceData* levels)
+{
+    size_t size = 0;
+    uint32_t levelWidth = width;
+    uint32_t levelHeight = height;
+    uint32_t i;
+    for (i=1; i<mipLevels; i++)
+    {
+        levelWidth = max(levelWidth / 2, 1);
+        levelHeight = max(levelHeight / 2, 1);
+        size += (size_t)levelWidth * levelHeight * 4;
+    }
+
+    unsigned char* mipPixels = size ? malloc(size) : NULL;
+
+    levels[0].mipLevel = 0;
+    levels[0].arrayLayer = 0;
+    levels[0].width = width;
+    levels[0].height = height;
+    levels[0].rowPitch = (VkDeviceSize)width * 4;
+    levels[0].data = pixels;
+
+    unsigned char* dst = mipPixels;
+    for (i=1; i<mipLevels; i++)
+    {
+        const unsigned char* src = levels[i-1].data;
+        uint32_t srcWidth = levels[i-1].width;
+        uint32_t srcHeight = levels[i-1].height;
+        uint32_t dstWidth = max(srcWidth / 2, 1);
+        uint32_t dstHeight = max(srcHeight / 2, 1);
+
+        uint32_t x, y, c;
+        for (y=0; y<dstHeight; y++)
+        {
+            uint32_t y0 = min(y * 2, srcHeight - 1);
+            uint32_t y1 = min(y * 2 + 1, srcHeight - 1);
+            for (x=0; x<dstWidth; x++)
+            {
+                uint32_t x0 = min(x * 2, srcWidth - 1);
+                uint32_t x1 = min(x * 2 + 1, srcWidth - 1);
+                for (c=0; c<4; c++)
+                {
+                    uint32_t sum = src[(y0 * srcWidth + x0) * 4 + c] +
+                        src[(y0 * srcWidth + x1) * 4 + c] +
+                        src[(y1 * srcWidth + x0) * 4 + c] +
+                        src[(y1 * srcWidth + x1) * 4 + c];
+                    dst[(y * dstWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+
+        levels[i].mipLevel = i;
+        levels[i].arrayLayer = 0;
+        levels[i].width = dstWidth;
+        levels[i].height = dstHeight;
+        levels[i].rowPitch = (VkDeviceSize)dstWidth * 4;
+        levels[i].data = dst;
+
+        dst += (size_t)dstWidth * dstHeight * 4;
+    }
+
+    return mipPixels;
+}
+
+// Bytes per 4x4 block of the block-compressed formats the cooker writes,
+// 0 for anything else
+uint32_t compressedBlockBytes(VkFormat format)
+{
+    switch (format)
+    {
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+            return 8;
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+        case VK_FORMAT_BC7_SRGB_BLOCK:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+// Uploads a cooked KTX2 texture's blocks and mip chain as they are. Returns
+// 0 without touching the engine when the file doesn't exist, isn't a
+// texture the loader understands or the device can't sample its format.
+_Bool loadKtx2Texture(struct Engine* engine, const char* fname)
+{
+    // Every level is read once, front to back, while staging
+    struct TextureSource source;
+    if (!openKtx2Source(engine, fname, FILE_ACCESS_SEQUENTIAL | FILE_ACCESS_PREFETCH, &source))
+        return 0;
+
+    uploadTextureSource(
+        engine,
+        &source,
+        0,
+        &(engine->textureImage),
+        &(engine->textureImageMemory)
+    );
+
+    engine->textureFormat = source.format;
+    engine->textureMipLevels = source.mipLevels;
+    closeTextureSource(&source);
+    return 1;
+}
+
+// Maps a cooked KTX2 file and points the source's levels into it. Returns 0
+// when the file doesn't exist, isn't a texture the loader understands or
+// the device can't sample its format.
+_Bool openKtx2Source(struct Engine* engine, const char* fname, uint32_t access, struct TextureSource* source)
+{
+    struct FileView view;
+    if (!openAsset(engine, fname, access, &view))
+        return 0;
+
+    const char* file = view.data;
+    size_t fileSize = view.size;
+
+    struct Ktx2Header header;
+    if (fileSize < sizeof(header))
+    {
+        fprintf(stderr, "%s is too short for a KTX2 file.\n", fname);
+        closeFileView(&view);
+        return 0;
+    }
+    memcpy(&header, file, sizeof(header));
+
+    VkFormat format = (VkFormat)header.vkFormat;
+    uint32_t blockBytes = compressedBlockBytes(format);
+    size_t indexEnd = sizeof(header) +
+        (size_t)header.levelCount * sizeof(struct Ktx2LevelIndex);
+
+    // Only 2D images the device can create, with no more levels than the
+    // full chain, so a damaged header falls back to the source image
+    uint32_t maxDimension = engine->deviceProperties.limits.maxImageDimension2D;
+    if (memcmp(header.identifier, KTX2_IDENTIFIER, KTX2_IDENTIFIER_SIZE) != 0 ||
+        header.pixelWidth == 0 || header.pixelHeight == 0 ||
+        header.pixelWidth > maxDimension || header.pixelHeight > maxDimension ||
+        header.pixelDepth > 1 || header.layerCount > 1 ||
+        header.faceCount != 1 || header.levelCount == 0 ||
+        header.levelCount > mipLevelCount(header.pixelWidth, header.pixelHeight) ||
+        header.supercompressionScheme != 0 || indexEnd > fileSize)
+    {
+        fprintf(stderr, "%s is not a supported KTX2 texture.\n", fname);
+        closeFileView(&view);
+        return 0;
+    }
+    if (blockBytes == 0)
+    {
+        fprintf(stderr, "%s has unsupported format %u.\n", fname, header.vkFormat);
+        closeFileView(&view);
+        return 0;
+    }
+
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(engine->physicalDevice, format, &props);
+    VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    if (!engine->textureCompressionBC ||
+        (props.optimalTilingFeatures & required) != required)
+    {
+        fprintf(stderr, "%s: format %u can't be sampled, using the source image.\n", fname, header.vkFormat);
+        closeFileView(&view);
+        return 0;
+    }
+
+    uint32_t mipLevels = header.levelCount;
+    struct TextureSubresourceData* levels = calloc(mipLevels, sizeof(*levels));
+
+    uint32_t i;
+    for (i=0; i<mipLevels; i++)
+    {
+        struct Ktx2LevelIndex index;
+        memcpy(
+            &index,
+            file + sizeof(header) + i * sizeof(index),
+            sizeof(index)
+        );
+
+        uint32_t width = max(header.pixelWidth >> i, 1);
+        uint32_t height = max(header.pixelHeight >> i, 1);
+        VkDeviceSize rowPitch = (VkDeviceSize)((width + 3) / 4) * blockBytes;
+        VkDeviceSize levelSize = rowPitch * ((height + 3) / 4);
+
+        if (index.byteOffset > fileSize || index.byteLength < levelSize ||
+            index.byteLength > fileSize - index.byteOffset)
+        {
+            fprintf(stderr, "%s: mip level %u is truncated.\n", fname, i);
+            free(levels);
+            closeFileView(&view);
+            return 0;
+        }
+
+        levels[i].mipLevel = i;
+        levels[i].arrayLayer = 0;
+        levels[i].width = width;
+        levels[i].height = height;
+        levels[i].rowPitch = rowPitch;
+        levels[i].data = file + index.byteOffset;
+    }
+
+    memset(source, 0, sizeof(*source));
+    source->format = format;
+    source->width = header.pixelWidth;
+    source->height = header.pixelHeight;
+    source->mipLevels = mipLevels;
+    source->blockBytes = blockBytes;
+    source->blockDim = 4;
+    source->levels = levels;
+    source->file = view;
+    return 1;
+}
+
+// Decodes an image file and builds its mip chain on the CPU
+void openImageSource(struct Engine* engine, const char* fname, struct TextureSource* source)
+{
+    struct FileView view;
+    if (!openAsset(engine, fname, FILE_ACCESS_SEQUENTIAL, &view))
+    {
+        fprintf(stderr, "stb_image failed to load resource %s\n", fname);
+        exit(-1);
+    }
+
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load_from_memory(
+        (const stbi_uc*)view.data,
+        (int)view.size,
+        &width,
+        &height,
+        &channels,
+        STBI_rgb_alpha
+    );
+    closeFileView(&view);
+    if (!pixels)
+    {
+        fprintf(stderr, "stb_image failed to load resource %s\n", fname);
+        exit(-1);
+    }
+
+    memset(source, 0, sizeof(*source));
+    source->format = VK_FORMAT_R8G8B8A8_UNORM;
+    source->width = (uint32_t)width;
+    source->height = (uint32_t)height;
+    source->mipLevels = mipLevelCount(source->width, source->height);
+    source->blockBytes = 4;
+    source->blockDim = 1;
+    source->levels = calloc(source->mipLevels, sizeof(*(source->levels)));
+    source->pixels = pixels;
+    source->mipPixels = generateMipmapsCpu(
+        pixels,
+        source->width,
+        source->height,
+        source->mipLevels,
+        source->levels
+    );
+}
+
+void closeTextureSource(struct TextureSource* source)
+{
+    free(source->levels);
+    free(source->mipPixels);
+    if (source->pixels)
+        stbi_image_free(source->pixels);
+    closeFileView(&(source->file));
+}
+
+// Creates an image holding the source's levels from baseLevel on, level
+// baseLevel becoming the image's level 0, and uploads them through the
+// upload batch. The image is left in SHADER_READ_ONLY_OPTIMAL.
+void uploadTextureSource(struct Engine* engine, const struct TextureSource* source, uint32_t baseLevel, VkImage* image, struct GpuAllocation* memory)
+{
+    uint32_t levelCount = source->mipLevels - baseLevel;
+    struct TextureSubresourceData* levels = calloc(levelCount, sizeof(*levels));
+    memcpy(levels, source->levels + baseLevel, levelCount * sizeof(*levels));
+
+    uint32_t i;
+    for (i=0; i<levelCount; i++)
+        levels[i].mipLevel = i;
+
+    VkBuffer stagingBuffer;
+    struct GpuAllocation stagingBufferMemory;
+    VkBufferImageCopy* regions = calloc(levelCount, sizeof(*regions));
+    stageTextureData(
+        engine,
+        levels,
+        levelCount,
+        source->blockBytes,
+        source->blockDim,
+        &stagingBuffer,
+        &stagingBufferMemory,
+        regions
+    );
+    free(levels);
+
+    createImage(
+        engine,
+        source->format,
+        source->levels[baseLevel].width,
+        source->levels[baseLevel].height,
+        levelCount,
+        1,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        GPU_MEMORY_DEVICE,
+        image,
+        memory
+    );
+
+    transitionImageLayout(
+        engine,
+        *image,
+        source->format,
+        levelCount,
+        1,
+        VK_IMAGE_LAYOUT_UNDEFINED,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+    );
+    copyBufferToImage(
+        engine,
+        stagingBuffer,
+        *image,
+        regions,
+        levelCount
+    );
+    free(regions);
+
+    transitionImageLayout(
+        engine,
+        *image,
+        source->format,
+        levelCount,
+        1,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    );
+
+    releaseStagingResource(
+        engine,
+        stagingBuffer,
+        VK_NULL_HANDLE,
+        &stagingBufferMemory
+    );
+}
+
+// TEXTURE IMAGE VIEW
+void createTextureImageView(struct Engine* engine)
+{
+    if (engine->streamer.enabled || engine->atlas.enabled)
+        return;
+
+    createImageView(
+        engine,
+        engine->textureImage,
+        engine->textureFormat,
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        engine->textureMipLevels,
+        &(engine->textureImageView)
+    );
+}
+
+void destroyTextureImageView(struct Engine* engine)
+{
+    if (engine->streamer.enabled || engine->atlas.enabled)
+        return;
+
+    vkDestroyImageView(engine->device, engine->textureImageView, NULL);
+}
+
+void createImageView(struct Engine* engine, VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels, VkImageView* imageView)
+{
+    createImageViewLayers(
+        engine,
+        image,
+        format,
+        aspectFlags,
+        VK_IMAGE_VIEW_TYPE_2D,
+        mipLevels,
+        1,
+        imageView
+    );
+}
+
+void createImageViewLayers(struct Engine* engine, VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, VkImageViewType viewType, uint32_t mipLevels, uint32_t layerCount, VkImageView* imageView)
+{
+    VkImageViewCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.image = image;
+    createInfo.viewType = viewType;
+    createInfo.format = format;
+    createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+    createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+    createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+    createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+    createInfo.subresourceRange.aspectMask = aspectFlags;
+    createInfo.subresourceRange.baseMipLevel = 0;
+    createInfo.subresourceRange.levelCount = mipLevels;
+    createInfo.subresourceRange.baseArrayLayer = 0;
+    createInfo.subresourceRange.layerCount = layerCount;
+
+    VkResult result;
+    result = vkCreateImageView(
+        engine->device,
+        &createInfo,
+        NULL,
+        imageView
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create image view for texture.\n");
+        exit(-1);
+    }
+}
+
+// TEXTURE SAMPLER
+void createTextureSampler(struct Engine* engine)
+{
+    VkSamplerCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.magFilter = VK_FILTER_LINEAR;
+    createInfo.minFilter = VK_FILTER_LINEAR;
+    createInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    createInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    createInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    createInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    createInfo.mipLodBias =0.0f;
+    createInfo.anisotropyEnable = VK_TRUE;
+    createInfo.maxAnisotropy = 16;
+    createInfo.compareEnable = VK_FALSE;
+    createInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+    createInfo.minLod = 0.0f;
+    createInfo.maxLod = (float)engine->textureMipLevels;
+    createInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+    createInfo.unnormalizedCoordinates = VK_FALSE;
+
+    VkResult result;
+    result = vkCreateSampler(
+        engine->device,
+        &createInfo,
+        NULL,
+        &(engine->textureSampler)
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create texture sampler.\n");
+        exit(-1);
+    }
+}
+
+void destroyTextureSampler(struct Engine* engine)
+{
+    vkDestroySampler(
+        engine->device,
+        engine->textureSampler,
+        NULL
+    );
+}
+
+// TEXTURE STREAMING
+void createTextureStreamer(struct Engine* engine)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+    if (!streamer->enabled)
+        return;
+
+    // Without a budget, leave half of the largest device-local heap to
+    // everything that isn't a texture
+    if (streamer->budget == 0)
+    {
+        VkPhysicalDeviceMemoryProperties* memProperties = &(engine->memoryProperties);
+        uint32_t i;
+        for (i=0; i<memProperties->memoryHeapCount; i++)
+        {
+            if (!(memProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT))
+                continue;
+            if (memProperties->memoryHeaps[i].size / 2 > streamer->budget)
+                streamer->budget = memProperties->memoryHeaps[i].size / 2;
+        }
+    }
+
+    if (streamer->pathCount == 0)
+        addStreamedTexture(engine, "textures/dog.ktx2", "textures/dog.jpeg");
+
+    // Each image's cooked KTX2 file is next to it, as `make textures` puts
+    // it
+    uint32_t i;
+    for (i=0; i<streamer->pathCount; i++)
+    {
+        const char* path = streamer->paths[i];
+        const char* dot = strrchr(path, '.');
+        const char* slash = strrchr(path, '/');
+        int stemLength = dot && (!slash || dot > slash) ?
+            (int)(dot - path) : (int)strlen(path);
+
+        char ktx2Path[PATH_MAX];
+        snprintf(ktx2Path, sizeof(ktx2Path), "%.*s.ktx2", stemLength, path);
+        addStreamedTexture(engine, ktx2Path, path);
+    }
+
+    // The sampler's LOD range covers the full chain of every streamed level
+    engine->textureFormat = streamer->textures[0].source.format;
+    engine->textureMipLevels = 0;
+    for (i=0; i<streamer->textureCount; i++)
+    {
+        engine->textureMipLevels = max(
+            engine->textureMipLevels,
+            streamer->textures[i].source.mipLevels
+        );
+    }
+}
+
+void destroyTextureStreamer(struct Engine* engine)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+    if (!streamer->enabled)
+        return;
+
+    // Called after the device is idle
+    uint32_t i;
+    for (i=0; i<streamer->retiredCount; i++)
+    {
+        struct RetiredTexture* retired = &(streamer->retired[i]);
+        vkDestroyImageView(engine->device, retired->view, NULL);
+        vkDestroyImage(engine->device, retired->image, NULL);
+        gpuFree(engine, &(retired->memory));
+    }
+    free(streamer->retired);
+
+    for (i=0; i<streamer->textureCount; i++)
+    {
+        struct StreamedTexture* texture = &(streamer->textures[i]);
+        if (texture->pending)
+        {
+            vkDestroyImageView(engine->device, texture->pendingView, NULL);
+            vkDestroyImage(engine->device, texture->pendingImage, NULL);
+            gpuFree(engine, &(texture->pendingMemory));
+        }
+        vkDestroyImageView(engine->device, texture->view, NULL);
+        vkDestroyImage(engine->device, texture->image, NULL);
+        gpuFree(engine, &(texture->memory));
+        closeTextureSource(&(texture->source));
+        free(texture->levelBytes);
+    }
+    free(streamer->textures);
+    free(streamer->paths);
+}
+
+// Registers a texture with only its mip tail resident. The cooked KTX2 file
+// is preferred, imagePath is decoded when it can't be used.
+uint32_t addStreamedTexture(struct Engine* engine, const char* ktx2Path, const char* imagePath)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+    streamer->textures = realloc(
+        streamer->textures,
+        (streamer->textureCount + 1) * sizeof(*(streamer->textures))
+    );
+    struct StreamedTexture* texture = &(streamer->textures[streamer->textureCount]);
+    memset(texture, 0, sizeof(*texture));
+
+    // Levels are read whenever residency changes, in no particular order
+    if (!openKtx2Source(engine, ktx2Path, FILE_ACCESS_RANDOM, &(texture->source)))
+        openImageSource(engine, imagePath, &(texture->source));
+
+    struct TextureSource* source = &(texture->source);
+    texture->tailLevel = source->mipLevels - 1;
+    while (texture->tailLevel > 0 &&
+        source->levels[texture->tailLevel - 1].width <= STREAMING_TAIL_SIZE &&
+        source->levels[texture->tailLevel - 1].height <= STREAMING_TAIL_SIZE)
+    {
+        texture->tailLevel--;
+    }
+    texture->residentLevel = texture->tailLevel;
+    texture->desiredLevel = texture->tailLevel;
+    measureStreamedTexture(engine, texture);
+
+    uploadTextureSource(
+        engine,
+        source,
+        texture->tailLevel,
+        &(texture->image),
+        &(texture->memory)
+    );
+    createImageView(
+        engine,
+        texture->image,
+        source->format,
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        source->mipLevels - texture->tailLevel,
+        &(texture->view)
+    );
+    streamer->residentBytes += texture->memory.size;
+
+    return streamer->textureCount++;
+}
+
+// The view descriptor sets sample, owned by the streamer or the atlas when
+// either is enabled
+VkImageView activeTextureView(struct Engine* engine)
+{
+    if (engine->streamer.enabled)
+        return engine->streamer.textures[engine->streamer.activeTexture].view;
+    if (engine->atlas.enabled)
+        return engine->atlas.view;
+    return engine->textureImageView;
+}
+
+// Runs once per frame after the frame's fence has signalled. Swaps in
+// residency changes the previous frame acquired, frees replaced images no
+// frame in flight can still sample and starts new changes within the budget.
+void updateTextureStreaming(struct Engine* engine)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+    if (!streamer->enabled)
+        return;
+
+    streamer->frame++;
+
+    uint32_t i = 0;
+    while (i < streamer->retiredCount)
+    {
+        struct RetiredTexture* retired = &(streamer->retired[i]);
+        if (retired->frame + engine->framesInFlight > streamer->frame)
+        {
+            i++;
+            continue;
+        }
+
+        vkDestroyImageView(engine->device, retired->view, NULL);
+        vkDestroyImage(engine->device, retired->image, NULL);
+        streamer->residentBytes -= retired->memory.size;
+        gpuFree(engine, &(retired->memory));
+        streamer->retired[i] = streamer->retired[--streamer->retiredCount];
+    }
+
+    for (i=0; i<streamer->textureCount; i++)
+    {
+        struct StreamedTexture* texture = &(streamer->textures[i]);
+        if (texture->pending &&
+            !asyncUploadPending(engine, texture->pendingUpload))
+        {
+            finishStreamedTexture(engine, texture);
+        }
+    }
+
+    // The mesh is drawn with one texture at a time. The others keep the
+    // level they last needed and stay resident until they are evicted.
+    streamer->activeTexture = (uint32_t)(
+        (streamer->frame / STREAMING_FRAMES_PER_TEXTURE) % streamer->textureCount
+    );
+    struct StreamedTexture* active = &(streamer->textures[streamer->activeTexture]);
+
+    struct UniformBufferObject ubo;
+    computeUniforms(engine, &ubo);
+    float screenSize = meshScreenSize(engine, &ubo);
+    active->desiredLevel = streamedTextureLevel(active, screenSize);
+    if (screenSize > 0.0f)
+        active->lastUsedFrame = streamer->frame;
+
+    // Only textures drawn this frame are sharpened
+    uint32_t changes = 0;
+    for (i=0; i<streamer->textureCount && changes < STREAMING_CHANGES_PER_FRAME; i++)
+    {
+        struct StreamedTexture* texture = &(streamer->textures[i]);
+        if (texture->pending || texture->desiredLevel >= texture->residentLevel ||
+            texture->lastUsedFrame != streamer->frame)
+        {
+            continue;
+        }
+
+        // Both images count against the budget until the old one is freed
+        uint32_t level = texture->desiredLevel;
+        VkDeviceSize freeing = streamingBytesFreeing(engine);
+        while (level < texture->residentLevel &&
+            streamer->residentBytes + texture->levelBytes[level] > streamer->budget)
+        {
+            // Evictions already under way free enough, wait for them
+            if (streamer->residentBytes - freeing + texture->levelBytes[level] <=
+                streamer->budget)
+            {
+                level = texture->residentLevel;
+                break;
+            }
+
+            struct StreamedTexture* victim = findEvictionVictim(engine, texture);
+            if (!victim)
+            {
+                level++;
+                continue;
+            }
+
+            // The memory comes back once the victim's smaller image is in
+            // use, try again then
+            uint32_t victimLevel = victim->residentLevel < victim->desiredLevel ?
+                victim->desiredLevel : victim->tailLevel;
+            streamTextureLevel(engine, victim, victimLevel);
+            streamer->evictionCount++;
+            changes++;
+            level = texture->residentLevel;
+        }
+
+        if (level < texture->residentLevel)
+        {
+            streamTextureLevel(engine, texture, level);
+            changes++;
+        }
+    }
+}
+
+// Bytes residentBytes drops by once the images being replaced by smaller
+// ones and the retired images are freed
+VkDeviceSize streamingBytesFreeing(struct Engine* engine)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+    VkDeviceSize size = 0;
+
+    uint32_t i;
+    for (i=0; i<streamer->retiredCount; i++)
+        size += streamer->retired[i].memory.size;
+    for (i=0; i<streamer->textureCount; i++)
+    {
+        struct StreamedTexture* texture = &(streamer->textures[i]);
+        if (texture->pending && texture->pendingLevel > texture->residentLevel)
+            size += texture->memory.size;
+    }
+
+    return size;
+}
+
+// Picks the texture to drop levels from to make room for texture: first one
+// holding levels sharper than it currently needs, otherwise the least
+// recently drawn one that wasn't drawn this frame. NULL when nothing can go.
+struct StreamedTexture* findEvictionVictim(struct Engine* engine, struct StreamedTexture* texture)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+    struct StreamedTexture* victim = NULL;
+
+    uint32_t i;
+    for (i=0; i<streamer->textureCount; i++)
+    {
+        struct StreamedTexture* candidate = &(streamer->textures[i]);
+        if (candidate == texture || candidate->pending)
+            continue;
+        if (candidate->residentLevel < candidate->desiredLevel)
+            return candidate;
+        if (candidate->residentLevel == candidate->tailLevel ||
+            candidate->lastUsedFrame == streamer->frame)
+        {
+            continue;
+        }
+        if (!victim || candidate->lastUsedFrame < victim->lastUsedFrame)
+            victim = candidate;
+    }
+
+    return victim;
+}
+
+// Starts replacing the texture's image with one holding levels from level
+// on. The copy runs on the transfer queue, the new image is swapped in by
+// finishStreamedTexture once a frame has acquired it.
+void streamTextureLevel(struct Engine* engine, struct StreamedTexture* texture, uint32_t level)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+    struct TextureSource* source = &(texture->source);
+    uint32_t levelCount = source->mipLevels - level;
+
+    createImage(
+        engine,
+        source->format,
+        source->levels[level].width,
+        source->levels[level].height,
+        levelCount,
+        1,
+        VK_IMAGE_TILING_OPTIMAL,
+        STREAMED_IMAGE_USAGE,
+        GPU_MEMORY_DEVICE,
+        &(texture->pendingImage),
+        &(texture->pendingMemory)
+    );
+    createImageView(
+        engine,
+        texture->pendingImage,
+        source->format,
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        levelCount,
+        &(texture->pendingView)
+    );
+
+    struct TextureSubresourceData* levels = calloc(levelCount, sizeof(*levels));
+    memcpy(levels, source->levels + level, levelCount * sizeof(*levels));
+
+    uint32_t i;
+    for (i=0; i<levelCount; i++)
+        levels[i].mipLevel = i;
+
+    texture->pendingUpload = uploadImageAsync(
+        engine,
+        texture->pendingImage,
+        levels,
+        levelCount,
+        source->blockBytes,
+        source->blockDim
+    );
+    free(levels);
+
+    texture->pending = 1;
+    texture->pendingLevel = level;
+    streamer->residentBytes += texture->pendingMemory.size;
+    streamer->uploadCount++;
+}
+
+// Makes a texture's pending image the one descriptor sets sample. The old
+// image stays alive until every frame in flight has moved off it.
+void finishStreamedTexture(struct Engine* engine, struct StreamedTexture* texture)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+
+    if (streamer->retiredCount == streamer->retiredCapacity)
+    {
+        streamer->retiredCapacity = streamer->retiredCapacity ?
+            streamer->retiredCapacity * 2 : 8;
+        streamer->retired = realloc(
+            streamer->retired,
+            streamer->retiredCapacity * sizeof(*(streamer->retired))
+        );
+    }
+
+    struct RetiredTexture* retired = &(streamer->retired[streamer->retiredCount++]);
+    retired->image = texture->image;
+    retired->memory = texture->memory;
+    retired->view = texture->view;
+    retired->frame = streamer->frame;
+
+    texture->image = texture->pendingImage;
+    texture->memory = texture->pendingMemory;
+    texture->view = texture->pendingView;
+    texture->residentLevel = texture->pendingLevel;
+    texture->pending = 0;
+}
+
+// Fills in how much device memory each image streamTextureLevel can create
+// for the texture takes, so the budget is checked in the same units as the
+// allocations residentBytes adds up. Each size comes from an image created
+// only to ask for its memory requirements.
+void measureStreamedTexture(struct Engine* engine, struct StreamedTexture* texture)
+{
+    struct TextureSource* source = &(texture->source);
+    texture->levelBytes = calloc(source->mipLevels, sizeof(*(texture->levelBytes)));
+
+    uint32_t i;
+    for (i=0; i<=texture->tailLevel; i++)
+    {
+        VkImage image;
+        createUnboundImage(
+            engine,
+            source->format,
+            source->levels[i].width,
+            source->levels[i].height,
+            source->mipLevels - i,
+            1,
+            VK_IMAGE_TILING_OPTIMAL,
+            STREAMED_IMAGE_USAGE,
+            &image
+        );
+
+        VkMemoryRequirements memRequirements;
+        vkGetImageMemoryRequirements(engine->device, image, &memRequirements);
+        texture->levelBytes[i] = memRequirements.size;
+
+        vkDestroyImage(engine->device, image, NULL);
+    }
+}
+
+// The sharpest level the texture needs to cover screenSize pixels with at
+// least one texel each. Textures that aren't on screen only need the tail.
+uint32_t streamedTextureLevel(const struct StreamedTexture* texture, float screenSize)
+{
+    if (screenSize <= 0.0f)
+        return texture->tailLevel;
+
+    uint32_t size = max(texture->source.width, texture->source.height);
+    uint32_t level = 0;
+    while (level < texture->tailLevel && (size >> (level + 1)) >= screenSize)
+        level++;
+
+    return level;
+}
+
+// Size in pixels of the larger side of the mesh's screen-space bounding
+// box, 0 when it is entirely off screen. Vertices behind the camera make it
+// cover the whole screen.
+float meshScreenSize(struct Engine* engine, struct UniformBufferObject* ubo)
+{
+    mat4x4 viewModel, mvp;
+    mat4x4_mul(viewModel, ubo->view, ubo->model);
+    mat4x4_mul(mvp, ubo->proj, viewModel);
+
+    float minX = 1.0f, minY = 1.0f, maxX = -1.0f, maxY = -1.0f;
+    uint32_t i;
+    for (i=0; i<engine->vertexCount; i++)
+    {
+        vec4 position = {
+            engine->vertices[i].position[0],
+            engine->vertices[i].position[1],
+            engine->vertices[i].position[2],
+            1.0f
+        };
+        vec4 clip;
+        mat4x4_mul_vec4(clip, mvp, position);
+
+        if (clip[3] <= 0.0f)
+        {
+            minX = minY = -1.0f;
+            maxX = maxY = 1.0f;
+            break;
+        }
+
+        float x = clip[0] / clip[3];
+        float y = clip[1] / clip[3];
+        minX = x < minX ? x : minX;
+        minY = y < minY ? y : minY;
+        maxX = x > maxX ? x : maxX;
+        maxY = y > maxY ? y : maxY;
+    }
+
+    // Clip the box to the screen
+    minX = minX < -1.0f ? -1.0f : minX;
+    minY = minY < -1.0f ? -1.0f : minY;
+    maxX = maxX > 1.0f ? 1.0f : maxX;
+    maxY = maxY > 1.0f ? 1.0f : maxY;
+    if (maxX <= minX || maxY <= minY)
+        return 0.0f;
+
+    float width = (maxX - minX) * 0.5f * engine->swapChainExtent.width;
+    float height = (maxY - minY) * 0.5f * engine->swapChainExtent.height;
+    return width > height ? width : height;
+}
+
+void textureStreamerReport(struct Engine* engine, FILE* fp)
+{
+    struct TextureStreamer* streamer = &(engine->streamer);
+
+    fprintf(
+        fp,
+        "Texture streaming: %.2f of %.2f MiB resident, %u uploads, %u evictions\n",
+        streamer->residentBytes / (1024.0 * 1024.0),
+        streamer->budget / (1024.0 * 1024.0),
+        streamer->uploadCount,
+        streamer->evictionCount
+    );
+
+    uint32_t i;
+    for (i=0; i<streamer->textureCount; i++)
+    {
+        struct StreamedTexture* texture = &(streamer->textures[i]);
+        fprintf(
+            fp,
+            "  texture %2u: %ux%u, level %u of %u resident (tail %u)\n",
+            i,
+            texture->source.width,
+            texture->source.height,
+            texture->residentLevel,
+            texture->source.mipLevels,
+            texture->tailLevel
+        );
+    }
+}
+
+// TEXTURE ATLAS
+void createTextureAtlas(struct Engine* engine)
+{
+    struct TextureAtlas* atlas = &(engine->atlas);
+    if (!atlas->enabled)
+        return;
+
+    struct DecodeJob* jobs = calloc(atlas->entryCount, sizeof(*jobs));
+    atlas->entries = calloc(atlas->entryCount, sizeof(*(atlas->entries)));
+
+    uint32_t i;
+    for (i=0; i<atlas->entryCount; i++)
+        jobs[i].path = atlas->paths[i];
+
+    // Every image is read and decoded by the pool before any is packed
+    decodeImageFiles(engine, jobs, atlas->entryCount, prepareAtlasDecode, NULL);
+    for (i=0; i<atlas->entryCount; i++)
+    {
+        if (jobs[i].failed)
+        {
+            fprintf(stderr, "stb_image failed to load resource %s\n", jobs[i].path);
+            exit(-1);
+        }
+    }
+
+    packTextureAtlas(engine, jobs);
+
+    createImage(
+        engine,
+        VK_FORMAT_R8G8B8A8_UNORM,
+        atlas->layerSize,
+        atlas->layerSize,
+        atlas->mipLevels,
+        atlas->layerCount,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        GPU_MEMORY_DEVICE,
+        &(atlas->image),
+        &(atlas->memory)
+    );
+    transitionImageLayout(
+        engine,
+        atlas->image,
+        VK_FORMAT_R8G8B8A8_UNORM,
+        atlas->mipLevels,
+        atlas->layerCount,
+        VK_IMAGE_LAYOUT_UNDEFINED,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+    );
+
+    // Space no cell covers is never sampled, cleared so it is defined
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+    VkClearColorValue clearColor = {{0.0f, 0.0f, 0.0f, 0.0f}};
+    VkImageSubresourceRange range;
+    range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    range.baseMipLevel = 0;
+    range.levelCount = atlas->mipLevels;
+    range.baseArrayLayer = 0;
+    range.layerCount = atlas->layerCount;
+    vkCmdClearColorImage(
+        commandBuffer,
+        atlas->image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        &clearColor,
+        1,
+        &range
+    );
+    endSingleTimeCommands(engine, commandBuffer);
+
+    // Every level of every entry's cell, borders included. Levels past the
+    // end of a small texture's chain repeat its last level.
+    uint32_t subresourceCount = atlas->entryCount * atlas->mipLevels;
+    struct TextureSubresourceData* subresources = calloc(
+        subresourceCount,
+        sizeof(*subresources)
+    );
+    VkOffset3D* offsets = calloc(subresourceCount, sizeof(*offsets));
+    unsigned char** cellPixels = calloc(atlas->entryCount, sizeof(*cellPixels));
+    uint32_t count = 0;
+    for (i=0; i<atlas->entryCount; i++)
+    {
+        struct AtlasEntry* entry = &(atlas->entries[i]);
+        uint32_t cellWidth = atlasCellSize(jobs[i].width);
+        uint32_t cellHeight = atlasCellSize(jobs[i].height);
+        uint32_t j;
+
+        size_t size = 0;
+        for (j=0; j<atlas->mipLevels; j++)
+            size += (size_t)(cellWidth >> j) * (cellHeight >> j) * 4;
+        cellPixels[i] = malloc(size);
+
+        // The decoded levels are packed one after the other
+        struct TextureSubresourceData level;
+        level.width = jobs[i].width;
+        level.height = jobs[i].height;
+        level.rowPitch = (VkDeviceSize)level.width * 4;
+        level.data = jobs[i].dst;
+
+        unsigned char* dst = cellPixels[i];
+        for (j=0; j<atlas->mipLevels; j++)
+        {
+            if (j > 0 && j < jobs[i].mipLevels)
+            {
+                level.data = (const unsigned char*)level.data +
+                    level.rowPitch * level.height;
+                level.width = max(level.width / 2, 1);
+                level.height = max(level.height / 2, 1);
+                level.rowPitch = (VkDeviceSize)level.width * 4;
+            }
+
+            uint32_t levelWidth = cellWidth >> j;
+            uint32_t levelHeight = cellHeight >> j;
+            fillAtlasCell(
+                &level,
+                ATLAS_ALIGNMENT >> j,
+                ATLAS_ALIGNMENT >> j,
+                levelWidth,
+                levelHeight,
+                dst
+            );
+
+            subresources[count].mipLevel = j;
+            subresources[count].arrayLayer = entry->layer;
+            subresources[count].width = levelWidth;
+            subresources[count].height = levelHeight;
+            subresources[count].rowPitch = (VkDeviceSize)levelWidth * 4;
+            subresources[count].data = dst;
+            offsets[count].x = (int32_t)((entry->x - ATLAS_ALIGNMENT) >> j);
+            offsets[count].y = (int32_t)((entry->y - ATLAS_ALIGNMENT) >> j);
+            offsets[count].z = 0;
+            count++;
+
+            dst += (size_t)levelWidth * levelHeight * 4;
+        }
+    }
+
+    VkBuffer stagingBuffer;
+    struct GpuAllocation stagingBufferMemory;
+    VkBufferImageCopy* regions = calloc(subresourceCount, sizeof(*regions));
+    stageTextureData(
+        engine,
+        subresources,
+        subresourceCount,
+        4,
+        1,
+        &stagingBuffer,
+        &stagingBufferMemory,
+        regions
+    );
+    for (i=0; i<subresourceCount; i++)
+        regions[i].imageOffset = offsets[i];
+
+    copyBufferToImage(
+        engine,
+        stagingBuffer,
+        atlas->image,
+        regions,
+        subresourceCount
+    );
+    transitionImageLayout(
+        engine,
+        atlas->image,
+        VK_FORMAT_R8G8B8A8_UNORM,
+        atlas->mipLevels,
+        atlas->layerCount,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    );
+    releaseStagingResource(
+        engine,
+        stagingBuffer,
+        VK_NULL_HANDLE,
+        &stagingBufferMemory
+    );
+
+    free(regions);
+    free(offsets);
+    free(subresources);
+    for (i=0; i<atlas->entryCount; i++)
+    {
+        free(cellPixels[i]);
+        free(jobs[i].dst);
+    }
+    free(cellPixels);
+    free(jobs);
+
+    createImageViewLayers(
+        engine,
+        atlas->image,
+        VK_FORMAT_R8G8B8A8_UNORM,
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+        atlas->mipLevels,
+        atlas->layerCount,
+        &(atlas->view)
+    );
+
+    engine->textureFormat = VK_FORMAT_R8G8B8A8_UNORM;
+    engine->textureMipLevels = atlas->mipLevels;
+}
+
+void destroyTextureAtlas(struct Engine* engine)
+{
+    struct TextureAtlas* atlas = &(engine->atlas);
+    if (!atlas->enabled)
+        return;
+
+    vkDestroyImageView(engine->device, atlas->view, NULL);
+    vkDestroyImage(engine->device, atlas->image, NULL);
+    gpuFree(engine, &(atlas->memory));
+    free(atlas->entries);
+    free(atlas->paths);
+}
+
+// Places every image's cell in a layer with a shelf packer, tallest first.
+// Cells don't overlap and stay inside the layer, so no entry's border is
+// shared with a neighbour or wraps around to the other side of the layer.
+void packTextureAtlas(struct Engine* engine, const struct DecodeJob* jobs)
+{
+    struct TextureAtlas* atlas = &(engine->atlas);
+
+    uint32_t* order = malloc(atlas->entryCount * sizeof(*order));
+    uint32_t i, j;
+    atlas->layerSize = ATLAS_LAYER_SIZE;
+    for (i=0; i<atlas->entryCount; i++)
+    {
+        order[i] = i;
+        uint32_t size = atlasCellSize(max(jobs[i].width, jobs[i].height));
+        atlas->layerSize = max(atlas->layerSize, size);
+    }
+    if (atlas->layerSize > engine->deviceProperties.limits.maxImageDimension2D)
+    {
+        fprintf(stderr, "Texture is too large for the atlas.\n");
+        exit(-1);
+    }
+
+    // Insertion sort, atlases are built once from a short list
+    for (i=1; i<atlas->entryCount; i++)
+    {
+        uint32_t index = order[i];
+        for (j=i; j>0 && jobs[order[j-1]].height < jobs[index].height; j--)
+            order[j] = order[j-1];
+        order[j] = index;
+    }
+
+    uint32_t shelfCount = 0;
+    struct AtlasShelf* shelves = calloc(atlas->entryCount, sizeof(*shelves));
+    uint32_t layerTop = 0;
+    atlas->layerCount = 1;
+
+    for (i=0; i<atlas->entryCount; i++)
+    {
+        const struct DecodeJob* job = &(jobs[order[i]]);
+        struct AtlasEntry* entry = &(atlas->entries[order[i]]);
+        uint32_t width = atlasCellSize(job->width);
+        uint32_t height = atlasCellSize(job->height);
+
+        // Shelves only take entries no taller than their first one
+        struct AtlasShelf* shelf = NULL;
+        for (j=0; j<shelfCount; j++)
+        {
+            if (shelves[j].height >= height &&
+                shelves[j].x + width <= atlas->layerSize)
+            {
+                shelf = &(shelves[j]);
+                break;
+            }
+        }
+
+        if (!shelf)
+        {
+            if (layerTop + height > atlas->layerSize)
+            {
+                atlas->layerCount++;
+                layerTop = 0;
+            }
+            shelf = &(shelves[shelfCount++]);
+            shelf->layer = atlas->layerCount - 1;
+            shelf->x = 0;
+            shelf->y = layerTop;
+            shelf->height = height;
+            layerTop += height;
+        }
+
+        entry->layer = shelf->layer;
+        entry->x = shelf->x + ATLAS_ALIGNMENT;
+        entry->y = shelf->y + ATLAS_ALIGNMENT;
+        shelf->x += width;
+
+        float layerSize = (float)atlas->layerSize;
+        entry->constants.uvTransform[0] = job->width / layerSize;
+        entry->constants.uvTransform[1] = job->height / layerSize;
+        entry->constants.uvTransform[2] = entry->x / layerSize;
+        entry->constants.uvTransform[3] = entry->y / layerSize;
+        entry->constants.layer = entry->layer;
+    }
+
+    if (atlas->layerCount > engine->deviceProperties.limits.maxImageArrayLayers)
+    {
+        fprintf(stderr, "Too many textures for the atlas.\n");
+        exit(-1);
+    }
+
+    atlas->mipLevels = min(ATLAS_MIP_LEVELS, mipLevelCount(atlas->layerSize, atlas->layerSize));
+
+    free(shelves);
+    free(order);
+}
+
+// Gives an atlas image a heap buffer to decode into, big enough for the
+// levels the atlas samples
+void prepareAtlasDecode(struct Engine* engine, struct DecodeJob* job, uint32_t index, void* userData)
+{
+    (void)engine;
+    (void)index;
+    (void)userData;
+
+    job->mipLevels = min(
+        mipLevelCount(job->width, job->height),
+        ATLAS_MIP_LEVELS
+    );
+
+    size_t size = 0;
+    uint32_t i;
+    for (i=0; i<job->mipLevels; i++)
+        size += (size_t)max(job->width >> i, 1) * max(job->height >> i, 1) * 4;
+    if (job->mipLevels == 1)
+        size += DECODE_TARGET_PADDING;
+
+    job->dst = malloc(size);
+}
+
+// An entry's size rounded up to ATLAS_ALIGNMENT plus a border on both sides
+uint32_t atlasCellSize(uint32_t size)
+{
+    size = (size + ATLAS_ALIGNMENT - 1) / ATLAS_ALIGNMENT * ATLAS_ALIGNMENT;
+    return size + 2 * ATLAS_ALIGNMENT;
+}
+
+// Writes a cellWidth x cellHeight cell with the level at (x, y) in it and
+// the level's edge texels repeated out to the edges of the cell, so
+// filtering at the edges of an entry never blends in anything else
+void fillAtlasCell(const struct TextureSubresourceData* level, uint32_t x, uint32_t y, uint32_t cellWidth, uint32_t cellHeight, unsigned char* dst)
+{
+    uint32_t cellX, cellY;
+    for (cellY=0; cellY<cellHeight; cellY++)
+    {
+        uint32_t levelY = cellY < y ? 0 : min(cellY - y, level->height - 1);
+        const unsigned char* row = (const unsigned char*)level->data +
+            levelY * level->rowPitch;
+        for (cellX=0; cellX<cellWidth; cellX++)
+        {
+            uint32_t levelX = cellX < x ? 0 : min(cellX - x, level->width - 1);
+            memcpy(dst, row + levelX * 4, 4);
+            dst += 4;
+        }
+    }
+}
+
+// BINDLESS TEXTURES
+// Turns bindless mode off when the device can't do descriptor indexing,
+// otherwise enables the extensions and fills in the features the texture
+// table needs. The shader indexes the table with a push constant, which
+// takes dynamic indexing of sampled image arrays.
+void checkBindlessSupport(
+    struct Engine* engine,
+    const VkPhysicalDeviceFeatures* supportedFeatures,
+    VkPhysicalDeviceFeatures* enabledFeatures,
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT* features
+)
+{
+    struct BindlessTextures* bindless = &(engine->bindless);
+
+    PFN_vkGetPhysicalDeviceFeatures2KHR getFeatures2 =
+        (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(
+            engine->instance,
+            "vkGetPhysicalDeviceFeatures2KHR"
+        );
+    PFN_vkGetPhysicalDeviceProperties2KHR getProperties2 =
+        (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(
+            engine->instance,
+            "vkGetPhysicalDeviceProperties2KHR"
+        );
+
+    const char* extensions[] = {
+        VK_KHR_MAINTENANCE3_EXTENSION_NAME,
+        VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME
+    };
+    uint32_t extensionCount =
+        sizeof(extensions)/sizeof(extensions[0]);
+
+    uint32_t availableCount;
+    vkEnumerateDeviceExtensionProperties(
+        engine->physicalDevice,
+        NULL,
+        &availableCount,
+        NULL
+    );
+    VkExtensionProperties* available = calloc(availableCount, sizeof(*available));
+    vkEnumerateDeviceExtensionProperties(
+        engine->physicalDevice,
+        NULL,
+        &availableCount,
+        available
+    );
+
+    uint32_t found = 0;
+    uint32_t i, j;
+    for (i=0; i<extensionCount; i++)
+    {
+        for (j=0; j<availableCount; j++)
+        {
+            if (strcmp(extensions[i], available[j].extensionName) == 0)
+            {
+                found++;
+                break;
+            }
+        }
+    }
+    free(available);
+
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT supported;
+    memset(&supported, 0, sizeof(supported));
+    supported.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+
+    VkPhysicalDeviceDescriptorIndexingPropertiesEXT properties;
+    memset(&properties, 0, sizeof(properties));
+    properties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+
+    if (found == extensionCount && getFeatures2 && getProperties2)
+    {
+        VkPhysicalDeviceFeatures2KHR features2;
+        memset(&features2, 0, sizeof(features2));
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+        features2.pNext = &supported;
+        getFeatures2(engine->physicalDevice, &features2);
+
+        VkPhysicalDeviceProperties2KHR properties2;
+        memset(&properties2, 0, sizeof(properties2));
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+        properties2.pNext = &properties;
+        getProperties2(engine->physicalDevice, &properties2);
+    }
+
+    if (!supportedFeatures->shaderSampledImageArrayDynamicIndexing ||
+        !supported.runtimeDescriptorArray ||
+        !supported.descriptorBindingPartiallyBound ||
+        !supported.descriptorBindingVariableDescriptorCount ||
+        !supported.descriptorBindingSampledImageUpdateAfterBind)
+    {
+        fprintf(stderr, "Descriptor indexing isn't supported, bindless textures are disabled.\n");
+        bindless->enabled = 0;
+        return;
+    }
+
+    bindless->capacity = min(
+        BINDLESS_MAX_TEXTURES,
+        min(
+            properties.maxDescriptorSetUpdateAfterBindSampledImages,
+            properties.maxPerStageDescriptorUpdateAfterBindSampledImages
+        )
+    );
+
+    enabledFeatures->shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+    features->runtimeDescriptorArray = VK_TRUE;
+    features->descriptorBindingPartiallyBound = VK_TRUE;
+    features->descriptorBindingVariableDescriptorCount = VK_TRUE;
+    features->descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+
+    for (i=0; i<extensionCount; i++)
+    {
+        engine->deviceExtensions[engine->deviceExtensionCount] =
+            calloc(1, strlen(extensions[i])+1);
+        strcpy(
+            engine->deviceExtensions[engine->deviceExtensionCount++],
+            extensions[i]
+        );
+    }
+}
+
+// Set 1 of the bindless pipeline: a sampler and a partially bound array of
+// sampled images that can be written while the set is bound
+void createBindlessLayout(struct Engine* engine)
+{
+    struct BindlessTextures* bindless = &(engine->bindless);
+    if (!bindless->enabled)
+        return;
+
+    VkDescriptorSetLayoutBinding bindings[2];
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    bindings[0].pImmutableSamplers = NULL;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    bindings[1].descriptorCount = bindless->capacity;
+    bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    bindings[1].pImmutableSamplers = NULL;
+
+    VkDescriptorBindingFlagsEXT bindingFlags[2];
+    bindingFlags[0] = 0;
+    bindingFlags[1] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT |
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+        VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT;
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flagsInfo;
+    flagsInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+    flagsInfo.pNext = NULL;
+    flagsInfo.bindingCount = 2;
+    flagsInfo.pBindingFlags = bindingFlags;
+
+    VkDescriptorSetLayoutCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    createInfo.pNext = &flagsInfo;
+    createInfo.flags =
+        VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+    createInfo.bindingCount = 2;
+    createInfo.pBindings = bindings;
+
+    VkResult result;
+    result = vkCreateDescriptorSetLayout(
+        engine->device,
+        &createInfo,
+        NULL,
+        &(bindless->layout)
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create bindless descriptor set layout.\n");
+        exit(-1);
+    }
+}
+
+void destroyBindlessLayout(struct Engine* engine)
+{
+    if (!engine->bindless.enabled)
+        return;
+
+    vkDestroyDescriptorSetLayout(engine->device, engine->bindless.layout, NULL);
+}
+
+// Allocates the texture table, which lives for the whole session, and
+// registers the engine's texture as index 0 followed by the extra textures
+void createBindlessTable(struct Engine* engine)
+{
+    struct BindlessTextures* bindless = &(engine->bindless);
+    if (!bindless->enabled)
+        return;
+
+    VkDescriptorPoolSize poolSizes[2];
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_SAMPLER;
+    poolSizes[0].descriptorCount = 1;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    poolSizes[1].descriptorCount = bindless->capacity;
+
+    VkDescriptorPoolCreateInfo poolInfo;
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.pNext = NULL;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+    poolInfo.maxSets = 1;
+    poolInfo.poolSizeCount = 2;
+    poolInfo.pPoolSizes = poolSizes;
+
+    VkResult result;
+    result = vkCreateDescriptorPool(
+        engine->device,
+        &poolInfo,
+        NULL,
+        &(bindless->pool)
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create bindless descriptor pool.\n");
+        exit(-1);
+    }
+
+    VkDescriptorSetVariableDescriptorCountAllocateInfoEXT countInfo;
+    countInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO_EXT;
+    countInfo.pNext = NULL;
+    countInfo.descriptorSetCount = 1;
+    countInfo.pDescriptorCounts = &(bindless->capacity);
+
+    VkDescriptorSetAllocateInfo allocInfo;
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.pNext = &countInfo;
+    allocInfo.descriptorPool = bindless->pool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &(bindless->layout);
+
+    result = vkAllocateDescriptorSets(engine->device, &allocInfo, &(bindless->set));
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to allocate bindless descriptor set.\n");
+        exit(-1);
+    }
+
+    VkDescriptorImageInfo samplerInfo;
+    samplerInfo.sampler = engine->textureSampler;
+    samplerInfo.imageView = VK_NULL_HANDLE;
+    samplerInfo.imageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkWriteDescriptorSet samplerWrite;
+    samplerWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    samplerWrite.pNext = NULL;
+    samplerWrite.dstSet = bindless->set;
+    samplerWrite.dstBinding = 0;
+    samplerWrite.dstArrayElement = 0;
+    samplerWrite.descriptorCount = 1;
+    samplerWrite.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+    samplerWrite.pImageInfo = &samplerInfo;
+    samplerWrite.pBufferInfo = NULL;
+    samplerWrite.pTexelBufferView = NULL;
+    vkUpdateDescriptorSets(engine->device, 1, &samplerWrite, 0, NULL);
+
+    addBindlessTexture(engine, engine->textureImageView);
+
+    if (bindless->pathCount == 0)
+        return;
+
+    bindless->loads = calloc(bindless->pathCount, sizeof(*(bindless->loads)));
+    bindless->views = calloc(bindless->pathCount, sizeof(*(bindless->views)));
+
+    uint32_t i;
+    for (i=0; i<bindless->pathCount; i++)
+        bindless->loads[i].path = bindless->paths[i];
+    loadTextures(engine, bindless->loads, bindless->pathCount);
+
+    for (i=0; i<bindless->pathCount; i++)
+    {
+        createImageView(
+            engine,
+            bindless->loads[i].image,
+            VK_FORMAT_R8G8B8A8_UNORM,
+            VK_IMAGE_ASPECT_COLOR_BIT,
+            bindless->loads[i].mipLevels,
+            &(bindless->views[i])
+        );
+        addBindlessTexture(engine, bindless->views[i]);
+    }
+}
+
+void destroyBindlessTable(struct Engine* engine)
+{
+    struct BindlessTextures* bindless = &(engine->bindless);
+    free(bindless->paths);
+    if (!bindless->enabled)
+        return;
+
+    uint32_t i;
+    for (i=0; i<bindless->pathCount; i++)
+    {
+        vkDestroyImageView(engine->device, bindless->views[i], NULL);
+        vkDestroyImage(engine->device, bindless->loads[i].image, NULL);
+        gpuFree(engine, &(bindless->loads[i].memory));
+    }
+    free(bindless->views);
+    free(bindless->loads);
+
+    // Frees the set
+    vkDestroyDescriptorPool(engine->device, bindless->pool, NULL);
+}
+
+// Writes the view into the next free slot of the table and returns the index
+// materials use for it. Slots can be written while frames using the table
+// are recorded or in flight, as long as those frames don't read the slot.
+uint32_t addBindlessTexture(struct Engine* engine, VkImageView view)
+{
+    struct BindlessTextures* bindless = &(engine->bindless);
+    if (bindless->textureCount == bindless->capacity)
+    {
+        fprintf(stderr, "The bindless texture table is full.\n");
+        exit(-1);
+    }
+
+    VkDescriptorImageInfo imageInfo;
+    imageInfo.sampler = VK_NULL_HANDLE;
+    imageInfo.imageView = view;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet write;
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.pNext = NULL;
+    write.dstSet = bindless->set;
+    write.dstBinding = 1;
+    write.dstArrayElement = bindless->textureCount;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    write.pImageInfo = &imageInfo;
+    write.pBufferInfo = NULL;
+    write.pTexelBufferView = NULL;
+    vkUpdateDescriptorSets(engine->device, 1, &write, 0, NULL);
+
+    return bindless->textureCount++;
+}
+
+// VERTEX BUFFER
+void createVertexBuffer(struct Engine* engine)
+{
+    VkDeviceSize bufferSize = sizeof(engine->vertices[0]) * engine->vertexCount;
+    VkBuffer stagingBuffer;
+    struct GpuAllocation stagingBufferMemory;
+
+    createBuffer(
+        engine,
+        bufferSize,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        GPU_MEMORY_STAGING,
+        &(stagingBuffer),
+        &(stagingBufferMemory)
+    );
+
+    memcpy(stagingBufferMemory.mapped, engine->vertices, (size_t)bufferSize);
+
+    createBuffer(
+        engine,
+        bufferSize,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        GPU_MEMORY_DEVICE,
+        &(engine->vertexBuffer),
+        &(engine->vertexBufferMemory)
+    );
+    copyBuffer(
+        engine,
+        &(stagingBuffer),
+        &(engine->vertexBuffer),
+        bufferSize
+    );
+
+    releaseStagingResource(
+        engine,
+        stagingBuffer,
+        VK_NULL_HANDLE,
+        &stagingBufferMemory
+    );
+}
+
+void copyBuffer(struct Engine* engine, VkBuffer* src, VkBuffer* dst, VkDeviceSize size)
+{
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+
+    VkBufferCopy copyRegion;
+    copyRegion.srcOffset = 0;
+    copyRegion.dstOffset = 0;
+    copyRegion.size = size;
+    vkCmdCopyBuffer(commandBuffer, *src, *dst, 1, &copyRegion);
+
+    endSingleTimeCommands(engine, commandBuffer);
+}
+
+VkCommandBuffer beginSingleTimeCommands(struct Engine* engine)
+{
+    if (engine->uploadBatch.active)
+        return engine->uploadBatch.commandBuffer;
+
+    VkCommandBufferAllocateInfo allocInfo;
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.pNext = NULL;
+    allocInfo.commandPool = engine->commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(engine->device, &allocInfo, &commandBuffer);
+
+    VkCommandBufferBeginInfo beginInfo;
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.pNext = NULL;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = NULL;
+
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+    return commandBuffer;
+}
+
+void endSingleTimeCommands(struct Engine* engine, VkCommandBuffer commandBuffer)
+{
+    // Batched commands are submitted together by submitUploadBatch
+    if (engine->uploadBatch.active &&
+        commandBuffer == engine->uploadBatch.commandBuffer)
+        return;
+
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = NULL;
+    submitInfo.waitSemaphoreCount = 0;
+    submitInfo.pWaitSemaphores = NULL;
+    submitInfo.pWaitDstStageMask = NULL;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.signalSemaphoreCount = 0;
+    submitInfo.pSignalSemaphores = NULL;
+
+    vkQueueSubmit(engine->graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    vkQueueWaitIdle(engine->graphicsQueue);
+
+    vkFreeCommandBuffers(
+        engine->device,
+        engine->commandPool,
+        1,
+        &commandBuffer
+    );
+}
+
+void createBuffer(struct Engine* engine, VkDeviceSize size, VkBufferUsageFlags usage, enum GpuMemoryUsage memoryUsage, VkBuffer* buffer, struct GpuAllocation* bufferMemory)
+{
+    VkBufferCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.size = size;
+    createInfo.usage = usage;
+    createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    // Only required for sharing mode concurrent
+    createInfo.queueFamilyIndexCount = 0;
+    createInfo.pQueueFamilyIndices = NULL;
+
+    vkCreateBuffer(engine->device, &createInfo, NULL, buffer);
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(
+        engine->device,
+        *buffer,
+        &memRequirements
+    );
+
+    gpuAllocate(engine, &memRequirements, memoryUsage, 1, bufferMemory);
+
+    vkBindBufferMemory(
+        engine->device,
+        *buffer,
+        bufferMemory->memory,
+        bufferMemory->offset
+    );
+}
+
+void destroyVertexBuffer(struct Engine* engine)
+{
+    vkDestroyBuffer(engine->device, engine->vertexBuffer, NULL);
+}
+
+void freeVertexBufferMemory(struct Engine* engine)
+{
+    gpuFree(engine, &(engine->vertexBufferMemory));
+}
+
+// Property flags a usage requires, would like and would rather not have.
+// Staging stays out of device-local host-visible memory (the small BAR
+// window without resizable BAR) so dynamic buffers can use it, and readback
+// wants cached memory since uncached reads are very slow.
+static const struct
+{
+    VkMemoryPropertyFlags required;
+    VkMemoryPropertyFlags preferred;
+    VkMemoryPropertyFlags avoided;
+} memoryUsageFlags[] = {
+    [GPU_MEMORY_DEVICE] = {
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        0,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+    },
+    [GPU_MEMORY_STAGING] = {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        0,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+        VK_MEMORY_PROPERTY_HOST_CACHED_BIT
+    },
+    [GPU_MEMORY_DYNAMIC] = {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        VK_MEMORY_PROPERTY_HOST_CACHED_BIT
+    },
+    [GPU_MEMORY_READBACK] = {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+        VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+    }
+};
+
+static uint32_t countBits(uint32_t value)
+{
+    uint32_t count = 0;
+    for (; value; value &= value - 1)
+        count++;
+    return count;
+}
+
+// Ranks every allowed memory type with the required flags by how well it
+// suits the usage, earlier types win ties as the spec orders them by
+// performance
+uint32_t findMemType(struct Engine* engine, uint32_t typeFilter, enum GpuMemoryUsage usage)
+{
+    VkPhysicalDeviceMemoryProperties* memProperties = &(engine->memoryProperties);
+    VkMemoryPropertyFlags required = memoryUsageFlags[usage].required;
+    VkMemoryPropertyFlags preferred = memoryUsageFlags[usage].preferred;
+    VkMemoryPropertyFlags avoided = memoryUsageFlags[usage].avoided;
+
+    uint32_t best = UINT32_MAX;
+    int bestScore = 0;
+    uint32_t i;
+    for (i=0; i<memProperties->memoryTypeCount; i++)
+    {
+        VkMemoryPropertyFlags flags = memProperties->memoryTypes[i].propertyFlags;
+        if (!(typeFilter & (1 << i)) || (flags & required) != required)
+            continue;
+
+        int score = 2 * countBits(flags & preferred) - countBits(flags & avoided);
+        if (best == UINT32_MAX || score > bestScore)
+        {
+            best = i;
+            bestScore = score;
+        }
+    }
+
+    if (best == UINT32_MAX)
+    {
+        fprintf(stderr, "Failed to find a suitable memory type.\n");
+        exit(-1);
+    }
+    return best;
+}
+
+// INDEX BUFFER
+void createIndexBuffer(struct Engine* engine)
+{
+    VkDeviceSize bufferSize = sizeof(engine->indices[0]) * engine->indexCount;
+    VkBuffer stagingBuffer;
+    struct GpuAllocation stagingBufferMemory;
+
+    createBuffer(
+        engine,
+        bufferSize,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        GPU_MEMORY_STAGING,
+        &(stagingBuffer),
+        &(stagingBufferMemory)
+    );
+
+    memcpy(stagingBufferMemory.mapped, engine->indices, (size_t)bufferSize);
+
+    createBuffer(
+        engine,
+        bufferSize,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        GPU_MEMORY_DEVICE,
+        &(engine->indexBuffer),
+        &(engine->indexBufferMemory)
+    );
+    copyBuffer(
+        engine,
+        &(stagingBuffer),
+        &(engine->indexBuffer),
+        bufferSize
+    );
+
+    releaseStagingResource(
+        engine,
+        stagingBuffer,
+        VK_NULL_HANDLE,
+        &stagingBufferMemory
+    );
+}
+
+void destroyIndexBuffer(struct Engine* engine)
+{
+    vkDestroyBuffer(engine->device, engine->indexBuffer, NULL);
+}
+
+void freeIndexBufferMemory(struct Engine* engine)
+{
+    gpuFree(engine, &(engine->indexBufferMemory));
+}
+
+// UNIFORM BUFFER
+void createUniformBuffer(struct Engine* engine)
+{
+    // Dynamic uniform offsets must be a multiple of the device alignment
+    VkDeviceSize alignment =
+        engine->deviceProperties.limits.minUniformBufferOffsetAlignment;
+    engine->uniformStride = sizeof(struct UniformBufferObject);
+    if (alignment > 0)
+    {
+        engine->uniformStride =
+            (engine->uniformStride + alignment - 1) & ~(alignment - 1);
+    }
+
+    VkDeviceSize bufferSize = engine->uniformStride * engine->framesInFlight;
+
+    createBuffer(
+        engine,
+        bufferSize,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        GPU_MEMORY_DYNAMIC,
+        &(engine->uniformBuffer),
+        &(engine->uniformBufferMemory)
+    );
+
+    // Host visible blocks stay mapped, coherent memory needs no flush
+    engine->uniformData = engine->uniformBufferMemory.mapped;
+}
+
+// Writes the current frame's slice of the uniform ring. Must only be called
+// after the frame's fence has signalled, since the GPU may still be reading
+// the slice written framesInFlight frames ago.
+void updateUniformBuffer(struct Engine* engine)
+{
+    struct UniformBufferObject ubo;
+    computeUniforms(engine, &ubo);
+
+    memcpy(
+        engine->uniformData + engine->currentFrame * engine->uniformStride,
+        &ubo,
+        sizeof(ubo)
+    );
+}
+
+// The transforms the frame is drawn with, also used to size streamed
+// textures on screen
+void computeUniforms(struct Engine* engine, struct UniformBufferObject* ubo)
+{
+    memset(ubo, 0, sizeof(*ubo));
+
+    mat4x4 empty;
+    memset(&empty, 0, sizeof(empty));
+    mat4x4_identity(empty);
+
+    mat4x4_identity(ubo->model);
+    mat4x4_rotate(
+        ubo->model, empty,
+        0.0f, 0.0f, 1.0f,
+        (float)degreesToRadians(22.5)
+    );
+
+    vec3 eye = {2.0f, 2.0f, 2.0f};
+    vec3 center = {0.0f, 0.0f, 0.0f};
+    vec3 up = {0.0f, 0.0f, 1.0f};
+    mat4x4_look_at(ubo->view, eye, center, up);
+
+    mat4x4_perspective(
+        ubo->proj,
+        (float)degreesToRadians(45.0f),
+        engine->swapChainExtent.width/(float)engine->swapChainExtent.height,
+        0.1f,
+        100.0f
+    );
+
+    ubo->proj[1][1] *= -1;
+}
+
+void destroyUniformBuffer(struct Engine* engine)
+{
+    vkDestroyBuffer(engine->device, engine->uniformBuffer, NULL);
+}
+
+void freeUniformBufferMemory(struct Engine* engine)
+{
+    gpuFree(engine, &(engine->uniformBufferMemory));
+}
+
+// UPLOAD BATCH
+// While a batch is open, beginSingleTimeCommands hands out the batch's
+// command buffer and endSingleTimeCommands is a no-op, so every transfer and
+// layout transition is recorded into one submission.
+void beginUploadBatch(struct Engine* engine)
+{
+    struct UploadBatch* batch = &(engine->uploadBatch);
+
+    VkCommandBufferAllocateInfo allocInfo;
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.pNext = NULL;
+    allocInfo.commandPool = engine->commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+
+    VkResult result;
+    result = vkAllocateCommandBuffers(
+        engine->device,
+        &allocInfo,
+        &(batch->commandBuffer)
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to allocate upload command buffer.\n");
+        exit(-1);
+    }
+
+    VkCommandBufferBeginInfo beginInfo;
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.pNext = NULL;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = NULL;
+
+    vkBeginCommandBuffer(batch->commandBuffer, &beginInfo);
+
+    batch->stagingCount = 0;
+    batch->active = 1;
+}
+
+// Submits everything recorded since beginUploadBatch, waits on a single
+// fence and then releases the staging resources the batch kept alive
+void submitUploadBatch(struct Engine* engine)
+{
+    struct UploadBatch* batch = &(engine->uploadBatch);
+
+    // Make every transfer visible to the stages that consume uploads
+    VkMemoryBarrier barrier;
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.pNext = NULL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask =
+        VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+        VK_ACCESS_INDEX_READ_BIT |
+        VK_ACCESS_UNIFORM_READ_BIT |
+        VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(
+        batch->commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0,
+        1,
+        &barrier,
+        0,
+        NULL,
+        0,
+        NULL
+    );
+
+    vkEndCommandBuffer(batch->commandBuffer);
+    batch->active = 0;
+
+    VkFenceCreateInfo fenceInfo;
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.pNext = NULL;
+    fenceInfo.flags = 0;
+
+    VkFence fence;
+    VkResult result;
+    result = vkCreateFence(engine->device, &fenceInfo, NULL, &fence);
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create upload fence.\n");
+        exit(-1);
+    }
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = NULL;
+    submitInfo.waitSemaphoreCount = 0;
+    submitInfo.pWaitSemaphores = NULL;
+    submitInfo.pWaitDstStageMask = NULL;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &(batch->commandBuffer);
+    submitInfo.signalSemaphoreCount = 0;
+    submitInfo.pSignalSemaphores = NULL;
+
+    result = vkQueueSubmit(engine->graphicsQueue, 1, &submitInfo, fence);
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to submit upload batch.\n");
+        exit(-1);
+    }
+
+    vkWaitForFences(engine->device, 1, &fence, VK_TRUE, UINT64_MAX);
+    vkDestroyFence(engine->device, fence, NULL);
+
+    vkFreeCommandBuffers(
+        engine->device,
+        engine->commandPool,
+        1,
+        &(batch->commandBuffer)
+    );
+
+    uint32_t i;
+    for (i=0; i<batch->stagingCount; i++)
+    {
+        struct StagingResource* staging = &(batch->staging[i]);
+        if (staging->buffer != VK_NULL_HANDLE)
+            vkDestroyBuffer(engine->device, staging->buffer, NULL);
+        if (staging->image != VK_NULL_HANDLE)
+            vkDestroyImage(engine->device, staging->image, NULL);
+        gpuFree(engine, &(staging->memory));
+    }
+
+    free(batch->staging);
+    batch->staging = NULL;
+    batch->stagingCount = 0;
+    batch->stagingCapacity = 0;
+}
+
+// Destroys a staging buffer or image once the GPU is done reading it:
+// immediately outside a batch, or when the open batch has completed
+void releaseStagingResource(struct Engine* engine, VkBuffer buffer, VkImage image, struct GpuAllocation* memory)
+{
+    struct UploadBatch* batch = &(engine->uploadBatch);
+
+    if (!batch->active)
+    {
+        if (buffer != VK_NULL_HANDLE)
+            vkDestroyBuffer(engine->device, buffer, NULL);
+        if (image != VK_NULL_HANDLE)
+            vkDestroyImage(engine->device, image, NULL);
+        gpuFree(engine, memory);
+        return;
+    }
+
+    if (batch->stagingCount == batch->stagingCapacity)
+    {
+        batch->stagingCapacity = batch->stagingCapacity ?
+            batch->stagingCapacity * 2 : 16;
+        batch->staging = realloc(
+            batch->staging,
+            batch->stagingCapacity * sizeof(*(batch->staging))
+        );
+    }
+
+    struct StagingResource* staging = &(batch->staging[batch->stagingCount++]);
+    staging->buffer = buffer;
+    staging->image = image;
+    staging->memory = *memory;
+}
+
+// ASYNC UPLOADS
+void createTransferContext(struct Engine* engine)
+{
+    VkCommandPoolCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    createInfo.queueFamilyIndex = engine->queueFamilyIndices.transferFamily;
+
+    VkResult result;
+    result = vkCreateCommandPool(
+        engine->device,
+        &createInfo,
+        NULL,
+        &(engine->transfer.commandPool)
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create transfer command pool.\n");
+        exit(-1);
+    }
+}
+
+void destroyTransferContext(struct Engine* engine)
+{
+    struct TransferContext* transfer = &(engine->transfer);
+
+    // Called after the device is idle, every upload has completed
+    uint32_t i;
+    for (i=0; i<transfer->uploadCount; i++)
+        freeAsyncUpload(engine, &(transfer->uploads[i]));
+
+    free(transfer->uploads);
+    vkDestroyCommandPool(engine->device, transfer->commandPool, NULL);
+}
+
+// Allocates and begins a transfer queue command buffer and stages the data
+// in a new host-visible buffer, left for the caller to fill when data is
+// NULL. The caller records the copy and finishes with submitAsyncUpload.
+struct AsyncUpload* beginAsyncUpload(struct Engine* engine, const void* data, VkDeviceSize size)
+{
+    struct TransferContext* transfer = &(engine->transfer);
+
+    if (transfer->uploadCount == transfer->uploadCapacity)
+    {
+        transfer->uploadCapacity = transfer->uploadCapacity ?
+            transfer->uploadCapacity * 2 : 16;
+        transfer->uploads = realloc(
+            transfer->uploads,
+            transfer->uploadCapacity * sizeof(*(transfer->uploads))
+        );
+    }
+
+    struct AsyncUpload* upload = &(transfer->uploads[transfer->uploadCount++]);
+    memset(upload, 0, sizeof(*upload));
+    upload->serial = ++transfer->uploadSerial;
+
+    createBuffer(
+        engine,
+        size,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        GPU_MEMORY_STAGING,
+        &(upload->stagingBuffer),
+        &(upload->stagingBufferMemory)
+    );
+
+    if (data)
+        memcpy(upload->stagingBufferMemory.mapped, data, (size_t)size);
+
+    VkCommandBufferAllocateInfo allocInfo;
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.pNext = NULL;
+    allocInfo.commandPool = transfer->commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    vkAllocateCommandBuffers(engine->device, &allocInfo, &(upload->commandBuffer));
+
+    VkCommandBufferBeginInfo beginInfo;
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.pNext = NULL;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = NULL;
+    vkBeginCommandBuffer(upload->commandBuffer, &beginInfo);
+
+    return upload;
+}
+
+// Ends the upload's command buffer and submits it to the transfer queue.
+// The graphics queue picks it up at the start of the next recorded frame.
+void submitAsyncUpload(struct Engine* engine, struct AsyncUpload* upload)
+{
+    vkEndCommandBuffer(upload->commandBuffer);
+
+    VkSemaphoreCreateInfo semaphoreInfo;
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = NULL;
+    semaphoreInfo.flags = 0;
+    vkCreateSemaphore(engine->device, &semaphoreInfo, NULL, &(upload->semaphore));
+
+    VkFenceCreateInfo fenceInfo;
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.pNext = NULL;
+    fenceInfo.flags = 0;
+    vkCreateFence(engine->device, &fenceInfo, NULL, &(upload->fence));
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = NULL;
+    submitInfo.waitSemaphoreCount = 0;
+    submitInfo.pWaitSemaphores = NULL;
+    submitInfo.pWaitDstStageMask = NULL;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &(upload->commandBuffer);
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &(upload->semaphore);
+
+    VkResult result;
+    result = vkQueueSubmit(engine->transferQueue, 1, &submitInfo, upload->fence);
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to submit async upload.\n");
+        exit(-1);
+    }
+
+    upload->state = UPLOAD_SUBMITTED;
+}
+
+// Uploads 2D image subresources without blocking and leaves the image in
+// SHADER_READ_ONLY_OPTIMAL for the fragment shader. The subresources are
+// laid out like stageTextureData does. Returns the upload's serial for
+// asyncUploadPending.
+uint64_t uploadImageAsync(struct Engine* engine, VkImage dst, const struct TextureSubresourceData* subresources, uint32_t subresourceCount, uint32_t blockBytes, uint32_t blockDim)
+{
+    VkBufferImageCopy* regions = calloc(subresourceCount, sizeof(*regions));
+    VkDeviceSize size = layoutTextureData(
+        engine,
+        subresources,
+        subresourceCount,
+        blockBytes,
+        blockDim,
+        regions
+    );
+
+    struct AsyncUpload* upload = beginAsyncUpload(engine, NULL, size);
+    writeTextureData(
+        subresources,
+        subresourceCount,
+        blockBytes,
+        blockDim,
+        regions,
+        upload->stagingBufferMemory.mapped
+    );
+
+    uint32_t levelCount = 0;
+    uint32_t layerCount = 0;
+    uint32_t i;
+    for (i=0; i<subresourceCount; i++)
+    {
+        levelCount = max(levelCount, subresources[i].mipLevel + 1);
+        layerCount = max(layerCount, subresources[i].arrayLayer + 1);
+    }
+
+    VkImageMemoryBarrier* barrier = &(upload->imageBarrier);
+    barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier->pNext = NULL;
+    barrier->srcAccessMask = 0;
+    barrier->dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier->oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier->newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->image = dst;
+    barrier->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier->subresourceRange.baseMipLevel = 0;
+    barrier->subresourceRange.levelCount = levelCount;
+    barrier->subresourceRange.baseArrayLayer = 0;
+    barrier->subresourceRange.layerCount = layerCount;
+
+    vkCmdPipelineBarrier(
+        upload->commandBuffer,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0,
+        0,
+        NULL,
+        0,
+        NULL,
+        1,
+        barrier
+    );
+
+    vkCmdCopyBufferToImage(
+        upload->commandBuffer,
+        upload->stagingBuffer,
+        dst,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        subresourceCount,
+        regions
+    );
+    free(regions);
+
+    // The same barrier, reused as the release/acquire layout transition
+    barrier->srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier->dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier->oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier->newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier->srcQueueFamilyIndex = engine->queueFamilyIndices.transferFamily;
+    barrier->dstQueueFamilyIndex = engine->queueFamilyIndices.graphicsFamily;
+    upload->dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+    recordUploadRelease(engine, upload);
+    submitAsyncUpload(engine, upload);
+    return upload->serial;
+}
+
+// Whether the upload hasn't been acquired by a recorded frame yet
+_Bool asyncUploadPending(struct Engine* engine, uint64_t serial)
+{
+    struct TransferContext* transfer = &(engine->transfer);
+
+    uint32_t i;
+    for (i=0; i<transfer->uploadCount; i++)
+    {
+        if (transfer->uploads[i].serial == serial)
+            return transfer->uploads[i].state == UPLOAD_SUBMITTED;
+    }
+    return 0;
+}
+
+// Records the release half of a queue family ownership transfer. Without a
+// dedicated transfer family this is an ordinary barrier and no acquire is
+// needed on the graphics side.
+void recordUploadRelease(struct Engine* engine, struct AsyncUpload* upload)
+{
+    _Bool ownershipTransfer = engine->queueFamilyIndices.transferFamily !=
+        engine->queueFamilyIndices.graphicsFamily;
+
+    VkImageMemoryBarrier imageBarrier = upload->imageBarrier;
+    VkPipelineStageFlags dstStage = upload->dstStage;
+
+    if (ownershipTransfer)
+    {
+        // dstAccessMask is ignored for a release
+        imageBarrier.dstAccessMask = 0;
+        dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    }
+    else
+    {
+        imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    }
+
+    vkCmdPipelineBarrier(
+        upload->commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        dstStage,
+        0,
+        0,
+        NULL,
+        0,
+        NULL,
+        1,
+        &imageBarrier
+    );
+}
+
+// Records the acquire half of every submitted upload into the frame's
+// command buffer and queues the uploads' semaphores as waits for the frame's
+// submit. Must be recorded outside of a render pass.
+void recordUploadAcquires(struct Engine* engine, VkCommandBuffer commandBuffer)
+{
+    struct TransferContext* transfer = &(engine->transfer);
+    _Bool ownershipTransfer = engine->queueFamilyIndices.transferFamily !=
+        engine->queueFamilyIndices.graphicsFamily;
+
+    transfer->frameWaitCount = 0;
+
+    uint32_t i;
+    for (i=0; i<transfer->uploadCount; i++)
+    {
+        struct AsyncUpload* upload = &(transfer->uploads[i]);
+        if (upload->state != UPLOAD_SUBMITTED)
+            continue;
+        if (transfer->frameWaitCount == MAX_UPLOAD_ACQUIRES_PER_FRAME)
+            break;
+
+        if (ownershipTransfer)
+        {
+            // srcAccessMask is ignored for an acquire
+            VkImageMemoryBarrier imageBarrier = upload->imageBarrier;
+            imageBarrier.srcAccessMask = 0;
+
+            // The source stage must match the semaphore's wait stage so the
+            // layout transition is ordered after the transfer queue's copy
+            vkCmdPipelineBarrier(
+                commandBuffer,
+                upload->dstStage,
+                upload->dstStage,
+                0,
+                0,
+                NULL,
+                0,
+                NULL,
+                1,
+                &imageBarrier
+            );
+        }
+
+        transfer->frameWaitSemaphores[transfer->frameWaitCount] =
+            upload->semaphore;
+        transfer->frameWaitStages[transfer->frameWaitCount] = upload->dstStage;
+        transfer->frameWaitCount++;
+
+        upload->state = UPLOAD_ACQUIRED;
+        upload->acquireFrame = engine->currentFrame;
+    }
+}
+
+// Frees uploads whose acquiring frame has completed. Called once the frame's
+// fence has signalled.
+void retireAsyncUploads(struct Engine* engine, uint32_t frame)
+{
+    struct TransferContext* transfer = &(engine->transfer);
+
+    uint32_t i = 0;
+    while (i < transfer->uploadCount)
+    {
+        struct AsyncUpload* upload = &(transfer->uploads[i]);
+        if (upload->state == UPLOAD_ACQUIRED && upload->acquireFrame == frame)
+        {
+            freeAsyncUpload(engine, upload);
+            transfer->uploads[i] = transfer->uploads[--transfer->uploadCount];
+            continue;
+        }
+        i++;
+    }
+}
+
+void freeAsyncUpload(struct Engine* engine, struct AsyncUpload* upload)
+{
+    vkDestroyFence(engine->device, upload->fence, NULL);
+    vkDestroySemaphore(engine->device, upload->semaphore, NULL);
+    vkFreeCommandBuffers(
+        engine->device,
+        engine->transfer.commandPool,
+        1,
+        &(upload->commandBuffer)
+    );
+    vkDestroyBuffer(engine->device, upload->stagingBuffer, NULL);
+    gpuFree(engine, &(upload->stagingBufferMemory));
+}
+
+// DESCRIPTOR POOL
+void createDescriptorPool(struct Engine* engine)
+{
+    VkDescriptorPoolSize poolSizes[2];
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    poolSizes[0].descriptorCount = engine->framesInFlight;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[1].descriptorCount = engine->framesInFlight;
+
+    VkDescriptorPoolCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.maxSets = engine->framesInFlight;
+    createInfo.poolSizeCount = 2;
+    createInfo.pPoolSizes = poolSizes;
+
+    VkResult result;
+    result = vkCreateDescriptorPool(
+        engine->device,
+        &createInfo,
+        NULL,
+        &(engine->descriptorPool)
+    );
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to create descriptor pool.\n");
+        exit(-1);
+    }
+}
+
+void destroyDescriptorPool(struct Engine* engine)
+{
+    vkDestroyDescriptorPool(engine->device, engine->descriptorPool, NULL);
+}
+
+// DESCRIPTOR SET
+void createDescriptorSet(struct Engine* engine)
+{
+    VkDescriptorSetLayout* layouts = malloc(
+        engine->framesInFlight * sizeof(*layouts)
+    );
+    uint32_t i;
+    for (i=0; i<engine->framesInFlight; i++)
+        layouts[i] = engine->descriptorSetLayout;
+
+    engine->descriptorSets = calloc(
+        engine->framesInFlight,
+        sizeof(*(engine->descriptorSets))
+    );
+    engine->descriptorImageViews = calloc(
+        engine->framesInFlight,
+        sizeof(*(engine->descriptorImageViews))
+    );
+
+    VkDescriptorSetAllocateInfo allocInfo;
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.pNext = NULL;
+    allocInfo.descriptorPool = engine->descriptorPool;
+    allocInfo.descriptorSetCount = engine->framesInFlight;
+    allocInfo.pSetLayouts = layouts;
+
+    VkResult result;
+    result = vkAllocateDescriptorSets(
+        engine->device,
+        &allocInfo,
+        engine->descriptorSets
+    );
+    free(layouts);
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to allocate descriptor sets.\n");
+        exit(-1);
+    }
+
+    for (i=0; i<engine->framesInFlight; i++)
+        writeDescriptorSet(engine, i);
+}
+
+// Points the frame's set at the uniform ring and the active texture view.
+// The frame's previous submission must have completed.
+void writeDescriptorSet(struct Engine* engine, uint32_t frame)
+{
+    VkDescriptorSet descriptorSet = engine->descriptorSets[frame];
+    engine->descriptorImageViews[frame] = activeTextureView(engine);
+
+    VkDescriptorBufferInfo bufferInfo;
+    // The offset of the current frame's slice is supplied at bind time
+    bufferInfo.buffer = engine->uniformBuffer;
+    bufferInfo.offset = 0;
+    bufferInfo.range = sizeof(struct UniformBufferObject);
+
+	VkDescriptorImageInfo imageInfo;
+    imageInfo.sampler = engine->textureSampler;
+    imageInfo.imageView = engine->descriptorImageViews[frame];
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet descriptorWrites[2];
+    descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[0].pNext = NULL;
+    descriptorWrites[0].dstSet = descriptorSet;
+    descriptorWrites[0].dstBinding = 0;
+    descriptorWrites[0].dstArrayElement = 0;
+    descriptorWrites[0].descriptorCount = 1;
+    descriptorWrites[0].descriptorType =
+        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    descriptorWrites[0].pImageInfo = NULL;
+    descriptorWrites[0].pBufferInfo = &bufferInfo;
+    descriptorWrites[0].pTexelBufferView = NULL;
+
+    descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[1].pNext = NULL;
+    descriptorWrites[1].dstSet = descriptorSet;
+    descriptorWrites[1].dstBinding = 1;
+    descriptorWrites[1].dstArrayElement = 0;
+    descriptorWrites[1].descriptorCount = 1;
+    descriptorWrites[1].descriptorType =
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorWrites[1].pImageInfo = &imageInfo;
+    descriptorWrites[1].pBufferInfo = NULL;
+    descriptorWrites[1].pTexelBufferView = NULL;
+
+    vkUpdateDescriptorSets(engine->device, 2, descriptorWrites, 0, NULL);
+}
+
+void freeDescriptorSets(struct Engine* engine)
+{
+    free(engine->descriptorSets);
+    free(engine->descriptorImageViews);
+}
+
+// COMMAND BUFFERS
+void createCommandBuffers(struct Engine* engine)
+{
+    engine->frames = calloc(engine->framesInFlight, sizeof(*(engine->frames)));
+
+    uint32_t i;
+    for (i=0; i<engine->framesInFlight; i++)
+    {
+        // Each frame gets its own pool so it can be reset as a whole once
+        // the frame's fence has signalled
+        VkCommandPoolCreateInfo poolInfo;
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.pNext = NULL;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = engine->queueFamilyIndices.graphicsFamily;
+
+        VkResult result;
+        result = vkCreateCommandPool(
+            engine->device,
+            &poolInfo,
+            NULL,
+            &(engine->frames[i].commandPool)
+        );
+        if (result != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to create frame command pool.\n");
+            exit(-1);
+        }
+
+        VkCommandBufferAllocateInfo allocInfo;
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.pNext = NULL;
+        allocInfo.commandPool = engine->frames[i].commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+
+        result = vkAllocateCommandBuffers(
+            engine->device,
+            &allocInfo,
+            &(engine->frames[i].commandBuffer)
+        );
+        if (result != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to create command buffers.\n");
+            exit(-1);
+        }
+    }
+}
+
+void recordCommandBuffer(struct Engine* engine, VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+    VkCommandBufferBeginInfo beginInfo;
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.pNext = NULL;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = NULL;
 
     vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-    return commandBuffer;
+    recordUploadAcquires(engine, commandBuffer);
+    profilerBeginFrame(engine, commandBuffer);
+    uint32_t mainPass = profilerBeginPass(engine, commandBuffer, "main");
+
+    VkRenderPassBeginInfo renderPassInfo;
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.pNext = NULL;
+    renderPassInfo.renderPass = engine->renderPass;
+    renderPassInfo.framebuffer = engine->framebuffers[imageIndex];
+    renderPassInfo.renderArea.offset.x = 0;
+    renderPassInfo.renderArea.offset.y = 0;
+    renderPassInfo.renderArea.extent = engine->swapChainExtent;
+
+    VkClearValue clearValues[2];
+    clearValues[0].color.float32[0] = 0.0f;
+    clearValues[0].color.float32[1] = 0.0f;
+    clearValues[0].color.float32[2] = 0.0f;
+    clearValues[0].color.float32[3] = 1.0f;
+    clearValues[1].depthStencil.depth = 1.0f;
+    clearValues[1].depthStencil.stencil = 0;
+
+    renderPassInfo.clearValueCount = 2;
+    renderPassInfo.pClearValues = clearValues;
+
+    vkCmdBeginRenderPass(
+        commandBuffer,
+        &renderPassInfo,
+        VK_SUBPASS_CONTENTS_INLINE
+    );
+
+    // Until the pipeline compiler delivers a pipeline the pass only clears
+    if (engine->graphicsPipeline != VK_NULL_HANDLE)
+        recordSceneDraws(engine, commandBuffer);
+
+    vkCmdEndRenderPass(commandBuffer);
+
+    profilerEndPass(engine, commandBuffer, mainPass);
+    profilerEndFrame(engine, commandBuffer);
+
+    VkResult result;
+    result = vkEndCommandBuffer(commandBuffer);
+    if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Failed to record command buffers.\n");
+        exit(-1);
+    }
+}
+
+// Binds the graphics pipeline and records every draw of the main pass
+void recordSceneDraws(struct Engine* engine, VkCommandBuffer commandBuffer)
+{
+    vkCmdBindPipeline(
+        commandBuffer,
+        VK_PIPELINE_BIND_POINT_GRAPHICS,
+        engine->graphicsPipeline
+    );
+
+    VkViewport viewport;
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float) engine->swapChainExtent.width;
+    viewport.height = (float) engine->swapChainExtent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+    VkRect2D scissor;
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+    scissor.extent = engine->swapChainExtent;
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    VkBuffer vertexBuffers[] = {engine->vertexBuffer};
+    VkDeviceSize offsets[] = {0};
+
+    vkCmdBindVertexBuffers(
+        commandBuffer,
+        0,
+        1,
+        vertexBuffers,
+        offsets
+    );
+
+    vkCmdBindIndexBuffer(
+        commandBuffer,
+        engine->indexBuffer,
+        0,
+        VK_INDEX_TYPE_UINT16
+    );
+
+    uint32_t uniformOffset =
+        (uint32_t)(engine->currentFrame * engine->uniformStride);
+    vkCmdBindDescriptorSets(
+        commandBuffer,
+        VK_PIPELINE_BIND_POINT_GRAPHICS,
+        engine->pipelineLayout,
+        0,
+        1,
+        &(engine->descriptorSets[engine->currentFrame]),
+        1,
+        &uniformOffset
+    );
+
+    if (engine->bindless.enabled)
+    {
+        // The table stays bound for the whole frame, draws only push the
+        // index of their texture
+        vkCmdBindDescriptorSets(
+            commandBuffer,
+            VK_PIPELINE_BIND_POINT_GRAPHICS,
+            engine->pipelineLayout,
+            1,
+            1,
+            &(engine->bindless.set),
+            0,
+            NULL
+        );
+
+        uint32_t i;
+        for (i=0; i<engine->drawCount; i++)
+        {
+            const struct DrawItem* draw = &(engine->draws[i]);
+            uint32_t textureIndex = draw->texture % engine->bindless.textureCount;
+            vkCmdPushConstants(
+                commandBuffer,
+                engine->pipelineLayout,
+                VK_SHADER_STAGE_FRAGMENT_BIT,
+                0,
+                sizeof(textureIndex),
+                &textureIndex
+            );
+            vkCmdDrawIndexed(
+                commandBuffer,
+                draw->indexCount,
+                1,
+                draw->firstIndex,
+                0,
+                0
+            );
+        }
+    }
+    else if (engine->atlas.enabled)
+    {
+        // One descriptor set and pipeline for every texture, only the push
+        // constants change between draws
+        uint32_t i;
+        for (i=0; i<engine->drawCount; i++)
+        {
+            const struct DrawItem* draw = &(engine->draws[i]);
+            const struct AtlasEntry* entry =
+                &(engine->atlas.entries[draw->texture % engine->atlas.entryCount]);
+            vkCmdPushConstants(
+                commandBuffer,
+                engine->pipelineLayout,
+                VK_SHADER_STAGE_FRAGMENT_BIT,
+                0,
+                sizeof(entry->constants),
+                &(entry->constants)
+            );
+            vkCmdDrawIndexed(
+                commandBuffer,
+                draw->indexCount,
+                1,
+                draw->firstIndex,
+                0,
+                0
+            );
+        }
+    }
+    else
+    {
+        vkCmdDrawIndexed(
+            commandBuffer,
+            engine->indexCount,
+            1,
+            0,
+            0,
+            0
+        );
+    }
+}
+
+void freeCommandBuffers(struct Engine* engine)
+{
+    // Destroying a pool frees the command buffers allocated from it
+    uint32_t i;
+    for (i=0; i<engine->framesInFlight; i++)
+    {
+        vkDestroyCommandPool(
+            engine->device,
+            engine->frames[i].commandPool,
+            NULL
+        );
+    }
+
+    free(engine->frames);
 }
 
-void endSingleTimeCommands(struct Engine* engine, VkCommandBuffer commandBuffer)
+// SYNC OBJECTS
+void createSyncObjects(struct Engine* engine)
 {
-    vkEndCommandBuffer(commandBuffer);
+    VkSemaphoreCreateInfo semaphoreInfo;
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = NULL;
+    semaphoreInfo.flags = 0;
 
-    VkSubmitInfo submitInfo;
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.pNext = NULL;
-    submitInfo.waitSemaphoreCount = 0;
-    submitInfo.pWaitSemaphores = NULL;
-    submitInfo.pWaitDstStageMask = NULL;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-    submitInfo.signalSemaphoreCount = 0;
-    submitInfo.pSignalSemaphores = NULL;
+    // Created signalled so the first wait on each frame returns immediately
+    VkFenceCreateInfo fenceInfo;
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.pNext = NULL;
+    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-    vkQueueSubmit(engine->graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(engine->graphicsQueue);
+    uint32_t i;
+    for (i=0; i<engine->framesInFlight; i++)
+    {
+        struct FrameData* frame = &(engine->frames[i]);
 
-    vkFreeCommandBuffers(
-        engine->device,
-        engine->commandPool,
-        1,
-        &commandBuffer
-    );
+        VkResult result;
+        result = vkCreateSemaphore(
+            engine->device,
+            &semaphoreInfo,
+            NULL,
+            &(frame->imageAvailable)
+        );
+        if (result != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to create semaphore.\n");
+            exit(-1);
+        }
+
+        result = vkCreateSemaphore(
+            engine->device,
+            &semaphoreInfo,
+            NULL,
+            &(frame->renderFinished)
+        );
+        if (result != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to create semaphore.\n");
+            exit(-1);
+        }
+
+        result = vkCreateFence(
+            engine->device,
+            &fenceInfo,
+            NULL,
+            &(frame->inFlight)
+        );
+        if (result != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to create fence.\n");
+            exit(-1);
+        }
+    }
 }
 
-void createBuffer(struct Engine* engine, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer* buffer, VkDeviceMemory* bufferMemory)
+void destroySyncObjects(struct Engine* engine)
 {
-    VkBufferCreateInfo createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0;
-    createInfo.size = size;
-    createInfo.usage = usage;
-    createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    // Only required for sharing mode concurrent
-    createInfo.queueFamilyIndexCount = 0;
-    createInfo.pQueueFamilyIndices = NULL;
+    uint32_t i;
+    for (i=0; i<engine->framesInFlight; i++)
+    {
+        struct FrameData* frame = &(engine->frames[i]);
+        vkDestroySemaphore(engine->device, frame->imageAvailable, NULL);
+        vkDestroySemaphore(engine->device, frame->renderFinished, NULL);
+        vkDestroyFence(engine->device, frame->inFlight, NULL);
+    }
+}
 
-    vkCreateBuffer(engine->device, &createInfo, NULL, buffer);
+// GPU PROFILER
+void createGpuProfiler(struct Engine* engine)
+{
+    struct GpuProfiler* profiler = &(engine->profiler);
 
-    VkMemoryRequirements memRequirements;
-    vkGetBufferMemoryRequirements(
-        engine->device,
-        *buffer,
-        &memRequirements
+    // Timestamps are only meaningful if the graphics queue reports valid bits
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        engine->physicalDevice,
+        &queueFamilyCount,
+        NULL
+    );
+    VkQueueFamilyProperties* queueFamilies = calloc(
+        queueFamilyCount,
+        sizeof(*queueFamilies)
+    );
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        engine->physicalDevice,
+        &queueFamilyCount,
+        queueFamilies
     );
+    uint32_t validBits = queueFamilies[
+        engine->queueFamilyIndices.graphicsFamily
+    ].timestampValidBits;
+    free(queueFamilies);
 
-    VkMemoryAllocateInfo allocInfo;
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.pNext = NULL;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemType(
-        engine,
-        memRequirements.memoryTypeBits,
-        properties
+    profiler->supported = validBits > 0;
+    if (!profiler->supported)
+    {
+        fprintf(stderr, "GPU timestamps unsupported, profiler disabled.\n");
+        return;
+    }
+
+    profiler->timestampMask =
+        validBits >= 64 ? UINT64_MAX : ((uint64_t)1 << validBits) - 1;
+    profiler->timestampPeriod = engine->deviceProperties.limits.timestampPeriod;
+    profiler->framePassCounts = calloc(
+        engine->framesInFlight,
+        sizeof(*(profiler->framePassCounts))
+    );
+    profiler->framePassNames = calloc(
+        engine->framesInFlight * PROFILER_MAX_PASSES,
+        sizeof(*(profiler->framePassNames))
     );
+    profiler->lastReport = getTime();
+
+    // Each frame in flight owns a begin/end query pair per pass
+    VkQueryPoolCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    createInfo.queryCount = engine->framesInFlight * PROFILER_MAX_PASSES * 2;
+    createInfo.pipelineStatistics = 0;
 
     VkResult result;
-    result = vkAllocateMemory(
+    result = vkCreateQueryPool(
         engine->device,
-        &allocInfo,
+        &createInfo,
         NULL,
-        bufferMemory
+        &(profiler->queryPool)
     );
     if (result != VK_SUCCESS)
     {
-        fprintf(stderr, "Failed to allocate memory for vertex buffer.\n");
+        fprintf(stderr, "Failed to create timestamp query pool.\n");
         exit(-1);
     }
-
-    vkBindBufferMemory(
-        engine->device,
-        *buffer,
-        *bufferMemory,
-        0
-    );
 }
 
-void destroyVertexBuffer(struct Engine* engine)
+void destroyGpuProfiler(struct Engine* engine)
 {
-    vkDestroyBuffer(engine->device, engine->vertexBuffer, NULL);
-}
+    struct GpuProfiler* profiler = &(engine->profiler);
+    if (!profiler->supported) return;
 
-void freeVertexBufferMemory(struct Engine* engine)
-{
-    vkFreeMemory(engine->device, engine->vertexBufferMemory, NULL);
+    vkDestroyQueryPool(engine->device, profiler->queryPool, NULL);
+    free(profiler->framePassCounts);
+    free(profiler->framePassNames);
 }
 
-uint32_t findMemType(struct Engine* engine, uint32_t typeFilter, VkMemoryPropertyFlags properties)
+// Reads back the timestamps written the last time this frame slot was used.
+// Called once the slot's fence has signalled, so results are already
+// available and the query never waits on the GPU.
+void profilerCollect(struct Engine* engine, uint32_t frame)
 {
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(engine->physicalDevice, &memProperties);
+    struct GpuProfiler* profiler = &(engine->profiler);
+    uint32_t passCount = profiler->framePassCounts[frame];
+    if (passCount == 0) return;
 
-    uint32_t i;
-    for (i=0; i<memProperties.memoryTypeCount; i++)
+    uint64_t timestamps[PROFILER_MAX_PASSES * 2];
+    VkResult result;
+    result = vkGetQueryPoolResults(
+        engine->device,
+        profiler->queryPool,
+        frame * PROFILER_MAX_PASSES * 2,
+        passCount * 2,
+        sizeof(timestamps),
+        timestamps,
+        sizeof(timestamps[0]),
+        VK_QUERY_RESULT_64_BIT
+    );
+
+    // The slot is reset and reused by this frame either way
+    profiler->framePassCounts[frame] = 0;
+    if (result != VK_SUCCESS)
+        return;
+
+    uint32_t i, j;
+    for (i=0; i<passCount; i++)
     {
-        if ((typeFilter & (1 << i)) &&
-            (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
+        const char* name =
+            profiler->framePassNames[frame * PROFILER_MAX_PASSES + i];
+        uint64_t ticks = (timestamps[i*2 + 1] - timestamps[i*2]) &
+            profiler->timestampMask;
+        double milliseconds = ticks * profiler->timestampPeriod / 1000000.0;
+
+        struct GpuPassTiming* timing = NULL;
+        for (j=0; j<profiler->passCount; j++)
+        {
+            if (strcmp(profiler->passes[j].name, name) == 0)
+            {
+                timing = &(profiler->passes[j]);
+                break;
+            }
+        }
+        if (!timing)
         {
-            return i;
+            if (profiler->passCount == PROFILER_MAX_PASSES)
+                continue;
+            timing = &(profiler->passes[profiler->passCount++]);
+            memset(timing, 0, sizeof(*timing));
+            timing->name = name;
         }
-    }
 
-    fprintf(stderr, "Failed to find a suitable memory type.\n");
-    exit(-1);
+        timing->milliseconds = milliseconds;
+        timing->totalMilliseconds += milliseconds;
+        timing->samples++;
+    }
 }
 
-// INDEX BUFFER
-void createIndexBuffer(struct Engine* engine)
+// Starts GPU timing for the current frame, must be recorded outside of a
+// render pass. Opens the implicit "frame" pass that spans the whole buffer.
+void profilerBeginFrame(struct Engine* engine, VkCommandBuffer commandBuffer)
 {
-    VkDeviceSize bufferSize = sizeof(engine->indices[0]) * engine->indexCount;
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
+    struct GpuProfiler* profiler = &(engine->profiler);
+    if (!profiler->supported) return;
 
-    createBuffer(
-        engine,
-        bufferSize,
-        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        &(stagingBuffer),
-        &(stagingBufferMemory)
-    );
+    uint32_t frame = engine->currentFrame;
+    profilerCollect(engine, frame);
 
-    void* data;
-    vkMapMemory(
-        engine->device,
-        stagingBufferMemory,
-        0,
-        bufferSize,
-        0,
-        &data
-    );
-    memcpy(data, engine->indices, (size_t)bufferSize);
-    vkUnmapMemory(engine->device, stagingBufferMemory);
+    if (profiler->reportEnabled)
+    {
+        double now = getTime();
+        if (now - profiler->lastReport >= profiler->reportInterval)
+        {
+            profilerReport(engine, stderr, profiler->reportJson);
+            profiler->lastReport = now;
+        }
+    }
 
-    createBuffer(
-        engine,
-        bufferSize,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        &(engine->indexBuffer),
-        &(engine->indexBufferMemory)
-    );
-    copyBuffer(
-        engine,
-        &(stagingBuffer),
-        &(engine->indexBuffer),
-        bufferSize
+    vkCmdResetQueryPool(
+        commandBuffer,
+        profiler->queryPool,
+        frame * PROFILER_MAX_PASSES * 2,
+        PROFILER_MAX_PASSES * 2
     );
 
-    vkDestroyBuffer(engine->device, stagingBuffer, NULL);
-    vkFreeMemory(engine->device, stagingBufferMemory, NULL);
+    profilerBeginPass(engine, commandBuffer, "frame");
 }
 
-void destroyIndexBuffer(struct Engine* engine)
+void profilerEndFrame(struct Engine* engine, VkCommandBuffer commandBuffer)
 {
-    vkDestroyBuffer(engine->device, engine->indexBuffer, NULL);
+    profilerEndPass(engine, commandBuffer, 0);
 }
 
-void freeIndexBufferMemory(struct Engine* engine)
+// Brackets a pass with timestamps. The name must outlive the profiler,
+// string literals are expected. Returns the handle for profilerEndPass.
+uint32_t profilerBeginPass(struct Engine* engine, VkCommandBuffer commandBuffer, const char* name)
 {
-    vkFreeMemory(engine->device, engine->indexBufferMemory, NULL);
-}
+    struct GpuProfiler* profiler = &(engine->profiler);
+    if (!profiler->supported) return 0;
 
-// UNIFORM BUFFER
-void createUniformBuffer(struct Engine* engine)
-{
-    VkDeviceSize bufferSize = sizeof(struct UniformBufferObject);
+    uint32_t frame = engine->currentFrame;
+    uint32_t pass = profiler->framePassCounts[frame];
+    if (pass == PROFILER_MAX_PASSES)
+    {
+        fprintf(stderr, "Too many profiler passes, %s not timed.\n", name);
+        return UINT32_MAX;
+    }
 
-    createBuffer(
-        engine,
-        bufferSize,
-        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        &(engine->uniformStagingBuffer),
-        &(engine->uniformStagingBufferMemory)
-    );
+    profiler->framePassNames[frame * PROFILER_MAX_PASSES + pass] = name;
+    profiler->framePassCounts[frame]++;
 
-    createBuffer(
-        engine,
-        bufferSize,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        &(engine->uniformBuffer),
-        &(engine->uniformBufferMemory)
+    vkCmdWriteTimestamp(
+        commandBuffer,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        profiler->queryPool,
+        (frame * PROFILER_MAX_PASSES + pass) * 2
     );
+
+    return pass;
 }
 
-void updateUniformBuffer(struct Engine* engine)
+void profilerEndPass(struct Engine* engine, VkCommandBuffer commandBuffer, uint32_t pass)
 {
-    struct UniformBufferObject ubo;
-    memset(&ubo, 0, sizeof(ubo));
-
-    mat4x4 empty;
-    memset(&empty, 0, sizeof(empty));
-    mat4x4_identity(empty);
-
-    mat4x4_identity(ubo.model);
-    mat4x4_rotate(
-        ubo.model, empty,
-        0.0f, 0.0f, 1.0f,
-        (float)degreesToRadians(22.5)
-    );
-
-    vec3 eye = {2.0f, 2.0f, 2.0f};
-    vec3 center = {0.0f, 0.0f, 0.0f};
-    vec3 up = {0.0f, 0.0f, 1.0f};
-    mat4x4_look_at(ubo.view, eye, center, up);
-
-    mat4x4_perspective(
-        ubo.proj,
-        (float)degreesToRadians(45.0f),
-        engine->swapChainExtent.width/(float)engine->swapChainExtent.height,
-        0.1f,
-        100.0f
-    );
-
-    ubo.proj[1][1] *= -1;
-
-    void* data;
-    vkMapMemory(
-        engine->device,
-        engine->uniformStagingBufferMemory,
-        0,
-        sizeof(ubo),
-        0,
-        &data
-    );
-    memcpy(data, &ubo, sizeof(ubo));
-    vkUnmapMemory(engine->device, engine->uniformStagingBufferMemory);
+    struct GpuProfiler* profiler = &(engine->profiler);
+    if (!profiler->supported || pass == UINT32_MAX) return;
 
-    copyBuffer(
-        engine,
-        &(engine->uniformStagingBuffer),
-        &(engine->uniformBuffer),
-        sizeof(ubo)
+    vkCmdWriteTimestamp(
+        commandBuffer,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        profiler->queryPool,
+        (engine->currentFrame * PROFILER_MAX_PASSES + pass) * 2 + 1
     );
 }
 
-void destroyUniformBuffer(struct Engine* engine)
+// Most recent GPU time of a pass in milliseconds, or -1 if it has not been
+// measured yet. The whole frame is reported under "frame".
+double profilerGetPassTime(struct Engine* engine, const char* name)
 {
-    vkDestroyBuffer(engine->device, engine->uniformStagingBuffer, NULL);
-    vkDestroyBuffer(engine->device, engine->uniformBuffer, NULL);
-}
+    struct GpuProfiler* profiler = &(engine->profiler);
 
-void freeUniformBufferMemory(struct Engine* engine)
-{
-    vkFreeMemory(engine->device, engine->uniformStagingBufferMemory, NULL);
-    vkFreeMemory(engine->device, engine->uniformBufferMemory, NULL);
+    uint32_t i;
+    for (i=0; i<profiler->passCount; i++)
+    {
+        if (strcmp(profiler->passes[i].name, name) == 0)
+            return profiler->passes[i].milliseconds;
+    }
+
+    return -1.0;
 }
 
-// DESCRIPTOR POOL
-void createDescriptorPool(struct Engine* engine)
+// Writes the average time of every pass since the previous report, either
+// as text or as a single JSON object per line, then starts a new interval
+void profilerReport(struct Engine* engine, FILE* fp, _Bool json)
 {
-    VkDescriptorPoolSize poolSizes[2];
-    poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    poolSizes[0].descriptorCount = 1;
-    poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    poolSizes[1].descriptorCount = 1;
+    struct GpuProfiler* profiler = &(engine->profiler);
 
-    VkDescriptorPoolCreateInfo createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0;
-    createInfo.maxSets = 1;
-    createInfo.poolSizeCount = 2;
-    createInfo.pPoolSizes = poolSizes;
+    if (json)
+        fprintf(fp, "{\"gpu_ms\": {");
+    else
+        fprintf(fp, "GPU:");
 
-    VkResult result;
-    result = vkCreateDescriptorPool(
-        engine->device,
-        &createInfo,
-        NULL,
-        &(engine->descriptorPool)
-    );
-    if (result != VK_SUCCESS)
+    uint32_t i;
+    for (i=0; i<profiler->passCount; i++)
     {
-        fprintf(stderr, "Failed to create descriptor pool.\n");
-        exit(-1);
+        struct GpuPassTiming* timing = &(profiler->passes[i]);
+        double average = timing->samples > 0 ?
+            timing->totalMilliseconds / timing->samples : 0.0;
+
+        if (json)
+        {
+            fprintf(fp, "%s", i > 0 ? ", " : "");
+            writeJsonString(fp, timing->name);
+            fprintf(fp, ": %.4f", average);
+        }
+        else
+            fprintf(fp, " %s %.3f ms", timing->name, average);
+
+        timing->totalMilliseconds = 0.0;
+        timing->samples = 0;
     }
-}
 
-void destroyDescriptorPool(struct Engine* engine)
-{
-    vkDestroyDescriptorPool(engine->device, engine->descriptorPool, NULL);
+    if (json)
+        fprintf(fp, "}}\n");
+    else
+        fprintf(fp, "\n");
 }
 
-// DESCRIPTOR SET
-void createDescriptorSet(struct Engine* engine)
+// BENCHMARK
+// Called after every frame with the wall time since the previous one.
+// Frames inside the warm-up window are discarded.
+void benchmarkRecordFrame(struct Engine* engine, double frameTime)
 {
-    VkDescriptorSetLayout layouts[] = {engine->descriptorSetLayout};
+    struct Benchmark* benchmark = &(engine->benchmark);
 
-    VkDescriptorSetAllocateInfo allocInfo;
-    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocInfo.pNext = NULL;
-    allocInfo.descriptorPool = engine->descriptorPool;
-    allocInfo.descriptorSetCount = 1;
-    allocInfo.pSetLayouts = layouts;
+    if (engine->frameNumber <= benchmark->warmupFrames)
+    {
+        benchmark->measureStart = getTime();
+        return;
+    }
 
-    VkResult result;
-    result = vkAllocateDescriptorSets(
-        engine->device,
-        &allocInfo,
-        &(engine->descriptorSet)
-    );
-    if (result != VK_SUCCESS)
+    if (benchmark->sampleCount == benchmark->sampleCapacity)
     {
-        fprintf(stderr, "Failed to allocate descriptor sets.\n");
-        exit(-1);
+        benchmark->sampleCapacity = benchmark->sampleCapacity ?
+            benchmark->sampleCapacity * 2 : 1024;
+        benchmark->cpuFrameTimes = realloc(
+            benchmark->cpuFrameTimes,
+            benchmark->sampleCapacity * sizeof(double)
+        );
+        benchmark->gpuFrameTimes = realloc(
+            benchmark->gpuFrameTimes,
+            benchmark->sampleCapacity * sizeof(double)
+        );
     }
 
-    VkDescriptorBufferInfo bufferInfo;
-    bufferInfo.buffer = engine->uniformBuffer;
-    bufferInfo.offset = 0;
-    bufferInfo.range = sizeof(struct UniformBufferObject);
+    // GPU results lag framesInFlight frames behind, which does not matter
+    // for the distribution over a fixed workload
+    benchmark->cpuFrameTimes[benchmark->sampleCount] = frameTime * 1000.0;
+    benchmark->gpuFrameTimes[benchmark->sampleCount] =
+        profilerGetPassTime(engine, "frame");
+    benchmark->sampleCount++;
+}
 
-	VkDescriptorImageInfo imageInfo;
-    imageInfo.sampler = engine->textureSampler;
-    imageInfo.imageView = engine->textureImageView;
-    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+// True once the requested number of frames or duration has been measured
+_Bool benchmarkDone(struct Engine* engine)
+{
+    struct Benchmark* benchmark = &(engine->benchmark);
 
-    VkWriteDescriptorSet descriptorWrites[2];
-    descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWrites[0].pNext = NULL;
-    descriptorWrites[0].dstSet = engine->descriptorSet;
-    descriptorWrites[0].dstBinding = 0;
-    descriptorWrites[0].dstArrayElement = 0;
-    descriptorWrites[0].descriptorCount = 1;
-    descriptorWrites[0].descriptorType =
-        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptorWrites[0].pImageInfo = NULL;
-    descriptorWrites[0].pBufferInfo = &bufferInfo;
-    descriptorWrites[0].pTexelBufferView = NULL;
+    if (engine->frameLimit > 0 && benchmark->sampleCount >= engine->frameLimit)
+        return 1;
 
-    descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWrites[1].pNext = NULL;
-    descriptorWrites[1].dstSet = engine->descriptorSet;
-    descriptorWrites[1].dstBinding = 1;
-    descriptorWrites[1].dstArrayElement = 0;
-    descriptorWrites[1].descriptorCount = 1;
-    descriptorWrites[1].descriptorType =
-        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    descriptorWrites[1].pImageInfo = &imageInfo;
-    descriptorWrites[1].pBufferInfo = NULL;
-    descriptorWrites[1].pTexelBufferView = NULL;
+    if (benchmark->duration > 0.0 && benchmark->sampleCount > 0 &&
+        getTime() - benchmark->measureStart >= benchmark->duration)
+        return 1;
 
-    vkUpdateDescriptorSets(engine->device, 2, descriptorWrites, 0, NULL);
+    return 0;
 }
 
-// COMMAND BUFFERS
-void createCommandBuffers(struct Engine* engine)
+static int compareDoubles(const void* a, const void* b)
 {
-    engine->commandBuffers = malloc(
-            engine->imageCount * sizeof(*(engine->commandBuffers)));
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
 
-    VkCommandBufferAllocateInfo allocInfo;
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.pNext = NULL;
-    allocInfo.commandPool = engine->commandPool;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = engine->imageCount;
+// Writes min/mean/percentiles/max of the non-negative samples as a JSON
+// object, or null if there are none
+void writeFrameStats(FILE* fp, const double* samples, uint32_t count)
+{
+    double* sorted = malloc((count ? count : 1) * sizeof(*sorted));
+    uint32_t valid = 0;
+    double sum = 0.0;
 
-    VkResult result;
-    result = vkAllocateCommandBuffers(
-        engine->device,
-        &allocInfo,
-        engine->commandBuffers
-    );
-    if (result != VK_SUCCESS)
+    uint32_t i;
+    for (i=0; i<count; i++)
     {
-        fprintf(stderr, "Failed to create command buffers.\n");
-        exit(-1);
+        if (samples[i] < 0.0) continue;
+        sorted[valid++] = samples[i];
+        sum += samples[i];
     }
 
-    uint32_t i;
-    for (i=0; i<engine->imageCount; i++)
+    if (valid == 0)
     {
-        VkCommandBufferBeginInfo beginInfo;
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.pNext = NULL;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-        beginInfo.pInheritanceInfo = NULL;
-
-        vkBeginCommandBuffer(engine->commandBuffers[i], &beginInfo);
-
-        VkRenderPassBeginInfo renderPassInfo;
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.pNext = NULL;
-        renderPassInfo.renderPass = engine->renderPass;
-        renderPassInfo.framebuffer = engine->framebuffers[i];
-        renderPassInfo.renderArea.offset.x = 0;
-        renderPassInfo.renderArea.offset.y = 0;
-        renderPassInfo.renderArea.extent = engine->swapChainExtent;
-
-        VkClearValue clearValues[2];
-        clearValues[0].color.float32[0] = 0.0f;
-        clearValues[0].color.float32[1] = 0.0f;
-        clearValues[0].color.float32[2] = 0.0f;
-        clearValues[0].color.float32[3] = 1.0f;
-        clearValues[1].depthStencil.depth = 1.0f;
-        clearValues[1].depthStencil.stencil = 0;
-
-        renderPassInfo.clearValueCount = 2;
-        renderPassInfo.pClearValues = clearValues;
-
-        vkCmdBeginRenderPass(
-            engine->commandBuffers[i],
-            &renderPassInfo,
-            VK_SUBPASS_CONTENTS_INLINE
-        );
-
-        vkCmdBindPipeline(
-            engine->commandBuffers[i],
-            VK_PIPELINE_BIND_POINT_GRAPHICS,
-            engine->graphicsPipeline
-        );
-
-        VkBuffer vertexBuffers[] = {engine->vertexBuffer};
-        VkDeviceSize offsets[] = {0};
-
-        vkCmdBindVertexBuffers(
-            engine->commandBuffers[i],
-            0,
-            1,
-            vertexBuffers,
-            offsets
-        );
-
-        vkCmdBindIndexBuffer(
-            engine->commandBuffers[i],
-            engine->indexBuffer,
-            0,
-            VK_INDEX_TYPE_UINT16
-        );
+        fprintf(fp, "null");
+        free(sorted);
+        return;
+    }
 
-        vkCmdBindDescriptorSets(
-            engine->commandBuffers[i],
-            VK_PIPELINE_BIND_POINT_GRAPHICS,
-            engine->pipelineLayout,
-            0,
-            1,
-            &(engine->descriptorSet),
-            0,
-            NULL
-        );
+    qsort(sorted, valid, sizeof(*sorted), compareDoubles);
 
-        vkCmdDrawIndexed(
-            engine->commandBuffers[i],
-            engine->indexCount,
-            1,
-            0,
-            0,
-            0
-        );
+    // Nearest-rank percentiles
+    double percentiles[3] = {0.50, 0.95, 0.99};
+    double values[3];
+    for (i=0; i<3; i++)
+    {
+        uint32_t rank = (uint32_t)ceil(percentiles[i] * valid);
+        values[i] = sorted[rank > 0 ? rank - 1 : 0];
+    }
 
-        vkCmdEndRenderPass(engine->commandBuffers[i]);
+    fprintf(
+        fp,
+        "{\"min\": %.4f, \"mean\": %.4f, \"p50\": %.4f, "
+        "\"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+        sorted[0],
+        sum / valid,
+        values[0],
+        values[1],
+        values[2],
+        sorted[valid - 1]
+    );
 
-        VkResult result;
-        result = vkEndCommandBuffer(engine->commandBuffers[i]);
-        if (result != VK_SUCCESS)
-        {
-            fprintf(stderr, "Failed to record command buffers.\n");
-            exit(-1);
-        }
-    }
+    free(sorted);
 }
 
-void freeCommandBuffers(struct Engine* engine)
+// Writes the string as a quoted JSON string. Quotes, backslashes and
+// control characters are escaped, other bytes are assumed to be UTF-8.
+void writeJsonString(FILE* fp, const char* string)
 {
-    vkFreeCommandBuffers(
-        engine->device,
-        engine->commandPool,
-        engine->imageCount,
-        engine->commandBuffers
-    );
-
-    free(engine->commandBuffers);
+    fputc('"', fp);
+    const unsigned char* c;
+    for (c=(const unsigned char*)string; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(fp, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(fp, "\\u%04x", *c);
+        else
+            fputc(*c, fp);
+    }
+    fputc('"', fp);
 }
 
-// SEMAPHORES
-void createSemaphores(struct Engine* engine)
+void writeBenchmarkReport(struct Engine* engine)
 {
-    VkSemaphoreCreateInfo createInfo;
-    createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0;
+    struct Benchmark* benchmark = &(engine->benchmark);
 
-    VkResult result;
-    result = vkCreateSemaphore(
-        engine->device,
-        &createInfo,
-        NULL,
-        &(engine->imageAvailable)
-    );
-    if (result != VK_SUCCESS)
+    FILE* fp = stdout;
+    if (strcmp(benchmark->reportPath, "-") != 0)
     {
-        fprintf(stderr, "Failed to create semaphore.\n");
-        exit(-1);
+        fp = fopen(benchmark->reportPath, "w");
+        if (!fp)
+        {
+            fprintf(
+                stderr,
+                "Failed to open benchmark report %s.\n",
+                benchmark->reportPath
+            );
+            return;
+        }
     }
 
-    result = vkCreateSemaphore(
-        engine->device,
-        &createInfo,
-        NULL,
-        &(engine->renderFinished)
+    double measured = benchmark->measureEnd - benchmark->measureStart;
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"device\": ");
+    writeJsonString(fp, engine->deviceProperties.deviceName);
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"headless\": %s,\n", engine->headless ? "true" : "false");
+    fprintf(fp, "  \"width\": %u,\n", engine->swapChainExtent.width);
+    fprintf(fp, "  \"height\": %u,\n", engine->swapChainExtent.height);
+    fprintf(fp, "  \"frames_in_flight\": %u,\n", engine->framesInFlight);
+    fprintf(fp, "  \"warmup_frames\": %u,\n", benchmark->warmupFrames);
+    fprintf(fp, "  \"measured_frames\": %u,\n", benchmark->sampleCount);
+    fprintf(fp, "  \"measured_seconds\": %.4f,\n", measured);
+    fprintf(
+        fp,
+        "  \"fps\": %.2f,\n",
+        measured > 0.0 ? benchmark->sampleCount / measured : 0.0
     );
-    if (result != VK_SUCCESS)
+
+    fprintf(fp, "  \"cpu_frame_ms\": ");
+    writeFrameStats(fp, benchmark->cpuFrameTimes, benchmark->sampleCount);
+    fprintf(fp, ",\n  \"gpu_frame_ms\": ");
+    writeFrameStats(fp, benchmark->gpuFrameTimes, benchmark->sampleCount);
+
+    fprintf(fp, ",\n  \"init_ms\": {\n");
+    fprintf(fp, "    \"total\": %.4f,\n", benchmark->initTotalTime);
+    fprintf(fp, "    \"stages\": {");
+    uint32_t i;
+    for (i=0; i<INIT_STAGE_COUNT; i++)
     {
-        fprintf(stderr, "Failed to create semaphore.\n");
-        exit(-1);
+        fprintf(fp, "%s\n      ", i > 0 ? "," : "");
+        writeJsonString(fp, initStages[i].name);
+        fprintf(fp, ": %.4f", benchmark->initStageTimes[i]);
     }
+    fprintf(fp, "\n    }\n  }");
+
+    struct GpuAllocatorStats memory;
+    gpuAllocatorStats(engine, NULL, &memory);
+    fprintf(fp, ",\n  \"gpu_memory\": {\n");
+    fprintf(fp, "    \"blocks\": %u,\n", memory.blockCount);
+    fprintf(fp, "    \"allocations\": %u,\n", memory.allocationCount);
+    fprintf(fp, "    \"block_bytes\": %llu,\n", (unsigned long long)memory.blockBytes);
+    fprintf(fp, "    \"used_bytes\": %llu\n", (unsigned long long)memory.usedBytes);
+    fprintf(fp, "  }\n}\n");
+
+    if (fp != stdout)
+        fclose(fp);
 }
 
-void destroySemaphores(struct Engine* engine)
+void freeBenchmark(struct Engine* engine)
 {
-    vkDestroySemaphore(engine->device, engine->imageAvailable, NULL);
-    vkDestroySemaphore(engine->device, engine->renderFinished, NULL);
+    free(engine->benchmark.cpuFrameTimes);
+    free(engine->benchmark.gpuFrameTimes);
+    free(engine->benchmark.initStageTimes);
 }
 
-void drawFrame(struct Engine* engine)
+// Returns whether a frame was submitted, skipped frames don't count towards
+// the frame limit or the benchmark
+_Bool drawFrame(struct Engine* engine)
 {
-    uint32_t imageIndex;
-    VkResult result = vkAcquireNextImageKHR(
+    struct FrameData* frame = &(engine->frames[engine->currentFrame]);
+
+    // Only blocks if the GPU is still working on the frame that last used
+    // these resources, framesInFlight frames ago
+    vkWaitForFences(
         engine->device,
-        engine->swapChain,
-        UINT64_MAX, // Wait for next image indefinitely (ns)
-        engine->imageAvailable,
-        VK_NULL_HANDLE,
-        &imageIndex
+        1,
+        &(frame->inFlight),
+        VK_TRUE,
+        UINT64_MAX
     );
+    retireAsyncUploads(engine, engine->currentFrame);
+
+    // Submissions complete in order, so everything up to this frame's last
+    // one is done
+    if (frame->submission > engine->completedSubmissions)
+        engine->completedSubmissions = frame->submission;
+    releaseRetiredSwapChains(engine);
+    releaseRetiredPipelines(engine);
+
+    if (engine->swapChainResized)
+    {
+        recreateSwapChain(engine);
+
+        // Still flagged while minimised, there is nothing to draw into.
+        // Sleep until the window changes rather than spin.
+        if (engine->swapChainResized)
+        {
+            glfwWaitEvents();
+            return 0;
+        }
+    }
+    pollShaderWatcher(engine);
+    installCompiledPipelines(engine);
+
+    uint32_t imageIndex = engine->currentFrame;
+    VkResult result = VK_SUCCESS;
+    if (!engine->headless)
+    {
+        result = vkAcquireNextImageKHR(
+            engine->device,
+            engine->swapChain,
+            UINT64_MAX, // Wait for next image indefinitely (ns)
+            frame->imageAvailable,
+            VK_NULL_HANDLE,
+            &imageIndex
+        );
+    }
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR)
     {
         recreateSwapChain(engine);
+        return 0;
     }
     else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
     {
@@ -2907,42 +10072,73 @@ void drawFrame(struct Engine* engine)
         exit(-1);
     }
 
+    // Reset only once work is guaranteed to be submitted for this frame
+    vkResetFences(engine->device, 1, &(frame->inFlight));
+
+    updateUniformBuffer(engine);
+    updateTextureStreaming(engine);
+    if (engine->descriptorImageViews[engine->currentFrame] !=
+        activeTextureView(engine))
+    {
+        writeDescriptorSet(engine, engine->currentFrame);
+    }
+
+    vkResetCommandPool(engine->device, frame->commandPool, 0);
+    recordCommandBuffer(engine, frame->commandBuffer, imageIndex);
+
     VkSubmitInfo submitInfo;
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.pNext = NULL;
 
-    VkSemaphore waitSemaphores[] = { engine->imageAvailable };
-    VkPipelineStageFlags waitStages[] = {
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-    };
+    // The swapchain image, nothing to acquire or present without one, plus
+    // every async upload the frame takes ownership of
+    VkSemaphore waitSemaphores[1 + MAX_UPLOAD_ACQUIRES_PER_FRAME];
+    VkPipelineStageFlags waitStages[1 + MAX_UPLOAD_ACQUIRES_PER_FRAME];
+    uint32_t waitCount = 0;
+    if (!engine->headless)
+    {
+        waitSemaphores[waitCount] = frame->imageAvailable;
+        waitStages[waitCount] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        waitCount++;
+    }
+    uint32_t i;
+    for (i=0; i<engine->transfer.frameWaitCount; i++)
+    {
+        waitSemaphores[waitCount] = engine->transfer.frameWaitSemaphores[i];
+        waitStages[waitCount] = engine->transfer.frameWaitStages[i];
+        waitCount++;
+    }
 
-    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.waitSemaphoreCount = waitCount;
     submitInfo.pWaitSemaphores = waitSemaphores;
     submitInfo.pWaitDstStageMask = waitStages;
 
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &(engine->commandBuffers[imageIndex]);
+    submitInfo.pCommandBuffers = &(frame->commandBuffer);
 
-    VkSemaphore signalSemaphores[] = { engine->renderFinished };
-    submitInfo.signalSemaphoreCount = 1;
+    VkSemaphore signalSemaphores[] = { frame->renderFinished };
+    submitInfo.signalSemaphoreCount = engine->headless ? 0 : 1;
     submitInfo.pSignalSemaphores = signalSemaphores;
 
     result = vkQueueSubmit(
         engine->graphicsQueue,
         1,
         &submitInfo,
-        VK_NULL_HANDLE
+        frame->inFlight
     );
-
-    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
-    {
-        recreateSwapChain(engine);
-    }
-    else if (result != VK_SUCCESS)
+    if (result != VK_SUCCESS)
     {
         fprintf(stderr, "Error while submitting queue.\n");
         exit(-1);
     }
+    frame->submission = ++engine->submissions;
+
+    if (engine->headless)
+    {
+        engine->currentFrame =
+            (engine->currentFrame + 1) % engine->framesInFlight;
+        return 1;
+    }
 
     VkPresentInfoKHR presentInfo;
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -2957,31 +10153,164 @@ void drawFrame(struct Engine* engine)
     presentInfo.pImageIndices = &imageIndex;
     presentInfo.pResults = NULL;
 
-    vkQueuePresentKHR(engine->presentQueue, &presentInfo);
+    result = vkQueuePresentKHR(engine->presentQueue, &presentInfo);
+
+    // Recreated at the start of the next frame
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+    {
+        engine->swapChainResized = 1;
+    }
+    else if (result != VK_SUCCESS)
+    {
+        fprintf(stderr, "Swapchain image could not be presented.\n");
+        exit(-1);
+    }
+
+    engine->currentFrame = (engine->currentFrame + 1) % engine->framesInFlight;
+    return 1;
+}
+
+// Copies a rendered offscreen image back to the host and writes it as a
+// binary PPM. The image must be idle and in TRANSFER_SRC_OPTIMAL layout.
+void saveFrame(struct Engine* engine, uint32_t imageIndex, const char* fname)
+{
+    uint32_t width = engine->swapChainExtent.width;
+    uint32_t height = engine->swapChainExtent.height;
+    VkDeviceSize size = (VkDeviceSize)width * height * 4;
+
+    VkBuffer readbackBuffer;
+    struct GpuAllocation readbackBufferMemory;
+    createBuffer(
+        engine,
+        size,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        GPU_MEMORY_READBACK,
+        &readbackBuffer,
+        &readbackBufferMemory
+    );
+
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(engine);
+
+    VkBufferImageCopy region;
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = (VkOffset3D){0, 0, 0};
+    region.imageExtent.width = width;
+    region.imageExtent.height = height;
+    region.imageExtent.depth = 1;
+
+    vkCmdCopyImageToBuffer(
+        commandBuffer,
+        engine->swapChainImages[imageIndex],
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        readbackBuffer,
+        1,
+        &region
+    );
+
+    // Make the copy visible to host reads
+    VkBufferMemoryBarrier barrier;
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.pNext = NULL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = readbackBuffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT,
+        0,
+        0,
+        NULL,
+        1,
+        &barrier,
+        0,
+        NULL
+    );
+
+    endSingleTimeCommands(engine, commandBuffer);
+
+    gpuInvalidate(engine, &readbackBufferMemory);
+    void* data = readbackBufferMemory.mapped;
+
+    FILE* fp = fopen(fname, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s for writing.\n", fname);
+    }
+    else
+    {
+        // PPM has no alpha channel, drop every fourth byte
+        fprintf(fp, "P6\n%u %u\n255\n", width, height);
+
+        const unsigned char* pixels = data;
+        unsigned char* row = malloc(width * 3);
+        uint32_t x, y;
+        for (y=0; y<height; y++)
+        {
+            for (x=0; x<width; x++)
+            {
+                const unsigned char* texel = pixels + (y * width + x) * 4;
+                row[x*3 + 0] = texel[0];
+                row[x*3 + 1] = texel[1];
+                row[x*3 + 2] = texel[2];
+            }
+            fwrite(row, width * 3, 1, fp);
+        }
+        free(row);
+
+        fclose(fp);
+    }
+
+    vkDestroyBuffer(engine->device, readbackBuffer, NULL);
+    gpuFree(engine, &readbackBufferMemory);
 }
 
+// Doesn't wait for the device. The old swapchain is handed to the new one
+// as oldSwapchain and its resources are retired, frames already in flight
+// keep rendering to them until releaseRetiredSwapChains frees them.
 void recreateSwapChain(struct Engine* engine)
 {
-    vkDeviceWaitIdle(engine->device);
+    // Minimised, keep the resize pending until the window has a size again
+    int width = 0;
+    int height = 0;
+    glfwGetFramebufferSize(engine->window, &width, &height);
+    if (width == 0 || height == 0)
+        return;
+    engine->swapChainResized = 0;
 
-    // Swapchain deletion is handled in createSwapChain
+    struct RetiredSwapChain* retired = retireSwapChain(engine);
+    VkFormat oldFormat = engine->swapChainImageFormat;
     createSwapChain(engine);
-
-    destroyImageViews(engine);
     createImageViews(engine);
 
-    destroyRenderPass(engine);
-    createRenderPass(engine);
+    // Viewport and scissor are dynamic, so the render pass and pipeline only
+    // depend on the attachment formats. The depth format never changes.
+    // Frames skip their draws until the compiler has the new pipeline.
+    if (engine->swapChainImageFormat != oldFormat)
+    {
+        retired->renderPass = engine->renderPass;
+        createRenderPass(engine);
 
-    destroyGraphicsPipeline(engine);
-    createGraphicsPipeline(engine);
+        retirePipeline(engine, engine->graphicsPipeline);
+        engine->graphicsPipeline = VK_NULL_HANDLE;
+        requestGraphicsPipeline(
+            engine,
+            graphicsFragShader(engine),
+            &(engine->graphicsPipeline)
+        );
+    }
 
-    destroyDepthResources(engine);
     createDepthResources(engine);
-
-    destroyFramebuffers(engine);
     createFramebuffers(engine);
-
-    freeCommandBuffers(engine);
-    createCommandBuffers(engine);
 }
@@ -0,0 +1,65 @@
+// Asset pack layout shared by the engine's loader and the offline packer
+// (tools/pack.c). A pack holds many asset files in one, so loading them
+// costs a single open and mmap instead of one per file.
+//
+// File layout: header, entry table, hash buckets, name table, then every
+// entry's payload aligned to the header's alignment. Assets are found by the
+// hash of their path: buckets is an open addressing table of entry indices
+// plus one (0 marks an empty bucket), probed linearly from
+// hash & (bucketCount - 1). All values are little-endian.
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+#define PACK_MAGIC "VKPACK\0\0"
+#define PACK_MAGIC_SIZE 8
+#define PACK_VERSION 1
+
+// Payloads are stored as-is or as a single LZ4 block
+#define PACK_COMPRESSION_NONE 0
+#define PACK_COMPRESSION_LZ4 1
+
+struct PackHeader
+{
+    uint8_t magic[PACK_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t entryCount;
+    // Power of two, at least twice entryCount
+    uint32_t bucketCount;
+    uint32_t alignment;
+
+    uint64_t entryOffset;
+    uint64_t bucketOffset;
+    uint64_t nameOffset;
+    uint64_t nameSize;
+};
+
+struct PackEntry
+{
+    uint64_t hash;
+    uint64_t offset;
+    // Stored bytes, compressed when compression isn't NONE
+    uint64_t size;
+    uint64_t uncompressedSize;
+    uint32_t compression;
+    // Nul-terminated path relative to the engine's working directory
+    uint32_t nameOffset;
+};
+
+_Static_assert(sizeof(struct PackHeader) == 56, "PackHeader must be 56 bytes");
+_Static_assert(sizeof(struct PackEntry) == 40, "PackEntry must be 40 bytes");
+
+// 64 bit FNV-1a of an asset's path
+static inline uint64_t packHash(const char* name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (; *name; name++)
+    {
+        hash ^= (uint8_t)*name;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+#endif
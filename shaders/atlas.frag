@@ -0,0 +1,23 @@
+#version 450
+#extension GL_ARB_seperate_shader_objects : enable
+
+// Every texture is a rectangle in a layer of one array image
+layout(binding = 1) uniform sampler2DArray texSampler;
+
+// Where the draw's texture sits, scale in xy and offset in zw
+layout(push_constant) uniform DrawConstants {
+    vec4 uvTransform;
+    uint layer;
+} draw;
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+    // Repeating would run into the neighbouring textures
+    vec2 uv = clamp(fragTexCoord, 0.0, 1.0);
+    uv = uv * draw.uvTransform.xy + draw.uvTransform.zw;
+    outColor = texture(texSampler, vec3(uv, float(draw.layer)));
+}
@@ -0,0 +1,25 @@
+#version 450
+#extension GL_ARB_seperate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : require
+
+// The texture table, every texture of the session in one set
+layout(set = 1, binding = 0) uniform sampler texSampler;
+layout(set = 1, binding = 1) uniform texture2D textures[];
+
+// Which texture of the table the draw's material uses
+layout(push_constant) uniform Material {
+    uint textureIndex;
+} material;
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+    // The index is the same for the whole draw, it needs no nonuniformEXT
+    outColor = texture(
+        sampler2D(textures[material.textureIndex], texSampler),
+        fragTexCoord
+    );
+}
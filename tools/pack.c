@@ -0,0 +1,357 @@
+// Offline asset packer. Writes files into a single asset pack the engine
+// maps at startup and serves assets from instead of loose files. Entries are
+// named by the paths given on the command line.
+//
+// Usage: pack [-c] [-a alignment] output.pack file...
+//   -c  LZ4 compress entries that shrink by at least an eighth
+//   -a  payload alignment in bytes, a power of two of at least 4 (default
+//       16) so SPIR-V words stay aligned
+
+#include "pack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// LZ4 block format limits: matches are at least 4 bytes and at most 64KiB
+// back, the last 5 bytes are always literals and the last match starts at
+// least 12 bytes before the end
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_FINISH 12
+#define LZ4_HASH_BITS 16
+
+struct InputFile
+{
+    const char* name;
+    unsigned char* data;
+    size_t size;
+    unsigned char* stored;
+    size_t storedSize;
+    uint32_t compression;
+    uint64_t offset;
+    uint32_t nameOffset;
+};
+
+static void printUsage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [-c] [-a alignment] output.pack file...\n",
+        program
+    );
+}
+
+static unsigned char* readWholeFile(const char* fname, size_t* size)
+{
+    FILE* fp = fopen(fname, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to load file %s.\n", fname);
+        exit(-1);
+    }
+
+    fseek(fp, 0L, SEEK_END);
+    long length = ftell(fp);
+    rewind(fp);
+    if (length < 0)
+    {
+        fprintf(stderr, "Failed to read file %s.\n", fname);
+        exit(-1);
+    }
+
+    unsigned char* data = malloc(length > 0 ? (size_t)length : 1);
+    if (fread(data, 1, (size_t)length, fp) != (size_t)length)
+    {
+        fprintf(stderr, "Failed to read file %s.\n", fname);
+        exit(-1);
+    }
+    fclose(fp);
+
+    *size = (size_t)length;
+    return data;
+}
+
+// LZ4 writes lengths of 15 and over as 15 in the token followed by 255s
+// and a final byte holding the remainder
+static unsigned char* writeLength(unsigned char* out, size_t length)
+{
+    length -= 15;
+    while (length >= 255)
+    {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+static unsigned char* writeSequence(unsigned char* out, const unsigned char* literals, size_t literalLength, size_t offset, size_t matchLength)
+{
+    unsigned char* token = out++;
+    *token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+    if (literalLength >= 15)
+        out = writeLength(out, literalLength);
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+
+    // The block's last sequence is literals only
+    if (matchLength == 0)
+        return out;
+
+    *out++ = (unsigned char)(offset & 0xFF);
+    *out++ = (unsigned char)(offset >> 8);
+
+    matchLength -= LZ4_MIN_MATCH;
+    *token |= (unsigned char)(matchLength < 15 ? matchLength : 15);
+    if (matchLength >= 15)
+        out = writeLength(out, matchLength);
+    return out;
+}
+
+static uint32_t read32(const unsigned char* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Worst case output of lz4Compress, incompressible input grows slightly
+static size_t lz4CompressBound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+// Greedy LZ4 block compressor with a single-entry hash table, fast and
+// good enough for assets packed once. dst must hold lz4CompressBound(size)
+// bytes. Returns the compressed size.
+static size_t lz4Compress(const unsigned char* src, size_t size, unsigned char* dst)
+{
+    uint32_t* table = calloc(1u << LZ4_HASH_BITS, sizeof(*table));
+    unsigned char* out = dst;
+    size_t anchor = 0;
+    size_t i = 0;
+
+    if (size > LZ4_MATCH_FINISH)
+    {
+        size_t matchEnd = size - LZ4_LAST_LITERALS;
+        while (i + LZ4_MATCH_FINISH < size)
+        {
+            uint32_t sequence = read32(src + i);
+            uint32_t h = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            size_t candidate = table[h];
+            // Positions are stored plus one, 0 is an empty slot
+            table[h] = (uint32_t)(i + 1);
+
+            if (candidate == 0 || i - (candidate - 1) > LZ4_MAX_OFFSET ||
+                read32(src + candidate - 1) != sequence)
+            {
+                i++;
+                continue;
+            }
+
+            size_t match = candidate - 1;
+            size_t length = LZ4_MIN_MATCH;
+            while (i + length < matchEnd && src[match + length] == src[i + length])
+                length++;
+
+            out = writeSequence(out, src + anchor, i - anchor, i - match, length);
+            i += length;
+            anchor = i;
+        }
+    }
+
+    out = writeSequence(out, src + anchor, size - anchor, 0, 0);
+
+    free(table);
+    return (size_t)(out - dst);
+}
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+int main(int argc, char** argv)
+{
+    _Bool compress = 0;
+    uint32_t alignment = 16;
+    const char* output = NULL;
+    struct InputFile* files = calloc(argc, sizeof(*files));
+    uint32_t fileCount = 0;
+
+    int i;
+    for (i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0)
+        {
+            compress = 1;
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i+1 < argc)
+        {
+            alignment = (uint32_t)atoi(argv[++i]);
+            if (alignment < 4 || (alignment & (alignment - 1)) != 0)
+            {
+                fprintf(stderr, "Alignment must be a power of two of at least 4.\n");
+                exit(-1);
+            }
+        }
+        else if (!output)
+        {
+            output = argv[i];
+        }
+        else
+        {
+            files[fileCount++].name = argv[i];
+        }
+    }
+
+    if (!output || fileCount == 0)
+    {
+        printUsage(argv[0]);
+        exit(-1);
+    }
+
+    uint32_t bucketCount = 1;
+    while (bucketCount < fileCount * 2)
+        bucketCount *= 2;
+    uint32_t* buckets = calloc(bucketCount, sizeof(*buckets));
+
+    // Hash every name into its bucket, rejecting duplicates
+    uint64_t nameSize = 0;
+    uint32_t f;
+    for (f=0; f<fileCount; f++)
+    {
+        struct InputFile* file = &(files[f]);
+        uint64_t hash = packHash(file->name);
+        uint32_t bucket = (uint32_t)hash & (bucketCount - 1);
+        while (buckets[bucket] != 0)
+        {
+            if (strcmp(files[buckets[bucket] - 1].name, file->name) == 0)
+            {
+                fprintf(stderr, "%s is listed more than once.\n", file->name);
+                exit(-1);
+            }
+            bucket = (bucket + 1) & (bucketCount - 1);
+        }
+        buckets[bucket] = f + 1;
+
+        file->nameOffset = (uint32_t)nameSize;
+        nameSize += strlen(file->name) + 1;
+    }
+
+    struct PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_SIZE);
+    header.version = PACK_VERSION;
+    header.entryCount = fileCount;
+    header.bucketCount = bucketCount;
+    header.alignment = alignment;
+    header.entryOffset = sizeof(header);
+    header.bucketOffset = header.entryOffset +
+        (uint64_t)fileCount * sizeof(struct PackEntry);
+    header.nameOffset = header.bucketOffset +
+        (uint64_t)bucketCount * sizeof(uint32_t);
+    header.nameSize = nameSize;
+
+    uint64_t offset = header.nameOffset + nameSize;
+    size_t totalSize = 0;
+    size_t totalStored = 0;
+    for (f=0; f<fileCount; f++)
+    {
+        struct InputFile* file = &(files[f]);
+        file->data = readWholeFile(file->name, &(file->size));
+        file->stored = file->data;
+        file->storedSize = file->size;
+        file->compression = PACK_COMPRESSION_NONE;
+
+        // Already compressed formats (JPEG, PNG) rarely shrink enough to be
+        // worth decompressing at load time
+        if (compress && file->size > 0)
+        {
+            unsigned char* compressed = malloc(lz4CompressBound(file->size));
+            size_t compressedSize = lz4Compress(file->data, file->size, compressed);
+            if (compressedSize <= file->size - file->size / 8)
+            {
+                file->stored = compressed;
+                file->storedSize = compressedSize;
+                file->compression = PACK_COMPRESSION_LZ4;
+            }
+            else
+            {
+                free(compressed);
+            }
+        }
+
+        offset = alignUp(offset, alignment);
+        file->offset = offset;
+        offset += file->storedSize;
+
+        totalSize += file->size;
+        totalStored += file->storedSize;
+    }
+
+    FILE* fp = fopen(output, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s for writing.\n", output);
+        exit(-1);
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    for (f=0; f<fileCount; f++)
+    {
+        struct PackEntry entry;
+        entry.hash = packHash(files[f].name);
+        entry.offset = files[f].offset;
+        entry.size = files[f].storedSize;
+        entry.uncompressedSize = files[f].size;
+        entry.compression = files[f].compression;
+        entry.nameOffset = files[f].nameOffset;
+        fwrite(&entry, sizeof(entry), 1, fp);
+    }
+    fwrite(buckets, sizeof(*buckets), bucketCount, fp);
+    for (f=0; f<fileCount; f++)
+        fwrite(files[f].name, 1, strlen(files[f].name) + 1, fp);
+
+    uint64_t written = header.nameOffset + nameSize;
+    static const unsigned char padding[4096];
+    for (f=0; f<fileCount; f++)
+    {
+        struct InputFile* file = &(files[f]);
+        while (written < file->offset)
+        {
+            uint64_t count = file->offset - written;
+            if (count > sizeof(padding))
+                count = sizeof(padding);
+            fwrite(padding, 1, (size_t)count, fp);
+            written += count;
+        }
+        fwrite(file->stored, 1, file->storedSize, fp);
+        written += file->storedSize;
+
+        if (file->stored != file->data)
+            free(file->stored);
+        free(file->data);
+    }
+
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "Failed to write %s.\n", output);
+        exit(-1);
+    }
+
+    printf(
+        "%s: %u files, %zu bytes stored as %zu\n",
+        output,
+        fileCount,
+        totalSize,
+        totalStored
+    );
+
+    free(buckets);
+    free(files);
+    return 0;
+}
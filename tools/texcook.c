@@ -0,0 +1,620 @@
+// Offline texture cooker. Encodes a source image to a block-compressed
+// format with a full mip chain and writes it as a KTX2 file the engine can
+// upload without decoding.
+//
+// Usage: texcook [-f bc1|bc3|bc7] input.(jpeg|png|...) output.ktx2
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "ktx2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Khronos data format descriptor color models of the block formats
+#define KHR_DF_MODEL_BC1A 128
+#define KHR_DF_MODEL_BC3 130
+#define KHR_DF_MODEL_BC7 134
+
+enum BlockFormat
+{
+    FORMAT_BC1,
+    FORMAT_BC3,
+    FORMAT_BC7
+};
+
+struct FormatInfo
+{
+    const char* name;
+    uint32_t vkFormat;
+    uint32_t blockBytes;
+    uint32_t colorModel;
+};
+
+static const struct FormatInfo formats[] = {
+    [FORMAT_BC1] = { "bc1", KTX2_FORMAT_BC1_RGB_UNORM, 8, KHR_DF_MODEL_BC1A },
+    [FORMAT_BC3] = { "bc3", KTX2_FORMAT_BC3_UNORM, 16, KHR_DF_MODEL_BC3 },
+    [FORMAT_BC7] = { "bc7", KTX2_FORMAT_BC7_UNORM, 16, KHR_DF_MODEL_BC7 }
+};
+
+struct MipLevel
+{
+    uint32_t width;
+    uint32_t height;
+    unsigned char* pixels;
+    unsigned char* blocks;
+    size_t blocksSize;
+};
+
+uint32_t min(uint32_t a, uint32_t b)
+{
+    return (a < b ? a : b);
+}
+uint32_t max(uint32_t a, uint32_t b)
+{
+    return (a > b ? a : b);
+}
+
+/*  -----------------------------
+ *  ------ Mip generation -------
+ *  -----------------------------   */
+// Halves an RGBA8 image with a 2x2 box filter, odd edges repeat their last
+// texel. Same filter as the engine's CPU fallback.
+void downsample(const struct MipLevel* src, struct MipLevel* dst)
+{
+    dst->width = max(src->width / 2, 1);
+    dst->height = max(src->height / 2, 1);
+    dst->pixels = malloc((size_t)dst->width * dst->height * 4);
+
+    uint32_t x, y, c;
+    for (y=0; y<dst->height; y++)
+    {
+        uint32_t y0 = min(y * 2, src->height - 1);
+        uint32_t y1 = min(y * 2 + 1, src->height - 1);
+        for (x=0; x<dst->width; x++)
+        {
+            uint32_t x0 = min(x * 2, src->width - 1);
+            uint32_t x1 = min(x * 2 + 1, src->width - 1);
+            for (c=0; c<4; c++)
+            {
+                uint32_t sum = src->pixels[(y0 * src->width + x0) * 4 + c] +
+                    src->pixels[(y0 * src->width + x1) * 4 + c] +
+                    src->pixels[(y1 * src->width + x0) * 4 + c] +
+                    src->pixels[(y1 * src->width + x1) * 4 + c];
+                dst->pixels[(y * dst->width + x) * 4 + c] =
+                    (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+/*  -----------------------------
+ *  ------ Block encoders -------
+ *  -----------------------------   */
+// Bounding box of the block's texels per channel
+void blockBounds(unsigned char texels[16][4], unsigned char lo[4], unsigned char hi[4])
+{
+    uint32_t i, c;
+    for (c=0; c<4; c++)
+    {
+        lo[c] = 255;
+        hi[c] = 0;
+    }
+    for (i=0; i<16; i++)
+    {
+        for (c=0; c<4; c++)
+        {
+            if (texels[i][c] < lo[c])
+                lo[c] = texels[i][c];
+            if (texels[i][c] > hi[c])
+                hi[c] = texels[i][c];
+        }
+    }
+}
+
+uint32_t colorDistance(const unsigned char* a, const unsigned char* b, uint32_t channels)
+{
+    uint32_t distance = 0;
+    uint32_t c;
+    for (c=0; c<channels; c++)
+    {
+        int d = (int)a[c] - (int)b[c];
+        distance += d * d;
+    }
+    return distance;
+}
+
+uint16_t packRgb565(const unsigned char* color)
+{
+    return (uint16_t)(((color[0] * 31 + 127) / 255) << 11 |
+        ((color[1] * 63 + 127) / 255) << 5 |
+        ((color[2] * 31 + 127) / 255));
+}
+
+void unpackRgb565(uint16_t packed, unsigned char* color)
+{
+    uint32_t r = (packed >> 11) & 31;
+    uint32_t g = (packed >> 5) & 63;
+    uint32_t b = packed & 31;
+    color[0] = (unsigned char)((r << 3) | (r >> 2));
+    color[1] = (unsigned char)((g << 2) | (g >> 4));
+    color[2] = (unsigned char)((b << 3) | (b >> 2));
+}
+
+// Opaque four-color block: endpoints from the inset bounding box, each
+// texel takes the nearest of the four palette entries
+void encodeBc1(unsigned char texels[16][4], unsigned char* out)
+{
+    unsigned char lo[4], hi[4];
+    blockBounds(texels, lo, hi);
+
+    // Insetting by 1/16 of the range reduces the error of the extremes
+    uint32_t c;
+    for (c=0; c<3; c++)
+    {
+        uint32_t inset = (hi[c] - lo[c]) / 16;
+        lo[c] = (unsigned char)(lo[c] + inset);
+        hi[c] = (unsigned char)(hi[c] - inset);
+    }
+
+    uint16_t color0 = packRgb565(hi);
+    uint16_t color1 = packRgb565(lo);
+    // color0 > color1 selects four-color mode
+    if (color0 < color1)
+    {
+        uint16_t swap = color0;
+        color0 = color1;
+        color1 = swap;
+    }
+
+    unsigned char palette[4][3];
+    unpackRgb565(color0, palette[0]);
+    unpackRgb565(color1, palette[1]);
+    for (c=0; c<3; c++)
+    {
+        palette[2][c] = (unsigned char)((2 * palette[0][c] + palette[1][c] + 1) / 3);
+        palette[3][c] = (unsigned char)((palette[0][c] + 2 * palette[1][c] + 1) / 3);
+    }
+
+    uint32_t indices = 0;
+    uint32_t i, j;
+    if (color0 != color1)
+    {
+        for (i=0; i<16; i++)
+        {
+            uint32_t best = 0;
+            uint32_t bestDistance = UINT32_MAX;
+            for (j=0; j<4; j++)
+            {
+                uint32_t distance = colorDistance(texels[i], palette[j], 3);
+                if (distance < bestDistance)
+                {
+                    best = j;
+                    bestDistance = distance;
+                }
+            }
+            indices |= best << (i * 2);
+        }
+    }
+
+    out[0] = color0 & 0xFF;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xFF;
+    out[3] = color1 >> 8;
+    out[4] = indices & 0xFF;
+    out[5] = (indices >> 8) & 0xFF;
+    out[6] = (indices >> 16) & 0xFF;
+    out[7] = (indices >> 24) & 0xFF;
+}
+
+// BC4-style alpha block followed by a BC1 color block. The color block of
+// BC3 always decodes in four-color mode.
+void encodeBc3(unsigned char texels[16][4], unsigned char* out)
+{
+    unsigned char lo[4], hi[4];
+    blockBounds(texels, lo, hi);
+
+    // alpha0 > alpha1 selects the eight-value interpolated mode
+    unsigned char alpha[8];
+    alpha[0] = hi[3];
+    alpha[1] = lo[3];
+    uint32_t i, j;
+    for (i=1; i<7; i++)
+        alpha[i+1] = (unsigned char)(((7 - i) * alpha[0] + i * alpha[1] + 3) / 7);
+
+    uint64_t indices = 0;
+    if (alpha[0] != alpha[1])
+    {
+        for (i=0; i<16; i++)
+        {
+            uint32_t best = 0;
+            uint32_t bestDistance = UINT32_MAX;
+            for (j=0; j<8; j++)
+            {
+                uint32_t distance = colorDistance(&(texels[i][3]), &(alpha[j]), 1);
+                if (distance < bestDistance)
+                {
+                    best = j;
+                    bestDistance = distance;
+                }
+            }
+            indices |= (uint64_t)best << (i * 3);
+        }
+    }
+
+    out[0] = alpha[0];
+    out[1] = alpha[1];
+    for (i=0; i<6; i++)
+        out[2 + i] = (indices >> (i * 8)) & 0xFF;
+
+    encodeBc1(texels, out + 8);
+}
+
+void putBits(unsigned char* block, uint32_t* position, uint32_t value, uint32_t count)
+{
+    uint32_t i;
+    for (i=0; i<count; i++)
+    {
+        if (value & (1u << i))
+            block[*position / 8] |= (unsigned char)(1u << (*position % 8));
+        (*position)++;
+    }
+}
+
+// Mode 6: one subset, 7-bit RGBA endpoints with a p-bit each and 4-bit
+// indices. The best single-subset mode for opaque and alpha content alike.
+void encodeBc7(unsigned char texels[16][4], unsigned char* out)
+{
+    static const uint32_t weights[16] = {
+        0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+    };
+
+    unsigned char bounds[2][4];
+    blockBounds(texels, bounds[0], bounds[1]);
+
+    // Quantize each endpoint to 7 bits plus the p-bit that fits it best
+    uint32_t endpoints[2][4];
+    uint32_t pbits[2];
+    unsigned char expanded[2][4];
+    uint32_t e, c, p;
+    for (e=0; e<2; e++)
+    {
+        uint32_t bestError = UINT32_MAX;
+        for (p=0; p<2; p++)
+        {
+            uint32_t values[4];
+            uint32_t error = 0;
+            for (c=0; c<4; c++)
+            {
+                int v = ((int)bounds[e][c] - (int)p + 1) / 2;
+                if (v > 127)
+                    v = 127;
+                values[c] = (uint32_t)v;
+                int d = (int)((values[c] << 1) | p) - (int)bounds[e][c];
+                error += d * d;
+            }
+            if (error < bestError)
+            {
+                bestError = error;
+                pbits[e] = p;
+                memcpy(endpoints[e], values, sizeof(values));
+            }
+        }
+        for (c=0; c<4; c++)
+            expanded[e][c] = (unsigned char)((endpoints[e][c] << 1) | pbits[e]);
+    }
+
+    unsigned char palette[16][4];
+    uint32_t i, j;
+    for (i=0; i<16; i++)
+    {
+        for (c=0; c<4; c++)
+        {
+            palette[i][c] = (unsigned char)(((64 - weights[i]) * expanded[0][c] +
+                weights[i] * expanded[1][c] + 32) >> 6);
+        }
+    }
+
+    uint32_t indices[16];
+    for (i=0; i<16; i++)
+    {
+        uint32_t bestDistance = UINT32_MAX;
+        for (j=0; j<16; j++)
+        {
+            uint32_t distance = colorDistance(texels[i], palette[j], 4);
+            if (distance < bestDistance)
+            {
+                indices[i] = j;
+                bestDistance = distance;
+            }
+        }
+    }
+
+    // The first texel's index is stored without its top bit, so it has to
+    // be below 8. Swapping the endpoints mirrors every index.
+    if (indices[0] >= 8)
+    {
+        for (c=0; c<4; c++)
+        {
+            uint32_t swap = endpoints[0][c];
+            endpoints[0][c] = endpoints[1][c];
+            endpoints[1][c] = swap;
+        }
+        uint32_t swap = pbits[0];
+        pbits[0] = pbits[1];
+        pbits[1] = swap;
+        for (i=0; i<16; i++)
+            indices[i] = 15 - indices[i];
+    }
+
+    memset(out, 0, 16);
+    uint32_t position = 0;
+    putBits(out, &position, 1 << 6, 7);
+    for (c=0; c<4; c++)
+    {
+        putBits(out, &position, endpoints[0][c], 7);
+        putBits(out, &position, endpoints[1][c], 7);
+    }
+    putBits(out, &position, pbits[0], 1);
+    putBits(out, &position, pbits[1], 1);
+    for (i=0; i<16; i++)
+        putBits(out, &position, indices[i], i == 0 ? 3 : 4);
+}
+
+// Encodes a level block by block, blocks past the edge repeat the last
+// row/column
+void encodeLevel(struct MipLevel* level, enum BlockFormat format)
+{
+    uint32_t blocksWide = (level->width + 3) / 4;
+    uint32_t blocksHigh = (level->height + 3) / 4;
+    uint32_t blockBytes = formats[format].blockBytes;
+
+    level->blocksSize = (size_t)blocksWide * blocksHigh * blockBytes;
+    level->blocks = malloc(level->blocksSize);
+
+    uint32_t bx, by, x, y;
+    for (by=0; by<blocksHigh; by++)
+    {
+        for (bx=0; bx<blocksWide; bx++)
+        {
+            unsigned char texels[16][4];
+            for (y=0; y<4; y++)
+            {
+                for (x=0; x<4; x++)
+                {
+                    uint32_t sx = min(bx * 4 + x, level->width - 1);
+                    uint32_t sy = min(by * 4 + y, level->height - 1);
+                    memcpy(
+                        texels[y * 4 + x],
+                        level->pixels + (sy * level->width + sx) * 4,
+                        4
+                    );
+                }
+            }
+
+            unsigned char* out = level->blocks +
+                ((size_t)by * blocksWide + bx) * blockBytes;
+            switch (format)
+            {
+                case FORMAT_BC1:
+                    encodeBc1(texels, out);
+                    break;
+                case FORMAT_BC3:
+                    encodeBc3(texels, out);
+                    break;
+                case FORMAT_BC7:
+                    encodeBc7(texels, out);
+                    break;
+            }
+        }
+    }
+}
+
+/*  -----------------------------
+ *  -------- KTX2 output --------
+ *  -----------------------------   */
+// Basic data format descriptor for a 4x4 block format. BC3 describes its
+// alpha and color halves as separate samples.
+uint32_t buildDfd(enum BlockFormat format, uint32_t* dfd)
+{
+    uint32_t sampleCount = format == FORMAT_BC3 ? 2 : 1;
+    uint32_t blockSize = 24 + 16 * sampleCount;
+
+    dfd[0] = 4 + blockSize;
+    // vendorId 0, descriptorType 0
+    dfd[1] = 0;
+    // versionNumber 2, descriptorBlockSize
+    dfd[2] = 2 | (blockSize << 16);
+    // colorModel, BT.709 primaries, linear transfer, no flags
+    dfd[3] = formats[format].colorModel | (1 << 8) | (1 << 16);
+    // texelBlockDimension minus one
+    dfd[4] = 3 | (3 << 8);
+    dfd[5] = formats[format].blockBytes;
+    dfd[6] = 0;
+
+    uint32_t* sample = &(dfd[7]);
+    if (format == FORMAT_BC3)
+    {
+        // Alpha channel (15) in the first 64 bits
+        sample[0] = 0 | (63 << 16) | (15u << 24);
+        sample[1] = 0;
+        sample[2] = 0;
+        sample[3] = UINT32_MAX;
+        sample += 4;
+
+        sample[0] = 64 | (63 << 16);
+    }
+    else
+    {
+        sample[0] = (formats[format].blockBytes * 8 - 1) << 16;
+    }
+    sample[1] = 0;
+    sample[2] = 0;
+    sample[3] = UINT32_MAX;
+
+    return dfd[0];
+}
+
+void writeKtx2(const char* fname, enum BlockFormat format, struct MipLevel* levels, uint32_t levelCount)
+{
+    uint32_t dfd[16];
+    uint32_t dfdSize = buildDfd(format, dfd);
+
+    struct Ktx2Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.identifier, KTX2_IDENTIFIER, KTX2_IDENTIFIER_SIZE);
+    header.vkFormat = formats[format].vkFormat;
+    header.typeSize = 1;
+    header.pixelWidth = levels[0].width;
+    header.pixelHeight = levels[0].height;
+    header.pixelDepth = 0;
+    header.layerCount = 0;
+    header.faceCount = 1;
+    header.levelCount = levelCount;
+    header.supercompressionScheme = 0;
+    header.dfdByteOffset = sizeof(header) + levelCount * sizeof(struct Ktx2LevelIndex);
+    header.dfdByteLength = dfdSize;
+
+    // Level data follows the DFD, smallest level first, each aligned to
+    // the block size
+    struct Ktx2LevelIndex* index = calloc(levelCount, sizeof(*index));
+    uint64_t offset = header.dfdByteOffset + dfdSize;
+    uint32_t alignment = formats[format].blockBytes;
+    uint32_t i;
+    for (i=levelCount; i-- > 0;)
+    {
+        offset = (offset + alignment - 1) / alignment * alignment;
+        index[i].byteOffset = offset;
+        index[i].byteLength = levels[i].blocksSize;
+        index[i].uncompressedByteLength = levels[i].blocksSize;
+        offset += levels[i].blocksSize;
+    }
+
+    FILE* fp = fopen(fname, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s for writing.\n", fname);
+        exit(-1);
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(index, sizeof(*index), levelCount, fp);
+    fwrite(dfd, dfdSize, 1, fp);
+
+    static const unsigned char padding[16] = {0};
+    for (i=levelCount; i-- > 0;)
+    {
+        long position = ftell(fp);
+        fwrite(padding, (size_t)(index[i].byteOffset - position), 1, fp);
+        fwrite(levels[i].blocks, levels[i].blocksSize, 1, fp);
+    }
+
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "Failed to write %s.\n", fname);
+        exit(-1);
+    }
+
+    free(index);
+}
+
+static void printUsage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [-f bc1|bc3|bc7] input output.ktx2\n",
+        program
+    );
+}
+
+int main(int argc, char** argv)
+{
+    enum BlockFormat format = FORMAT_BC7;
+    const char* input = NULL;
+    const char* output = NULL;
+
+    int i;
+    for (i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0 && i+1 < argc)
+        {
+            const char* name = argv[++i];
+            uint32_t f;
+            for (f=0; f<sizeof(formats)/sizeof(formats[0]); f++)
+            {
+                if (strcmp(name, formats[f].name) == 0)
+                    break;
+            }
+            if (f == sizeof(formats)/sizeof(formats[0]))
+            {
+                fprintf(stderr, "Unknown format %s.\n", name);
+                exit(-1);
+            }
+            format = (enum BlockFormat)f;
+        }
+        else if (!input)
+        {
+            input = argv[i];
+        }
+        else if (!output)
+        {
+            output = argv[i];
+        }
+        else
+        {
+            printUsage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (!input || !output)
+    {
+        printUsage(argv[0]);
+        exit(-1);
+    }
+
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load(input, &width, &height, &channels, STBI_rgb_alpha);
+    if (!pixels)
+    {
+        fprintf(stderr, "stb_image failed to load resource %s\n", input);
+        exit(-1);
+    }
+
+    uint32_t levelCount = 1;
+    uint32_t size = max(width, height);
+    while (size > 1)
+    {
+        size /= 2;
+        levelCount++;
+    }
+
+    struct MipLevel* levels = calloc(levelCount, sizeof(*levels));
+    levels[0].width = width;
+    levels[0].height = height;
+    levels[0].pixels = pixels;
+
+    uint32_t level;
+    for (level=0; level<levelCount; level++)
+    {
+        if (level > 0)
+            downsample(&(levels[level-1]), &(levels[level]));
+        encodeLevel(&(levels[level]), format);
+    }
+
+    writeKtx2(output, format, levels, levelCount);
+
+    stbi_image_free(levels[0].pixels);
+    for (level=0; level<levelCount; level++)
+    {
+        if (level > 0)
+            free(levels[level].pixels);
+        free(levels[level].blocks);
+    }
+    free(levels);
+
+    return 0;
+}